@@ -0,0 +1,140 @@
+// Micro-benchmark for vsfs_bitmap.h: checks the word/AVX2 searches against
+// the old bit-at-a-time loop, then times them on empty, full and fragmented
+// bitmaps.
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_bitmap.c -o bench_bitmap
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "vsfs_bitmap.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What find_free_inode()/find_free_data_block() used to do.
+static uint64_t find_zero_naive(const uint8_t *bm, uint64_t nbits) {
+    for (uint64_t i = 0; i < nbits; i++) {
+        uint64_t byte_idx = i / 8;
+        uint64_t bit_idx = i % 8;
+        if (!(bm[byte_idx] & (1 << bit_idx))) {
+            return i;
+        }
+    }
+    return VSFS_BITMAP_NONE;
+}
+
+static uint64_t find_zero_run_naive(const uint8_t *bm, uint64_t nbits, uint64_t len) {
+    uint64_t run = 0;
+    for (uint64_t i = 0; i < nbits; i++) {
+        run = vsfs_bitmap_test(bm, i) ? 0 : run + 1;
+        if (run == len) {
+            return i + 1 - len;
+        }
+    }
+    return VSFS_BITMAP_NONE;
+}
+
+static int check(uint8_t *bm, uint64_t nbits) {
+    for (uint64_t start = 0; start < 200 && start < nbits; start += 7) {
+        uint64_t want = VSFS_BITMAP_NONE;
+        for (uint64_t i = start; i < nbits; i++) {
+            if (!vsfs_bitmap_test(bm, i)) {
+                want = i;
+                break;
+            }
+        }
+        if (vsfs_bitmap_find_zero(bm, nbits, start) != want) {
+            fprintf(stderr, "Error: find_zero mismatch (nbits=%llu start=%llu)\n",
+                    (unsigned long long)nbits, (unsigned long long)start);
+            return -1;
+        }
+    }
+    for (uint64_t len = 1; len <= 40; len++) {
+        if (vsfs_bitmap_find_zero_run(bm, nbits, 0, len) != find_zero_run_naive(bm, nbits, len)) {
+            fprintf(stderr, "Error: find_zero_run mismatch (nbits=%llu len=%llu)\n",
+                    (unsigned long long)nbits, (unsigned long long)len);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    uint8_t *bm;
+} scenario_t;
+
+int main(int argc, char *argv[]) {
+    uint64_t nbits = argc > 1 ? strtoull(argv[1], NULL, 10) : 4096 * 8 * 64;   // 64 bitmap blocks
+    size_t nbytes = (size_t)((nbits + 7) / 8);
+    srand(42);
+
+    // correctness on odd sizes and random fill levels
+    for (int round = 0; round < 300; round++) {
+        uint64_t n = 1 + (uint64_t)(rand() % 3000);
+        uint8_t *bm = malloc((size_t)((n + 7) / 8));
+        int density = rand() % 101;
+        for (uint64_t i = 0; i < (n + 7) / 8; i++) bm[i] = 0;
+        for (uint64_t i = 0; i < n; i++) {
+            if (rand() % 100 < density) vsfs_bitmap_set(bm, i);
+        }
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1) vsfs_bitmap_init();
+            if (check(bm, n) != 0) return 1;
+        }
+        vsfs_bitmap_skip_full = vsfs_bitmap_skip_full_scalar;
+        free(bm);
+    }
+    printf("word and AVX2 searches match the bit-at-a-time loop\n");
+
+    // empty: everything free; full: only the very last bit free;
+    // fragmented: 95% allocated at random, with no run longer than a few bits
+    uint8_t *empty = calloc(nbytes, 1);
+    uint8_t *full = malloc(nbytes);
+    uint8_t *frag = malloc(nbytes);
+    memset(full, 0xFF, nbytes);
+    vsfs_bitmap_clear(full, nbits - 1);
+    for (size_t i = 0; i < nbytes; i++) frag[i] = 0xFF;
+    for (uint64_t i = 0; i < nbits / 20; i++) vsfs_bitmap_clear(frag, (uint64_t)rand() % nbits);
+    // push the fragmented free bits past the first half so the scan has work to do
+    memset(frag, 0xFF, nbytes / 2);
+
+    scenario_t scenarios[] = {{"empty", empty}, {"full", full}, {"fragmented", frag}};
+    const char *impls[] = {"naive", "word", "avx2"};
+    printf("%-11s %-6s %14s %14s\n", "bitmap", "impl", "find_zero(ns)", "zero_run8(ns)");
+    for (size_t s = 0; s < 3; s++) {
+        for (int impl = 0; impl < 3; impl++) {
+            vsfs_bitmap_skip_full = vsfs_bitmap_skip_full_scalar;
+            if (impl == 2) {
+                vsfs_bitmap_init();
+                if (vsfs_bitmap_skip_full == vsfs_bitmap_skip_full_scalar) continue; // no AVX2
+            }
+            int iters = 200;
+            volatile uint64_t sink = 0;
+            double t0 = now_sec();
+            for (int i = 0; i < iters; i++) {
+                sink ^= impl == 0 ? find_zero_naive(scenarios[s].bm, nbits)
+                                  : vsfs_bitmap_find_zero(scenarios[s].bm, nbits, 0);
+            }
+            double t1 = now_sec();
+            for (int i = 0; i < iters; i++) {
+                sink ^= impl == 0 ? find_zero_run_naive(scenarios[s].bm, nbits, 8)
+                                  : vsfs_bitmap_find_zero_run(scenarios[s].bm, nbits, 0, 8);
+            }
+            double t2 = now_sec();
+            (void)sink;
+            printf("%-11s %-6s %14.0f %14.0f\n", scenarios[s].name, impls[impl],
+                   (t1 - t0) / iters * 1e9, (t2 - t1) / iters * 1e9);
+        }
+    }
+    free(empty);
+    free(full);
+    free(frag);
+    return 0;
+}
@@ -0,0 +1,443 @@
+// Benchmark suite for libminivsfs: crc32 throughput, bitmap scans on empty,
+// full and fragmented bitmaps, vsfs_format() across image sizes, single and
+// batched vsfs_add() latency and root directory lookups with a full
+// directory. Results go to stdout (or --output) as one JSON document so runs
+// can be compared across releases; progress goes to stderr.
+//
+// Every result is the median and the best of several runs; --quick runs
+// fewer and smaller cases. Images and the files added to them are created
+// in a scratch directory under --dir (default /tmp) and removed afterwards.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_vsfs.c -L. -lminivsfs -pthread -o bench_vsfs
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vsfs.h"
+#include "vsfs_crc32.h"
+#include "vsfs_bitmap.h"
+
+#define MAX_RUNS 9
+#define MAX_RESULTS 64
+#define DIR_ENTRIES 766            // 12 directory blocks of 64 slots, less "." and ".."
+
+typedef struct {
+    const char *bench;
+    char name[48];
+    const char *unit;
+    uint64_t param;
+    const char *param_name;
+    double median;
+    double best;
+    int runs;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static size_t nresults;
+static int runs = 5;
+static int quick;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Record n samples: their median, and the best run (the largest for
+// throughput, the smallest for times).
+static void record(const char *bench, const char *name, const char *param_name, uint64_t param,
+                   const char *unit, double *samples, int n) {
+    if (nresults == MAX_RESULTS) {
+        return;
+    }
+    qsort(samples, (size_t)n, sizeof(double), cmp_double);
+    result_t *r = &results[nresults++];
+    r->bench = bench;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->param_name = param_name;
+    r->param = param;
+    r->unit = unit;
+    r->median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    r->best = strcmp(unit, "GB/s") == 0 ? samples[n - 1] : samples[0];
+    r->runs = n;
+    fprintf(stderr, "%-7s %-26s %s=%-10llu %12.3f %s\n", bench, name, param_name,
+            (unsigned long long)param, r->median, unit);
+}
+
+static int lib_error(const char *what) {
+    fprintf(stderr, "Error: %s: %s\n", what, vsfs_last_error());
+    return -1;
+}
+
+static int write_file(const char *path, size_t len, unsigned seed) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    uint8_t buf[4096];
+    size_t done = 0;
+    while (done < len) {
+        size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        for (size_t i = 0; i < n; i++) buf[i] = (uint8_t)(seed + done + i);
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    return close(fd);
+}
+
+static int bench_crc32(void) {
+    size_t sizes[] = {116, 4092, 65536, 1u << 20};
+    size_t total = (quick ? 16u : 128u) << 20;   // bytes hashed per run
+    uint8_t *buf = malloc(1u << 20);
+    if (!buf) {
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < 1u << 20; i++) buf[i] = (uint8_t)(i * 131 + 7);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        size_t iters = total / len;
+        double samples[MAX_RUNS];
+        for (int r = 0; r < runs; r++) {
+            volatile uint32_t sink = 0;
+            double t0 = now_sec();
+            for (size_t i = 0; i < iters; i++) sink ^= vsfs_crc32(0, buf, len);
+            double dt = now_sec() - t0;
+            (void)sink;
+            samples[r] = (double)iters * len / dt / 1e9;
+        }
+        record("crc32", "vsfs_crc32", "bytes", len, "GB/s", samples, runs);
+    }
+    free(buf);
+    return 0;
+}
+
+static int bench_bitmap(void) {
+    uint64_t nbits = 4096 * 8 * 64;          // 64 bitmap blocks
+    size_t nbytes = (size_t)(nbits / 8);
+    uint8_t *empty = calloc(nbytes, 1);
+    uint8_t *full = malloc(nbytes);
+    uint8_t *frag = malloc(nbytes);
+    if (!empty || !full || !frag) {
+        free(empty);
+        free(full);
+        free(frag);
+        fprintf(stderr, "Error: out of memory\n");
+        return -1;
+    }
+    // the same three shapes as bench_bitmap: everything free, only the last
+    // bit free, and 95% allocated at random in the second half
+    memset(full, 0xFF, nbytes);
+    vsfs_bitmap_clear(full, nbits - 1);
+    memset(frag, 0xFF, nbytes);
+    srand(42);
+    for (uint64_t i = 0; i < nbits / 20; i++) vsfs_bitmap_clear(frag, (uint64_t)rand() % nbits);
+    memset(frag, 0xFF, nbytes / 2);
+
+    struct {
+        const char *name;
+        const uint8_t *bm;
+    } shapes[] = {{"empty", empty}, {"full", full}, {"fragmented", frag}};
+    int iters = quick ? 50 : 200;
+    for (size_t s = 0; s < 3; s++) {
+        double zero[MAX_RUNS], run8[MAX_RUNS];
+        for (int r = 0; r < runs; r++) {
+            volatile uint64_t sink = 0;
+            double t0 = now_sec();
+            for (int i = 0; i < iters; i++) sink ^= vsfs_bitmap_find_zero(shapes[s].bm, nbits, 0);
+            double t1 = now_sec();
+            for (int i = 0; i < iters; i++) sink ^= vsfs_bitmap_find_zero_run(shapes[s].bm, nbits, 0, 8);
+            double t2 = now_sec();
+            (void)sink;
+            zero[r] = (t1 - t0) / iters * 1e9;
+            run8[r] = (t2 - t1) / iters * 1e9;
+        }
+        char name[48];
+        snprintf(name, sizeof(name), "find_zero/%s", shapes[s].name);
+        record("bitmap", name, "bits", nbits, "ns", zero, runs);
+        snprintf(name, sizeof(name), "find_zero_run8/%s", shapes[s].name);
+        record("bitmap", name, "bits", nbits, "ns", run8, runs);
+    }
+    free(empty);
+    free(full);
+    free(frag);
+    return 0;
+}
+
+static int bench_mkfs(void) {
+    uint64_t sizes[] = {1024, 16384, 262144, 1048576};
+    size_t nsizes = quick ? 2 : sizeof(sizes) / sizeof(sizes[0]);
+    for (size_t s = 0; s < nsizes; s++) {
+        vsfs_format_opts_t opts = { sizes[s], 1024, 0 };
+        double samples[MAX_RUNS];
+        for (int r = 0; r < runs; r++) {
+            unlink("mkfs.img");
+            double t0 = now_sec();
+            if (vsfs_format("mkfs.img", &opts, NULL) != 0) {
+                return lib_error("Cannot format image");
+            }
+            samples[r] = (now_sec() - t0) * 1e3;
+        }
+        unlink("mkfs.img");
+        record("mkfs", "vsfs_format", "size_kib", sizes[s], "ms", samples, runs);
+    }
+    return 0;
+}
+
+static vsfs_t *fresh_image(const char *path) {
+    vsfs_format_opts_t opts = { 65536, 1024, 0 };
+    unlink(path);
+    vsfs_t *fs = vsfs_format(path, &opts, NULL) == 0 ? vsfs_open(path, VSFS_RDWR) : NULL;
+    if (!fs) {
+        lib_error("Cannot create image");
+    }
+    return fs;
+}
+
+// Add nfiles files of file_size bytes one vsfs_add() at a time and as one
+// vsfs_add_batch(): the per file latency of the calls, and the time the
+// vsfs_close() that writes everything back takes.
+static int bench_add(char **names, size_t nfiles, size_t file_size) {
+    for (size_t i = 0; i < nfiles; i++) {
+        if (write_file(names[i], file_size, (unsigned)i) != 0) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", names[i], strerror(errno));
+            return -1;
+        }
+    }
+    static const char *modes[] = {"single", "batch"};
+    for (int m = 0; m < 2; m++) {
+        double add_us[MAX_RUNS], close_ms[MAX_RUNS];
+        for (int r = 0; r < runs; r++) {
+            vsfs_t *fs = fresh_image("add.img");
+            if (!fs) {
+                return -1;
+            }
+            double t0 = now_sec();
+            int rc = 0;
+            if (m == 0) {
+                for (size_t i = 0; i < nfiles && rc == 0; i++) rc = vsfs_add(fs, names[i]);
+            } else {
+                rc = vsfs_add_batch(fs, (const char *const *)names, nfiles);
+            }
+            if (rc != 0) {
+                lib_error("Cannot add files");
+                vsfs_close(fs);
+                return -1;
+            }
+            double t1 = now_sec();
+            if (vsfs_close(fs) != 0) {
+                return lib_error("Cannot write back image");
+            }
+            add_us[r] = (t1 - t0) / nfiles * 1e6;
+            close_ms[r] = (now_sec() - t1) * 1e3;
+        }
+        char name[48];
+        snprintf(name, sizeof(name), "%s/%zu_files", modes[m], nfiles);
+        record("add", name, "file_bytes", file_size, "us/file", add_us, runs);
+        snprintf(name, sizeof(name), "%s/%zu_files/close", modes[m], nfiles);
+        record("add", name, "file_bytes", file_size, "ms", close_ms, runs);
+    }
+    unlink("add.img");
+    return 0;
+}
+
+// Look up every name of a full root directory, and as many absent names,
+// on a freshly opened handle (the open itself is timed too).
+static int bench_lookup(char **names) {
+    for (size_t i = 0; i < DIR_ENTRIES; i++) {
+        if (write_file(names[i], 512, (unsigned)i) != 0) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", names[i], strerror(errno));
+            return -1;
+        }
+    }
+    vsfs_t *fs = fresh_image("lookup.img");
+    if (!fs) {
+        return -1;
+    }
+    if (vsfs_add_batch(fs, (const char *const *)names, DIR_ENTRIES) != 0) {
+        lib_error("Cannot add files");
+        vsfs_close(fs);
+        return -1;
+    }
+    if (vsfs_close(fs) != 0) {
+        return lib_error("Cannot write back image");
+    }
+    int rounds = quick ? 20 : 200;
+    double open_us[MAX_RUNS], hit[MAX_RUNS], miss[MAX_RUNS];
+    for (int r = 0; r < runs; r++) {
+        double t0 = now_sec();
+        fs = vsfs_open("lookup.img", VSFS_RDONLY);
+        if (!fs) {
+            return lib_error("Cannot open image");
+        }
+        double t1 = now_sec();
+        for (int k = 0; k < rounds; k++) {
+            for (size_t i = 0; i < DIR_ENTRIES; i++) {
+                if (vsfs_stat(fs, names[i], NULL) != 1) {
+                    fprintf(stderr, "Error: Lookup of '%s' failed\n", names[i]);
+                    vsfs_close(fs);
+                    return -1;
+                }
+            }
+        }
+        double t2 = now_sec();
+        char absent[16];
+        for (int k = 0; k < rounds; k++) {
+            for (size_t i = 0; i < DIR_ENTRIES; i++) {
+                snprintf(absent, sizeof(absent), "x%05zu", i);
+                if (vsfs_stat(fs, absent, NULL) != 0) {
+                    fprintf(stderr, "Error: Lookup of '%s' failed\n", absent);
+                    vsfs_close(fs);
+                    return -1;
+                }
+            }
+        }
+        double t3 = now_sec();
+        vsfs_close(fs);
+        open_us[r] = (t1 - t0) * 1e6;
+        hit[r] = (t2 - t1) / ((double)rounds * DIR_ENTRIES) * 1e9;
+        miss[r] = (t3 - t2) / ((double)rounds * DIR_ENTRIES) * 1e9;
+    }
+    unlink("lookup.img");
+    record("lookup", "open", "entries", DIR_ENTRIES, "us", open_us, runs);
+    record("lookup", "stat/hit", "entries", DIR_ENTRIES, "ns", hit, runs);
+    record("lookup", "stat/miss", "entries", DIR_ENTRIES, "ns", miss, runs);
+    return 0;
+}
+
+static void print_json(FILE *out) {
+    const char *crc_kernel = "slice16";
+#ifdef VSFS_CRC32_HAVE_PCLMUL
+    if (vsfs_crc32_impl == vsfs_crc32_pclmul) crc_kernel = "pclmul";
+#endif
+    const char *bitmap_scan = "word";
+#ifdef VSFS_BITMAP_HAVE_AVX2
+    if (vsfs_bitmap_skip_full == vsfs_bitmap_skip_full_avx2) bitmap_scan = "avx2";
+#endif
+    fprintf(out, "{\n  \"suite\": \"minivsfs\",\n  \"schema\": 1,\n");
+    fprintf(out, "  \"timestamp\": %lld,\n", (long long)time(NULL));
+    fprintf(out, "  \"quick\": %s,\n", quick ? "true" : "false");
+    fprintf(out, "  \"host\": {\"cpus\": %ld, \"crc32_kernel\": \"%s\", \"bitmap_scan\": \"%s\"},\n",
+            sysconf(_SC_NPROCESSORS_ONLN), crc_kernel, bitmap_scan);
+    fprintf(out, "  \"results\": [");
+    for (size_t i = 0; i < nresults; i++) {
+        const result_t *r = &results[i];
+        fprintf(out, "%s\n    {\"bench\": \"%s\", \"name\": \"%s\", \"%s\": %llu, \"unit\": \"%s\", "
+                "\"median\": %.6g, \"best\": %.6g, \"runs\": %d}",
+                i ? "," : "", r->bench, r->name, r->param_name, (unsigned long long)r->param,
+                r->unit, r->median, r->best, r->runs);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+// Close and remove a partly written --output file.
+static void discard_output(FILE *out, const char *output) {
+    if (output) {
+        fclose(out);
+        unlink(output);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = "/tmp";
+    const char *output = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--dir <scratch dir>] [--output <results.json>] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick) {
+        runs = 3;
+    }
+    vsfs_crc32_init();
+    vsfs_bitmap_init();
+
+    // open the output before changing directory, so a relative path works,
+    // and come back to this directory before removing the scratch directory
+    // (or the output), so relative --dir and --output paths work as well
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    char scratch[4096];
+    snprintf(scratch, sizeof(scratch), "%s/bench_vsfs.XXXXXX", dir);
+    if (cwd < 0 || !mkdtemp(scratch) || chdir(scratch) != 0) {
+        fprintf(stderr, "Error: Cannot create scratch directory in %s: %s\n", dir, strerror(errno));
+        if (cwd >= 0) {
+            rmdir(scratch);
+            close(cwd);
+        }
+        discard_output(out, output);
+        return 1;
+    }
+
+    // host files are added under their relative names, so they live in the
+    // scratch directory itself
+    int rc = 0;
+    char **names = calloc(DIR_ENTRIES, sizeof(char *));
+    for (size_t i = 0; names && i < DIR_ENTRIES; i++) {
+        names[i] = malloc(16);
+        if (!names[i]) {
+            break;
+        }
+        snprintf(names[i], 16, "f%05zu", i);
+    }
+    if (!names || !names[DIR_ENTRIES - 1]) {
+        fprintf(stderr, "Error: out of memory\n");
+        rc = 1;
+    }
+
+    if (rc == 0 &&
+        (bench_crc32() != 0 || bench_bitmap() != 0 || bench_mkfs() != 0 ||
+         bench_add(names, 1, 4096) != 0 || bench_add(names, 64, 4096) != 0 ||
+         bench_add(names, 64, 262144) != 0 || bench_lookup(names) != 0)) {
+        rc = 1;
+    }
+
+    for (size_t i = 0; names && i < DIR_ENTRIES && names[i]; i++) {
+        unlink(names[i]);
+        free(names[i]);
+    }
+    free(names);
+    unlink("mkfs.img");
+    unlink("add.img");
+    unlink("lookup.img");
+    if (fchdir(cwd) != 0 || rmdir(scratch) != 0) {
+        fprintf(stderr, "Warning: Cannot remove %s\n", scratch);
+    }
+    close(cwd);
+    if (rc != 0) {
+        discard_output(out, output);
+        return rc;
+    }
+    print_json(out);
+    if (fflush(out) != 0 || (output && fclose(out) != 0)) {
+        fprintf(stderr, "Error: Cannot write results\n");
+        return 1;
+    }
+    return 0;
+}
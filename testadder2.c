@@ -7,6 +7,8 @@
 #include <getopt.h>
 #include <sys/stat.h>
 
+#include "vsfs_bitmap.h"
+
 #define BLOCK_SIZE 4096
 #define INODE_SIZE 128
 #define MAGIC_NUMBER 0x4D565346
@@ -129,19 +131,12 @@ int find_free_inode(FILE* img_file, superblock_t* sb) {
         return -1;
     }
 
-    for (size_t byte_idx = 0; byte_idx < BLOCK_SIZE; byte_idx++) {
-        for (int bit_idx = 0; bit_idx < 8; bit_idx++) {
-            uint64_t inode_num = byte_idx * 8 + bit_idx + 1; // 1-indexed
-            if (inode_num > sb->inode_count) {
-                return -1; // No more inodes available
-            }
-            
-            if (!(inode_bitmap[byte_idx] & (1 << bit_idx))) {
-                return (int)inode_num;
-            }
-        }
+    uint64_t limit = sb->inode_count < BLOCK_SIZE * 8 ? sb->inode_count : BLOCK_SIZE * 8;
+    uint64_t idx = vsfs_bitmap_find_zero((const uint8_t*)inode_bitmap, limit, 0);
+    if (idx == VSFS_BITMAP_NONE) {
+        return -1; // No free inodes
     }
-    return -1; // No free inodes
+    return (int)(idx + 1); // 1-indexed
 }
 
 // Find the first free data block
@@ -153,19 +148,12 @@ int find_free_data_block(FILE* img_file, superblock_t* sb) {
         return -1;
     }
 
-    for (size_t byte_idx = 0; byte_idx < BLOCK_SIZE; byte_idx++) {
-        for (int bit_idx = 0; bit_idx < 8; bit_idx++) {
-            uint64_t block_num = byte_idx * 8 + bit_idx;
-            if (block_num >= sb->data_region_blocks) {
-                return -1; // No more data blocks available
-            }
-            
-            if (!(data_bitmap[byte_idx] & (1 << bit_idx))) {
-                return (int)block_num;
-            }
-        }
+    uint64_t limit = sb->data_region_blocks < BLOCK_SIZE * 8 ? sb->data_region_blocks : BLOCK_SIZE * 8;
+    uint64_t idx = vsfs_bitmap_find_zero((const uint8_t*)data_bitmap, limit, 0);
+    if (idx == VSFS_BITMAP_NONE) {
+        return -1; // No free data blocks
     }
-    return -1; // No free data blocks
+    return (int)idx;
 }
 
 // Find a free directory entry in root directory
@@ -411,6 +399,8 @@ int add_file_to_filesystem(FILE* img_file, superblock_t* sb, const char* filenam
 }
 
 int main(int argc, char* argv[]) {
+    vsfs_bitmap_init();
+
     char* input_name = NULL;
     char* output_name = NULL;
     char* file_name = NULL;
@@ -0,0 +1,65 @@
+// Regression test: images whose block group count sits on a layout
+// boundary (adding a group there takes away more data blocks than it
+// brings) must format, open and verify clean, since mkfs and the open path
+// must agree on that count.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra testgroups.c -L. -lminivsfs -pthread -o testgroups
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vsfs.h"
+
+static int check_size(uint64_t size_kib) {
+    vsfs_format_opts_t opts = { size_kib, 2000000,
+                                VSFS_FORMAT_GROUPS | VSFS_FORMAT_SPARSE | VSFS_FORMAT_LAZY_ITABLE };
+    vsfs_info_t info;
+    unlink("groups.img");
+    if (vsfs_format("groups.img", &opts, &info) != 0) {
+        fprintf(stderr, "Error: Cannot format %llu KiB image: %s\n", (unsigned long long)size_kib,
+                vsfs_last_error());
+        return -1;
+    }
+    vsfs_t *fs = vsfs_open("groups.img", VSFS_RDWR);
+    if (!fs) {
+        fprintf(stderr, "Error: %llu KiB image with %llu groups does not open: %s\n",
+                (unsigned long long)size_kib, (unsigned long long)info.group_count, vsfs_last_error());
+        return -1;
+    }
+    vsfs_close(fs);
+    vsfs_check_opts_t check_opts = { 0 };
+    int64_t problems = vsfs_check("groups.img", &check_opts, NULL, NULL);
+    if (problems != 0) {
+        fprintf(stderr, "Error: %llu KiB image with %llu groups has %lld problems\n",
+                (unsigned long long)size_kib, (unsigned long long)info.group_count, (long long)problems);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void) {
+    static const uint64_t sizes[] = {643484, 774568, 774572, 1036712};
+    char scratch[] = "/tmp/testgroups.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        fprintf(stderr, "Error: Cannot create scratch directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; i++) {
+        rc = check_size(sizes[i]) != 0;
+    }
+
+    unlink("groups.img");
+    if (chdir("/") != 0 || rmdir(scratch) != 0) {
+        fprintf(stderr, "Warning: Cannot remove %s\n", scratch);
+    }
+    if (rc == 0) {
+        printf("group layouts on count boundaries open and check clean\n");
+    }
+    return rc;
+}
@@ -0,0 +1,166 @@
+// Regression test: a block-mapped file whose single indirect block number
+// has 0xE57A (EXTENT_MAGIC) in its low 16 bits must still be read through
+// its block map, and the image must check clean. The same file is then
+// added to an --extents image, where it maps by extents.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra testindirect.c -L. -lminivsfs -pthread -o testindirect
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "vsfs.h"
+#include "vsfs_internal.h"
+
+#define IMAGE_KIB (400u * 1024u)
+#define TARGET_BLOCK 58746u          // 0xE57A
+#define FILE_INODE 2u
+
+static int fail(const char *what) {
+    fprintf(stderr, "Error: %s: %s\n", what, vsfs_last_error());
+    return -1;
+}
+
+// Every block of the host file starts with its own index, so a block read
+// from the wrong place shows up.
+static int write_host_file(const char *path, uint64_t blocks) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    uint8_t buf[BS];
+    memset(buf, 0xA5, sizeof(buf));
+    for (uint64_t i = 0; i < blocks; i++) {
+        memcpy(buf, &i, sizeof(i));
+        if (write(fd, buf, BS) != BS) {
+            fprintf(stderr, "Error: Cannot write %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+static int read_inode(const char *image, uint32_t ino, inode_t *inode) {
+    int fd = open(image, O_RDONLY);
+    superblock_t sb;
+    int rc = fd < 0 || pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) ||
+             pread(fd, inode, sizeof(*inode), (off_t)(sb.inode_table_start * BS + (ino - 1) * INODE_SIZE)) !=
+                 (ssize_t)sizeof(*inode);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (rc) {
+        fprintf(stderr, "Error: Cannot read inode %u of %s\n", ino, image);
+        return -1;
+    }
+    return 0;
+}
+
+static int verify_contents(vsfs_t *fs, const char *name, uint64_t blocks) {
+    uint8_t buf[BS];
+    for (uint64_t i = 0; i < blocks; i++) {
+        if (vsfs_read(fs, name, buf, BS, i * BS) != BS) {
+            return fail("Cannot read file back");
+        }
+        uint64_t stamp;
+        memcpy(&stamp, buf, sizeof(stamp));
+        if (stamp != i || buf[BS - 1] != 0xA5) {
+            fprintf(stderr, "Error: block %llu of %s does not read back\n", (unsigned long long)i, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int run(const char *image, uint32_t flags, const char *host, uint64_t blocks) {
+    vsfs_format_opts_t opts = { IMAGE_KIB, 1024, VSFS_FORMAT_SPARSE | flags };
+    unlink(image);
+    if (vsfs_format(image, &opts, NULL) != 0) {
+        return fail("Cannot format image");
+    }
+    vsfs_t *fs = vsfs_open(image, VSFS_RDWR);
+    if (!fs || vsfs_add(fs, host) != 0) {
+        if (fs) {
+            vsfs_close(fs);
+        }
+        return fail("Cannot add file");
+    }
+    if (vsfs_close(fs) != 0) {
+        return fail("Cannot close image");
+    }
+
+    inode_t inode;
+    if (read_inode(image, FILE_INODE, &inode) != 0) {
+        return -1;
+    }
+    int extents = (flags & VSFS_FORMAT_EXTENTS) != 0;
+    if (!extents && inode.reserved_0 != TARGET_BLOCK) {
+        fprintf(stderr, "Error: indirect block is %u, expected %u\n", inode.reserved_0, TARGET_BLOCK);
+        return -1;
+    }
+    if (extents != ((inode.xattr_ptr & EXTENT_XATTR_FLAG) != 0)) {
+        fprintf(stderr, "Error: %s image has extent flag %s\n", extents ? "extent" : "block-mapped",
+                extents ? "clear" : "set");
+        return -1;
+    }
+
+    fs = vsfs_open(image, VSFS_RDONLY);
+    if (!fs) {
+        return fail("Cannot open image");
+    }
+    int rc = verify_contents(fs, host, blocks);
+    vsfs_close(fs);
+    if (rc != 0) {
+        return -1;
+    }
+    vsfs_check_opts_t check_opts = { 0 };
+    int64_t problems = vsfs_check(image, &check_opts, NULL, NULL);
+    if (problems != 0) {
+        fprintf(stderr, "Error: %s has %lld problems\n", image, (long long)problems);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void) {
+    char scratch[] = "/tmp/testindirect.XXXXXX";
+    if (!mkdtemp(scratch) || chdir(scratch) != 0) {
+        fprintf(stderr, "Error: Cannot create scratch directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // The root directory holds the first data block and a new file's data
+    // goes in one run right after it, followed by its single indirect block.
+    vsfs_format_opts_t opts = { IMAGE_KIB, 1024, VSFS_FORMAT_SPARSE };
+    vsfs_info_t info;
+    if (vsfs_format("probe.img", &opts, &info) != 0) {
+        fail("Cannot format image");
+        return 1;
+    }
+    unlink("probe.img");
+    uint64_t blocks = TARGET_BLOCK - (info.data_region_start + 1);
+
+    int rc = 1;
+    if (write_host_file("data.bin", blocks) == 0 &&
+        run("blockmap.img", 0, "data.bin", blocks) == 0 &&
+        run("extents.img", VSFS_FORMAT_EXTENTS, "data.bin", blocks) == 0) {
+        rc = 0;
+    }
+
+    unlink("data.bin");
+    unlink("blockmap.img");
+    unlink("extents.img");
+    if (chdir("/") != 0 || rmdir(scratch) != 0) {
+        fprintf(stderr, "Warning: Cannot remove %s\n", scratch);
+    }
+    if (rc == 0) {
+        printf("indirect block at %u reads back as a block map\n", TARGET_BLOCK);
+    }
+    return rc;
+}
@@ -0,0 +1,2347 @@
+// libminivsfs: image handle, allocation, directory index and the vsfs_*
+// entry points other than vsfs_format() (see vsfs.h).
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "vsfs.h"
+#include "vsfs_internal.h"
+#include "vsfs_io.h"
+#include "vsfs_cache.h"
+
+#define GROUP_WORKERS_MAX 8
+#define ITABLE_INIT_CHUNK 1024u    // inode table blocks zeroed per step of vsfs_init_itable()
+#define STREAM_CHUNK (1u << 20)    // bytes of a stream read (and written) at a time
+
+static _Thread_local char last_error[512];
+
+void vsfs_set_error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(last_error, sizeof(last_error), fmt, ap);
+    va_end(ap);
+}
+
+const char *vsfs_last_error(void) {
+    return last_error;
+}
+
+// Bits [lo, hi) of a bitmap that a batch has touched. On large images the
+// bitmaps span many blocks; only this range is copied back and written.
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} bitmap_span_t;
+
+static void span_add(bitmap_span_t *span, uint64_t bit, uint64_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (span->hi == 0 || bit < span->lo) span->lo = bit;
+    if (bit + count > span->hi) span->hi = bit + count;
+}
+
+// Byte offset and length in the bitmap covering span
+static size_t span_bytes(const bitmap_span_t *span, size_t *offset) {
+    *offset = (size_t)(span->lo / 8);
+    return span->hi == 0 ? 0 : (size_t)((span->hi + 7) / 8) - *offset;
+}
+
+// An open image. Block 0 (the superblock and its extension), the group
+// descriptor table and both bitmaps are read once and kept in memory;
+// every other metadata block goes through the buffer cache, and file data
+// is read and written directly. All of it goes through the I/O backend io.
+// Changes stay in memory until image_flush() writes them back;
+// image_commit() also makes them durable.
+typedef struct {
+    int fd;
+    int writable;
+    uint64_t size;
+    vsfs_io_t io;
+    uint8_t *sb_block;             // block 0
+    superblock_t *sb;
+    superblock_ext_t *sb_ext;
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    group_desc_t *groups;          // NULL without SB_FLAG_GROUPS
+    uint32_t group_count;
+    bcache_t cache;
+    int sb_dirty;                  // set only once the superblock CRC is final
+    int sb_crc_valid;              // stored CRC matches, so updates can patch it
+    bitmap_span_t inode_bitmap_dirty;   // in blocks of each region
+    bitmap_span_t data_bitmap_dirty;
+    bitmap_span_t gdt_dirty;
+} image_t;
+
+// Read the descriptor table and check that it matches the geometry the
+// superblock implies.
+static int image_load_groups(image_t *img) {
+    const superblock_t *sb = img->sb;
+    uint64_t count = group_count_for(sb->data_region_blocks);
+    uint64_t gdt_blocks = sb->inode_bitmap_start - 1;
+    if (count * sizeof(group_desc_t) > gdt_blocks * BS || sb->inode_count % count != 0) {
+        return -1;
+    }
+    group_desc_t *groups = malloc(gdt_blocks * BS);
+    if (!groups || io_read(&img->io, groups, gdt_blocks * BS, BS) != 0) {
+        free(groups);
+        return -1;
+    }
+    uint64_t per_group = sb->inode_count / count;
+    for (uint64_t g = 0; g < count; g++) {
+        const group_desc_t *gd = &groups[g];
+        uint64_t blocks = g + 1 == count ? sb->data_region_blocks - g * BLOCKS_PER_GROUP : BLOCKS_PER_GROUP;
+        if (crc32(gd, offsetof(group_desc_t, checksum)) != gd->checksum ||
+            gd->first_data_block != sb->data_region_start + g * BLOCKS_PER_GROUP ||
+            gd->data_blocks != blocks || gd->inode_count != per_group || per_group % 64 != 0 ||
+            gd->first_inode != g * per_group + 1) {
+            free(groups);
+            return -1;
+        }
+    }
+    img->groups = groups;
+    img->group_count = (uint32_t)count;
+    return 0;
+}
+
+static void image_close(image_t *img) {
+    bcache_destroy(&img->cache);
+    vsfs_io_close(&img->io);
+    if (img->fd >= 0) {
+        close(img->fd);
+    }
+    free(img->sb_block);
+    free(img->inode_bitmap);
+    free(img->data_bitmap);
+    free(img->groups);
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    img->io.data_fd = -1;
+}
+
+// Open an image on I/O backend io_kind, validate its layout and load the
+// metadata kept in memory. With direct, file data written to the image
+// goes through a second, O_DIRECT descriptor. Returns 0 on success, -1 on
+// error (see vsfs_last_error()).
+static int image_open(image_t *img, const char *path, int writable, int io_kind, int direct, size_t cache_blocks) {
+    memset(img, 0, sizeof(*img));
+    img->fd = -1;
+    img->io.data_fd = -1;
+    if (direct && writable && (io_kind == VSFS_IO_STDIO || io_kind == VSFS_IO_MMAP)) {
+        vsfs_set_error("Direct I/O needs the pread or uring backend");
+        return -1;
+    }
+
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        vsfs_set_error("Cannot open image '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    img->fd = fd;
+    img->writable = writable;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        vsfs_set_error("Cannot stat image '%s': %s", path, strerror(errno));
+        goto fail;
+    }
+    img->size = (uint64_t)st.st_size;
+    int data_fd = -1;
+    if (direct && writable) {
+        data_fd = open(path, O_RDWR | O_DIRECT);
+        if (data_fd < 0) {
+            vsfs_set_error("Cannot open image '%s' for direct I/O: %s", path, strerror(errno));
+            goto fail;
+        }
+    }
+    if (vsfs_io_open(&img->io, io_kind, fd, data_fd, writable, img->size) != 0) {
+        vsfs_set_error("Cannot open image '%s': %s", path, strerror(errno));
+        if (data_fd >= 0) close(data_fd);
+        img->io.data_fd = -1;
+        goto fail;
+    }
+    if (img->size < BS || posix_memalign((void **)&img->sb_block, BS, BS) != 0 ||
+        io_read(&img->io, img->sb_block, BS, 0) != 0) {
+        vsfs_set_error("Cannot read superblock");
+        goto fail;
+    }
+    img->sb = (superblock_t *)img->sb_block;
+    img->sb_ext = (superblock_ext_t *)(img->sb_block + SB_EXT_OFFSET);
+    uint32_t stored_crc = img->sb->checksum;
+    img->sb_crc_valid = superblock_crc_finalize(img->sb) == stored_crc;
+    img->sb->checksum = stored_crc;
+
+    const superblock_t *sb = img->sb;
+    if (sb->magic != VSFS_MAGIC) {
+        vsfs_set_error("Invalid file system magic number");
+        goto fail;
+    }
+    if (sb->block_size != BS || sb->total_blocks > img->size / BS ||
+        sb->inode_bitmap_start + sb->inode_bitmap_blocks > sb->total_blocks ||
+        sb->data_bitmap_start + sb->data_bitmap_blocks > sb->total_blocks ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->total_blocks ||
+        sb->data_region_start + sb->data_region_blocks > sb->total_blocks ||
+        sb->inode_count > sb->inode_table_blocks * (BS / INODE_SIZE) ||
+        sb->inode_count > sb->inode_bitmap_blocks * BS * 8 ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * BS * 8) {
+        vsfs_set_error("Corrupt superblock in '%s'", path);
+        goto fail;
+    }
+    if ((sb->flags & SB_FLAG_LAZY_ITABLE) &&
+        (img->sb_ext->itable_initialized == 0 || img->sb_ext->itable_initialized > sb->inode_table_blocks)) {
+        vsfs_set_error("Corrupt superblock in '%s'", path);
+        goto fail;
+    }
+
+    img->inode_bitmap = malloc(sb->inode_bitmap_blocks * BS);
+    img->data_bitmap = malloc(sb->data_bitmap_blocks * BS);
+    if (!img->inode_bitmap || !img->data_bitmap) {
+        vsfs_set_error("Out of memory");
+        goto fail;
+    }
+    if (io_read(&img->io, img->inode_bitmap, sb->inode_bitmap_blocks * BS, sb->inode_bitmap_start * BS) != 0 ||
+        io_read(&img->io, img->data_bitmap, sb->data_bitmap_blocks * BS, sb->data_bitmap_start * BS) != 0) {
+        vsfs_set_error("Cannot read bitmaps of '%s': %s", path, strerror(errno));
+        goto fail;
+    }
+    if ((sb->flags & SB_FLAG_GROUPS) && image_load_groups(img) != 0) {
+        vsfs_set_error("Corrupt group descriptors in '%s'", path);
+        goto fail;
+    }
+    if (bcache_init(&img->cache, &img->io, cache_blocks) != 0) {
+        vsfs_set_error("Out of memory");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    image_close(img);
+    return -1;
+}
+
+// Pinned cache buffer holding a block, or NULL if the block is out of range
+// or cannot be read. Release it with image_block_put().
+static uint8_t *image_block_get(image_t *img, uint64_t block_num, int flags) {
+    if (block_num == 0 || block_num >= img->sb->total_blocks) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return bcache_get(&img->cache, block_num, flags);
+}
+
+static void image_block_put(image_t *img, const uint8_t *data, int dirty) {
+    bcache_put(&img->cache, data, dirty);
+}
+
+// Copy a 1-indexed inode out of, or into, its inode table block.
+static int image_read_inode(image_t *img, uint64_t inode_num, inode_t *out) {
+    if (inode_num == 0 || inode_num > img->sb->inode_count) {
+        return -1;
+    }
+    uint64_t off = (inode_num - 1) * INODE_SIZE;
+    uint8_t *block_data = image_block_get(img, img->sb->inode_table_start + off / BS, 0);
+    if (!block_data) {
+        return -1;
+    }
+    memcpy(out, block_data + off % BS, INODE_SIZE);
+    image_block_put(img, block_data, 0);
+    return 0;
+}
+
+static int image_write_inode(image_t *img, uint64_t inode_num, const inode_t *in) {
+    if (inode_num == 0 || inode_num > img->sb->inode_count) {
+        return -1;
+    }
+    uint64_t off = (inode_num - 1) * INODE_SIZE;
+    uint8_t *block_data = image_block_get(img, img->sb->inode_table_start + off / BS, 0);
+    if (!block_data) {
+        return -1;
+    }
+    memcpy(block_data + off % BS, in, INODE_SIZE);
+    image_block_put(img, block_data, 1);
+    return 0;
+}
+
+// Superblock changes are written back only once marked, i.e. after
+// superblock_crc_finalize().
+static void image_mark_sb(image_t *img) {
+    img->sb_dirty = 1;
+}
+
+// Change n bytes at offset off of block 0 (a superblock_t or
+// superblock_ext_t field) and mark it. The CRC is patched for those bytes
+// alone unless it was stale when the image was opened.
+static void image_sb_update(image_t *img, size_t off, const void *val, size_t n) {
+    if (img->sb_crc_valid) {
+        superblock_update(img->sb_block, off, val, n);
+    } else {
+        memcpy(img->sb_block + off, val, n);
+        superblock_crc_finalize(img->sb);
+        img->sb_crc_valid = 1;
+    }
+    image_mark_sb(img);
+}
+
+// An inode for image_write_inodes().
+typedef struct {
+    uint32_t num;
+    inode_t inode;                 // inode_crc is filled in on the way out
+} inode_update_t;
+
+static int cmp_inode_update(const void *a, const void *b) {
+    uint32_t x = ((const inode_update_t *)a)->num, y = ((const inode_update_t *)b)->num;
+    return x < y ? -1 : x > y;
+}
+
+// Store a batch of inodes, sorted in place by number, so each inode table
+// block is fetched once and the CRCs of all the inodes stored into it are
+// finalized together.
+static int image_write_inodes(image_t *img, inode_update_t *u, size_t n) {
+    qsort(u, n, sizeof(*u), cmp_inode_update);
+    const uint64_t per_block = BS / INODE_SIZE;
+    for (size_t i = 0; i < n; ) {
+        if (u[i].num == 0 || u[i].num > img->sb->inode_count) {
+            return -1;
+        }
+        uint64_t block = (u[i].num - 1) / per_block;
+        uint8_t *block_data = image_block_get(img, img->sb->inode_table_start + block, 0);
+        if (!block_data) {
+            return -1;
+        }
+        uint32_t dirty = 0;
+        for (; i < n && u[i].num <= img->sb->inode_count && (u[i].num - 1) / per_block == block; i++) {
+            uint32_t slot = (u[i].num - 1) % per_block;
+            memcpy(block_data + slot * INODE_SIZE, &u[i].inode, INODE_SIZE);
+            dirty |= 1u << slot;
+        }
+        inode_block_crc_finalize(block_data, dirty);
+        image_block_put(img, block_data, 1);
+    }
+    return 0;
+}
+
+// Note that bytes [offset, offset+len) of an in-memory region changed.
+static void region_mark(bitmap_span_t *span, uint64_t offset, uint64_t len) {
+    if (len > 0) {
+        span_add(span, offset / BS, (offset + len + BS - 1) / BS - offset / BS);
+    }
+}
+
+// Write back everything changed since the last flush: dirty cache blocks,
+// the touched bitmap and descriptor blocks and the superblock, sorted by
+// block and gathered into one pwritev() per run of adjacent blocks.
+static int image_flush(image_t *img) {
+    if (!img->writable) {
+        return 0;
+    }
+    const superblock_t *sb = img->sb;
+    bitmap_span_t *spans[3] = { &img->inode_bitmap_dirty, &img->data_bitmap_dirty, &img->gdt_dirty };
+    const uint8_t *mem[3] = { img->inode_bitmap, img->data_bitmap, (const uint8_t *)img->groups };
+    uint64_t start[3] = { sb->inode_bitmap_start, sb->data_bitmap_start, 1 };
+    bcache_region_t regions[4];
+    size_t n = 0;
+    for (int i = 0; i < 3; i++) {
+        if (spans[i]->hi != 0) {
+            regions[n++] = (bcache_region_t){ start[i] + spans[i]->lo, spans[i]->hi - spans[i]->lo,
+                                              mem[i] + spans[i]->lo * BS };
+        }
+    }
+    if (img->sb_dirty) {
+        regions[n++] = (bcache_region_t){ 0, 1, img->sb_block };
+    }
+    if (bcache_flush(&img->cache, regions, n) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        *spans[i] = (bitmap_span_t){0, 0};
+    }
+    img->sb_dirty = 0;
+    return 0;
+}
+
+// Flush and wait for the data to reach stable storage with one fdatasync().
+// Used as the barrier between the ordered steps of a VSFS_SYNC update and
+// when closing.
+static int image_commit(image_t *img) {
+    if (!img->writable) {
+        return 0;
+    }
+    if (image_flush(img) != 0) {
+        return -1;
+    }
+    return io_sync(&img->io);
+}
+
+// Forget every change not yet written back: dirty cache blocks, bitmap and
+// descriptor spans and the superblock. What stays in memory no longer
+// matches the image afterwards.
+static void image_discard(image_t *img) {
+    bcache_discard(&img->cache, 0, UINT64_MAX);
+    img->inode_bitmap_dirty = (bitmap_span_t){0, 0};
+    img->data_bitmap_dirty = (bitmap_span_t){0, 0};
+    img->gdt_dirty = (bitmap_span_t){0, 0};
+    img->sb_dirty = 0;
+}
+
+// Zero inode table blocks [first, end) of a lazily initialized table.
+// Punching a hole makes this O(1) in the range size on most filesystems;
+// otherwise zeros are written. Cached copies of the blocks are dropped.
+static int itable_zero(image_t *img, uint64_t first, uint64_t end, int sync) {
+    if (first >= end) {
+        return 0;
+    }
+    uint64_t start = img->sb->inode_table_start + first;
+    bcache_discard(&img->cache, start, img->sb->inode_table_start + end);
+    off_t offset = (off_t)(start * BS);
+    off_t len = (off_t)((end - first) * BS);
+    if (fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) != 0) {
+        static const uint8_t zero[64 * BS];
+        for (off_t done = 0; done < len; done += (off_t)sizeof(zero)) {
+            size_t chunk = len - done < (off_t)sizeof(zero) ? (size_t)(len - done) : sizeof(zero);
+            if (io_write(&img->io, zero, chunk, (uint64_t)(offset + done)) != 0) {
+                return -1;
+            }
+        }
+    }
+    return sync ? io_sync(&img->io) : 0;
+}
+
+// Make sure the inode table is initialized up to and including the block
+// holding inode_num, moving the high-water mark. The mark only dirties
+// block 0, so it goes out with the next flush; with sync the zeroing is
+// made durable first, so the mark never covers blocks that are not.
+static int itable_extend(image_t *img, uint32_t inode_num, int sync) {
+    if (!(img->sb->flags & SB_FLAG_LAZY_ITABLE)) {
+        return 0;
+    }
+    uint64_t block = (uint64_t)(inode_num - 1) * INODE_SIZE / BS;
+    uint64_t hwm = img->sb_ext->itable_initialized;
+    if (block < hwm) {
+        return 0;
+    }
+    if (itable_zero(img, hwm, block + 1, sync) != 0) {
+        return -1;
+    }
+    uint64_t mark = block + 1;
+    image_sb_update(img, SB_EXT_OFFSET + offsetof(superblock_ext_t, itable_initialized), &mark, sizeof(mark));
+    return 0;
+}
+
+// Background initialization of the rest of a lazy inode table. Works in
+// ITABLE_INIT_CHUNK steps and commits the high-water mark after each, so
+// the pass can be interrupted and resumed; when the table is complete the
+// image becomes an ordinary, fully initialized one.
+static int itable_init_all(image_t *img, int sync) {
+    superblock_t *sb = img->sb;
+    if (!(sb->flags & SB_FLAG_LAZY_ITABLE)) {
+        return 0;
+    }
+    while (img->sb_ext->itable_initialized < sb->inode_table_blocks) {
+        uint64_t first = img->sb_ext->itable_initialized;
+        uint64_t end = sb->inode_table_blocks - first > ITABLE_INIT_CHUNK ? first + ITABLE_INIT_CHUNK
+                                                                          : sb->inode_table_blocks;
+        if (itable_zero(img, first, end, sync) != 0) {
+            return -1;
+        }
+        image_sb_update(img, SB_EXT_OFFSET + offsetof(superblock_ext_t, itable_initialized), &end, sizeof(end));
+        if (sync && image_commit(img) != 0) {
+            return -1;
+        }
+    }
+    uint32_t flags = sb->flags & ~SB_FLAG_LAZY_ITABLE;
+    uint64_t mark = 0;
+    image_sb_update(img, offsetof(superblock_t, flags), &flags, sizeof(flags));
+    image_sb_update(img, SB_EXT_OFFSET + offsetof(superblock_ext_t, itable_initialized), &mark, sizeof(mark));
+    return sync ? image_commit(img) : 0;
+}
+
+// How copy_range() moves bytes; it steps down a level when the kernel
+// refuses one for a pair of files.
+typedef enum { COPY_CFR = 0, COPY_SENDFILE, COPY_RW } copy_mode_t;
+
+// Copy len bytes from in_fd at in_off to out_fd at out_off without going
+// through user space where possible: copy_file_range (which may share
+// extents), then sendfile, then a pread/pwrite loop. All-zero blocks are
+// skipped in the last case so they stay holes in the output.
+static int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t len, copy_mode_t *mode) {
+    while (len > 0 && *mode == COPY_CFR) {
+        loff_t src = in_off, dst = out_off;
+        ssize_t n = copy_file_range(in_fd, &src, out_fd, &dst, (size_t)len, 0);
+        if (n > 0) {
+            in_off += n;
+            out_off += n;
+            len -= n;
+            continue;
+        }
+        if (n == 0) {
+            return -1; // source shrank underneath us
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        *mode = COPY_SENDFILE; // not supported for this pair of files
+    }
+
+    if (len > 0 && *mode == COPY_SENDFILE) {
+        if (lseek(out_fd, out_off, SEEK_SET) < 0) {
+            return -1;
+        }
+        while (len > 0) {
+            off_t src = in_off;
+            ssize_t n = sendfile(out_fd, in_fd, &src, (size_t)len);
+            if (n > 0) {
+                in_off += n;
+                out_off += n;
+                len -= n;
+                continue;
+            }
+            if (n == 0) {
+                return -1;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                return -1;
+            }
+            *mode = COPY_RW;
+            break;
+        }
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+    static const uint8_t zero[BS];
+    size_t buf_size = 64 * BS;
+    uint8_t *buf = malloc(buf_size);
+    if (!buf) {
+        return -1;
+    }
+    int rc = 0;
+    while (len > 0) {
+        size_t want = len < (off_t)buf_size ? (size_t)len : buf_size;
+        ssize_t n = pread(in_fd, buf, want, in_off);
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        for (ssize_t done = 0; done < n && rc == 0; done += BS) {
+            size_t chunk = (size_t)(n - done) < BS ? (size_t)(n - done) : BS;
+            if (chunk == BS && memcmp(buf + done, zero, BS) == 0) {
+                continue;
+            }
+            if (pwrite(out_fd, buf + done, chunk, out_off + done) != (ssize_t)chunk) {
+                rc = -1;
+            }
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    free(buf);
+    return rc;
+}
+
+// Create dst as a copy of src without leaving the process. Tries, in order:
+// a reflink (FICLONE, shares extents on btrfs/xfs/...), then copy_range()
+// over the data segments reported by SEEK_DATA/SEEK_HOLE. Holes in src stay
+// holes in dst.
+int vsfs_copy_image(const char *src, const char *dst) {
+    int in_fd = open(src, O_RDONLY);
+    if (in_fd < 0) {
+        vsfs_set_error("Cannot open input file '%s': %s", src, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        vsfs_set_error("Cannot stat input file '%s': %s", src, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    struct stat dst_st;
+    if (stat(dst, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+        vsfs_set_error("Input and output are the same file");
+        close(in_fd);
+        return -1;
+    }
+
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out_fd < 0) {
+        vsfs_set_error("Cannot create output file '%s': %s", dst, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+
+    int rc = 0;
+    if (ioctl(out_fd, FICLONE, in_fd) != 0) {
+        copy_mode_t mode = COPY_CFR;
+        off_t pos = 0;
+        while (pos < st.st_size) {
+            off_t data = lseek(in_fd, pos, SEEK_DATA);
+            if (data < 0) {
+                if (errno == ENXIO) {
+                    break; // only a hole remains
+                }
+                data = pos; // SEEK_DATA unsupported: treat the rest as data
+            }
+            off_t hole = lseek(in_fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > st.st_size) {
+                hole = st.st_size;
+            }
+            if (copy_range(in_fd, data, out_fd, data, hole - data, &mode) != 0) {
+                rc = -1;
+                break;
+            }
+            pos = hole;
+        }
+        if (rc == 0 && ftruncate(out_fd, st.st_size) != 0) {
+            rc = -1;
+        }
+    }
+    if (rc != 0) {
+        vsfs_set_error("Cannot copy input file to output file: %s", strerror(errno));
+    }
+    if (close(out_fd) != 0 && rc == 0) {
+        vsfs_set_error("Cannot copy input file to output file: %s", strerror(errno));
+        rc = -1;
+    }
+    close(in_fd);
+    return rc;
+}
+
+// Touched ranges of both bitmaps for a batch: entry 0 collects allocations
+// made across the whole image, entry 1 + g those made inside block group g,
+// so each group worker records into its own spans.
+typedef struct {
+    bitmap_span_t *inode;
+    bitmap_span_t *data;
+    size_t count;
+} dirty_map_t;
+
+// Find the first free inode bit in [first, end) at or after inode number
+// hint (1-based) and return its inode number, or 0 if there is none.
+// Passing the previous allocation as the hint keeps a batch from rescanning
+// the allocated prefix for every file.
+static uint32_t find_free_inode(const uint8_t *bitmap, uint64_t first, uint64_t end, uint32_t hint) {
+    uint64_t from = hint > first ? hint - 1 : first;
+    uint64_t i = vsfs_bitmap_find_zero(bitmap, end, from);
+    if (i == VSFS_BITMAP_NONE && from > first) {
+        i = vsfs_bitmap_find_zero(bitmap, end, first);
+    }
+    if (i == VSFS_BITMAP_NONE) {
+        return 0;
+    }
+    return (uint32_t)(i + 1); // Return 1-indexed inode number
+}
+
+// In-memory data block allocator. Works on a private copy of the data
+// bitmap, restricted to region-relative blocks [first, end) (the whole data
+// region, or one block group); goal is the block after the last allocation,
+// so consecutive files of a batch are laid out back to back.
+typedef struct {
+    const superblock_t *sb;
+    uint8_t *bitmap;
+    uint64_t goal;
+    bitmap_span_t *dirty;
+    uint64_t first;
+    uint64_t end;
+} block_alloc_t;
+
+// Reserve count data blocks in one call and store their absolute block
+// numbers in out[]. A single contiguous run is preferred (first fit from the
+// goal, then from the start of the region); if the region is too fragmented
+// the blocks are gathered from the free runs in order. Returns the number of
+// extents used, or -1 (nothing reserved) if there is not enough space.
+static int alloc_data_blocks(block_alloc_t *ba, uint64_t count, uint32_t *out) {
+    const superblock_t *sb = ba->sb;
+    uint64_t nbits = ba->end;
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t goal = ba->goal > ba->first ? ba->goal : ba->first;
+    uint64_t run = vsfs_bitmap_find_zero_run(ba->bitmap, nbits, goal, count);
+    if (run == VSFS_BITMAP_NONE && goal != ba->first) {
+        run = vsfs_bitmap_find_zero_run(ba->bitmap, nbits, ba->first, count);
+    }
+    if (run != VSFS_BITMAP_NONE) {
+        vsfs_bitmap_set_range(ba->bitmap, run, count);
+        span_add(ba->dirty, run, count);
+        for (uint64_t i = 0; i < count; i++) {
+            out[i] = (uint32_t)(sb->data_region_start + run + i);
+        }
+        ba->goal = run + count;
+        return 1;
+    }
+
+    // No single run is long enough: take free runs in order
+    uint64_t got = 0, pos = ba->first;
+    int extents = 0;
+    while (got < count) {
+        uint64_t start = vsfs_bitmap_find_zero(ba->bitmap, nbits, pos);
+        if (start == VSFS_BITMAP_NONE) {
+            for (uint64_t i = 0; i < got; i++) {
+                vsfs_bitmap_clear(ba->bitmap, out[i] - sb->data_region_start);
+            }
+            return -1;
+        }
+        uint64_t end = vsfs_bitmap_find_set(ba->bitmap, nbits, start, start + (count - got));
+        vsfs_bitmap_set_range(ba->bitmap, start, end - start);
+        span_add(ba->dirty, start, end - start);
+        for (uint64_t b = start; b < end; b++) {
+            out[got++] = (uint32_t)(sb->data_region_start + b);
+        }
+        extents++;
+        pos = end;
+    }
+    ba->goal = pos;
+    return extents;
+}
+
+// Set bit in bitmap
+static void set_bit(uint8_t *bitmap, uint64_t bit_num) {
+    vsfs_bitmap_set(bitmap, bit_num);
+}
+
+// FNV-1a over the NUL-terminated name (at most 58 bytes)
+static uint32_t dir_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < 58 && name[i]; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Copy the directory entry at location loc (block index * 64 + entry) into
+// out. Returns 1, 0 if that directory block is not allocated, or -1 if it
+// cannot be read.
+static int dir_entry_read(image_t *img, const inode_t *dir, uint32_t loc, dirent64_t *out) {
+    if (loc >= DIR_MAX_ENTRIES || dir->direct[loc / DIRENTS_PER_BLOCK] == 0) {
+        return 0;
+    }
+    const uint8_t *block_data = image_block_get(img, dir->direct[loc / DIRENTS_PER_BLOCK], 0);
+    if (!block_data) {
+        return -1;
+    }
+    memcpy(out, block_data + (loc % DIRENTS_PER_BLOCK) * sizeof(dirent64_t), sizeof(*out));
+    image_block_put(img, block_data, 0);
+    return 1;
+}
+
+static int dir_entry_write(image_t *img, const inode_t *dir, uint32_t loc, const dirent64_t *entry) {
+    if (loc >= DIR_MAX_ENTRIES || dir->direct[loc / DIRENTS_PER_BLOCK] == 0) {
+        return -1;
+    }
+    uint8_t *block_data = image_block_get(img, dir->direct[loc / DIRENTS_PER_BLOCK], 0);
+    if (!block_data) {
+        return -1;
+    }
+    memcpy(block_data + (loc % DIRENTS_PER_BLOCK) * sizeof(dirent64_t), entry, sizeof(*entry));
+    image_block_put(img, block_data, 1);
+    return 0;
+}
+
+static void dir_index_insert(dir_index_t *idx, const char *name, uint32_t loc) {
+    uint32_t h = dir_hash(name);
+    uint16_t tag = (uint16_t)(h >> 16) | 1;
+    uint32_t i = h % DIR_INDEX_SLOTS;
+    while (idx->loc[i] != 0) {
+        i = (i + 1) % DIR_INDEX_SLOTS;
+    }
+    idx->tag[i] = tag;
+    idx->loc[i] = (uint16_t)(loc + 1);
+    idx->count++;
+}
+
+// Location of name in the directory, or -1. One hash, and normally one
+// dirent block touched.
+static int dir_index_lookup(image_t *img, const inode_t *dir, const dir_index_t *idx, const char *name) {
+    uint32_t h = dir_hash(name);
+    uint16_t tag = (uint16_t)(h >> 16) | 1;
+    for (uint32_t i = h % DIR_INDEX_SLOTS; idx->loc[i] != 0; i = (i + 1) % DIR_INDEX_SLOTS) {
+        if (idx->tag[i] != tag) {
+            continue;
+        }
+        uint32_t loc = idx->loc[i] - 1u;
+        dirent64_t entry;
+        if (dir_entry_read(img, dir, loc, &entry) > 0 && entry.inode_no != 0 &&
+            strncmp(entry.name, name, sizeof(entry.name)) == 0) {
+            return (int)loc;
+        }
+    }
+    return -1;
+}
+
+// Load the on-disk index of dir into idx. Returns 0 if it is present and
+// current, -1 if it must be rebuilt.
+static int dir_index_load(image_t *img, const inode_t *dir, dir_index_t *idx) {
+    if (!(img->sb->flags & SB_FLAG_DIR_INDEX) || dir->reserved_2 == 0) {
+        return -1;
+    }
+    const uint8_t *block_data = image_block_get(img, dir->reserved_2, 0);
+    if (!block_data) {
+        return -1;
+    }
+    memcpy(idx, block_data, sizeof(*idx));
+    image_block_put(img, block_data, 0);
+    uint32_t stored = idx->checksum;
+    idx->checksum = 0;
+    if (idx->magic != DIR_INDEX_MAGIC || crc32(idx, sizeof(*idx)) != stored ||
+        idx->dir_mtime != dir->mtime || idx->next_free > DIR_MAX_ENTRIES) {
+        return -1;
+    }
+    // an older tool that ignores the index fills the first free slot
+    dirent64_t entry;
+    int found = dir_entry_read(img, dir, idx->next_free, &entry);
+    if (found < 0 || (found > 0 && entry.inode_no != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Rebuild idx by scanning every dirent block of dir.
+static int dir_index_build(image_t *img, const inode_t *dir, dir_index_t *idx) {
+    memset(idx, 0, sizeof(*idx));
+    idx->magic = DIR_INDEX_MAGIC;
+    idx->next_free = DIR_MAX_ENTRIES;
+    for (uint32_t blk = 0; blk < DIRECT_MAX; blk++) {
+        uint32_t base = blk * DIRENTS_PER_BLOCK;
+        if (dir->direct[blk] == 0) {
+            if (idx->next_free == DIR_MAX_ENTRIES) {
+                idx->next_free = base;
+            }
+            continue;
+        }
+        const uint8_t *block_data = image_block_get(img, dir->direct[blk], 0);
+        if (!block_data) {
+            return -1;
+        }
+        const dirent64_t *entries = (const dirent64_t *)block_data;
+        for (uint32_t e = 0; e < DIRENTS_PER_BLOCK; e++) {
+            if (entries[e].inode_no == 0) {
+                if (idx->next_free == DIR_MAX_ENTRIES) {
+                    idx->next_free = base + e;
+                }
+                continue;
+            }
+            dir_index_insert(idx, entries[e].name, base + e);
+        }
+        image_block_put(img, block_data, 0);
+    }
+    return 0;
+}
+
+// Stamp the index with the directory mtime it now matches and checksum it.
+static void dir_index_finalize(dir_index_t *idx, uint64_t dir_mtime) {
+    idx->dir_mtime = dir_mtime;
+    idx->checksum = 0;
+    idx->checksum = crc32(idx, sizeof(*idx));
+}
+
+// One file of a batch add: where it comes from and what was reserved for it.
+typedef struct {
+    const char *path;              // host path
+    char name[58];                 // name in the root directory (truncated to 57 chars)
+    int fd;                        // stream read to end of file (pipe, FIFO, stdin), -1 for a regular file
+    int own_fd;                    // fd was opened from path and is closed with the job
+    uint64_t size;
+    uint64_t blocks_needed;
+    uint64_t meta_needed;          // single/double indirect blocks
+    uint32_t inode_num;
+    uint32_t *blocks;              // data blocks, in file order
+    uint32_t *meta;                // indirect or extent blocks, in the order build_block_map() uses them
+    int use_extents;
+    uint64_t extent_count;
+    uint32_t dir_loc;              // free root directory slot reserved for it
+    int64_t group;                 // block group it is placed in, -1 = anywhere
+} add_job_t;
+
+typedef struct {
+    add_job_t *jobs;
+    size_t count;
+    size_t cap;
+} job_list_t;
+
+// Root directory blocks and index block a batch has to allocate.
+typedef struct {
+    uint32_t new_dir_blocks[DIRECT_MAX];   // 0 = block already exists
+    uint32_t index_block;                  // 0 = reuse the existing one
+} dir_plan_t;
+
+// Number of blocks starting at blocks[i] that are physically consecutive.
+static uint64_t contiguous_blocks(const uint32_t *blocks, uint64_t i, uint64_t count) {
+    uint64_t n = 1;
+    while (i + n < count && blocks[i + n] == blocks[i] + n) {
+        n++;
+    }
+    return n;
+}
+
+// Number of contiguous runs in blocks[0..count).
+static uint64_t count_runs(const uint32_t *blocks, uint64_t count) {
+    uint64_t runs = 0;
+    for (uint64_t i = 0; i < count; i += contiguous_blocks(blocks, i, count)) {
+        runs++;
+    }
+    return runs;
+}
+
+// Number of indirect blocks needed to map data_blocks blocks: one single
+// indirect block for the next PTRS_PER_BLOCK blocks, then a double indirect
+// block plus one second-level block per PTRS_PER_BLOCK blocks after that.
+static uint64_t indirect_blocks_needed(uint64_t data_blocks) {
+    if (data_blocks <= DIRECT_MAX) {
+        return 0;
+    }
+    uint64_t rest = data_blocks - DIRECT_MAX;
+    if (rest <= PTRS_PER_BLOCK) {
+        return 1;
+    }
+    rest -= PTRS_PER_BLOCK;
+    return 2 + (rest + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+// Describe the job's blocks as extents, inline or in its extent block.
+static int build_extent_map(image_t *img, const add_job_t *job, inode_t *inode) {
+    extent_t ext[EXTENT_INLINE_MAX];
+    extent_block_t *tree = NULL;
+    if (job->extent_count > EXTENT_INLINE_MAX) {
+        tree = (extent_block_t *)image_block_get(img, job->meta[0], BCACHE_NOREAD);
+        if (!tree) {
+            return -1;
+        }
+        memset(tree, 0, BS);
+        tree->magic = EXTENT_MAGIC;
+        tree->count = (uint32_t)job->extent_count;
+    }
+    uint32_t n = 0;
+    for (uint64_t i = 0; i < job->blocks_needed; n++) {
+        uint64_t run = contiguous_blocks(job->blocks, i, job->blocks_needed);
+        extent_t e = { (uint32_t)i, job->blocks[i], (uint32_t)run };
+        if (tree) {
+            tree->ext[n] = e;
+        } else {
+            ext[n] = e;
+        }
+        i += run;
+    }
+
+    uint32_t depth = tree ? 1 : 0;
+    inode->xattr_ptr = EXTENT_XATTR_FLAG;
+    inode->reserved_0 = EXTENT_MAGIC | depth << 16 | (tree ? 0 : n) << 24;
+    if (tree) {
+        image_block_put(img, (uint8_t *)tree, 1);
+        inode->reserved_1 = job->meta[0];
+        inode->reserved_2 = n;
+    } else {
+        if (n > 0) {
+            inode->reserved_1 = ext[0].start;
+            inode->reserved_2 = ext[0].len;
+        }
+        if (n > 1) {
+            inode->xattr_ptr |= (uint64_t)ext[1].start | (uint64_t)ext[1].len << 32;
+        }
+    }
+    return 0;
+}
+
+// Entry i of the pointer block block_num, or 0 if it cannot be read.
+static uint32_t block_ptr(image_t *img, uint32_t block_num, uint64_t i) {
+    const uint8_t *block_data = image_block_get(img, block_num, 0);
+    if (!block_data) {
+        return 0;
+    }
+    uint32_t ptr = ((const uint32_t *)block_data)[i];
+    image_block_put(img, block_data, 0);
+    return ptr;
+}
+
+// Physical block for logical in an extent block, or 0.
+static uint32_t extent_tree_lookup(const extent_block_t *tree, uint64_t logical) {
+    uint32_t lo = 0, hi = tree->count;   // find the last extent with ext.logical <= logical
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (tree->ext[mid].logical <= logical) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    const extent_t *e = &tree->ext[lo];
+    if (tree->count == 0 || logical < e->logical || logical - e->logical >= e->len) {
+        return 0;
+    }
+    return e->start + (uint32_t)(logical - e->logical);
+}
+
+// Physical block holding file block logical, or 0 for a hole / past EOF.
+// Extent-mapped files are searched with a binary search over their extents.
+static uint32_t file_block_lookup(image_t *img, const inode_t *inode, uint64_t logical) {
+    if (inode_is_extent_mapped(img->sb, inode)) {
+        uint32_t depth = (inode->reserved_0 >> 16) & 0xFF;
+        uint32_t count = inode->reserved_0 >> 24;
+        if (depth == 0) {
+            uint64_t first_len = count > 0 ? inode->reserved_2 : 0;
+            if (logical < first_len) {
+                return inode->reserved_1 + (uint32_t)logical;
+            }
+            uint64_t second_len = count > 1 ? extent_inline2_len(inode) : 0;
+            if (logical - first_len < second_len) {
+                return extent_inline2_start(inode) + (uint32_t)(logical - first_len);
+            }
+            return 0;
+        }
+        const extent_block_t *tree = (const extent_block_t *)image_block_get(img, inode->reserved_1, 0);
+        if (!tree) {
+            return 0;
+        }
+        uint32_t block = 0;
+        if (tree->magic == EXTENT_MAGIC && tree->count <= EXTENT_TREE_MAX) {
+            block = extent_tree_lookup(tree, logical);
+        }
+        image_block_put(img, (const uint8_t *)tree, 0);
+        return block;
+    }
+
+    if (logical < DIRECT_MAX) {
+        return inode->direct[logical];
+    }
+    logical -= DIRECT_MAX;
+    if (logical < PTRS_PER_BLOCK) {
+        return block_ptr(img, inode->reserved_0, logical);
+    }
+    logical -= PTRS_PER_BLOCK;
+    if (logical >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+        return 0;
+    }
+    uint32_t level2 = block_ptr(img, inode->reserved_1, logical / PTRS_PER_BLOCK);
+    return level2 ? block_ptr(img, level2, logical % PTRS_PER_BLOCK) : 0;
+}
+
+// Fill the job's indirect (or extent) blocks in the image and point the
+// inode at them.
+static int build_block_map(image_t *img, const add_job_t *job, inode_t *inode) {
+    if (job->use_extents) {
+        return build_extent_map(img, job, inode);
+    }
+    uint64_t i = 0, m = 0;
+    for (; i < job->blocks_needed && i < DIRECT_MAX; i++) {
+        inode->direct[i] = job->blocks[i];
+    }
+    if (i < job->blocks_needed) {
+        inode->reserved_0 = job->meta[m++];
+        uint32_t *ptrs = (uint32_t *)image_block_get(img, inode->reserved_0, BCACHE_NOREAD);
+        if (!ptrs) {
+            return -1;
+        }
+        memset(ptrs, 0, BS);
+        for (uint32_t j = 0; j < PTRS_PER_BLOCK && i < job->blocks_needed; j++) {
+            ptrs[j] = job->blocks[i++];
+        }
+        image_block_put(img, (uint8_t *)ptrs, 1);
+    }
+    if (i < job->blocks_needed) {
+        inode->reserved_1 = job->meta[m++];
+        uint32_t *level1 = (uint32_t *)image_block_get(img, inode->reserved_1, BCACHE_NOREAD);
+        if (!level1) {
+            return -1;
+        }
+        memset(level1, 0, BS);
+        for (uint32_t j = 0; j < PTRS_PER_BLOCK && i < job->blocks_needed; j++) {
+            level1[j] = job->meta[m++];
+            uint32_t *level2 = (uint32_t *)image_block_get(img, level1[j], BCACHE_NOREAD);
+            if (!level2) {
+                image_block_put(img, (uint8_t *)level1, 1);
+                return -1;
+            }
+            memset(level2, 0, BS);
+            for (uint32_t t = 0; t < PTRS_PER_BLOCK && i < job->blocks_needed; t++) {
+                level2[t] = job->blocks[i++];
+            }
+            image_block_put(img, (uint8_t *)level2, 1);
+        }
+        image_block_put(img, (uint8_t *)level1, 1);
+    }
+    return 0;
+}
+
+// Copy the touched ranges of the private bitmaps back into the image and
+// mark the bitmap blocks they cover for write-back.
+static void commit_bitmaps(image_t *img, const uint8_t *inode_bitmap, const uint8_t *data_bitmap, const dirty_map_t *dirty) {
+    for (size_t i = 0; i < dirty->count; i++) {
+        size_t off;
+        size_t len = span_bytes(&dirty->inode[i], &off);
+        memcpy(img->inode_bitmap + off, inode_bitmap + off, len);
+        region_mark(&img->inode_bitmap_dirty, off, len);
+        len = span_bytes(&dirty->data[i], &off);
+        memcpy(img->data_bitmap + off, data_bitmap + off, len);
+        region_mark(&img->data_bitmap_dirty, off, len);
+    }
+}
+
+// Recount the free inodes and blocks of every group the batch touched from
+// the (already updated) bitmaps in the image. Recounting rather than
+// subtracting also repairs counts left stale by tools unaware of groups.
+static int update_group_descs(image_t *img, const dirty_map_t *dirty) {
+    if (!img->groups) {
+        return 0;
+    }
+    const superblock_t *sb = img->sb;
+    uint32_t ngroups = img->group_count;
+    uint64_t per_group = sb->inode_count / ngroups;
+    uint8_t *touched = calloc(ngroups, 1);
+    if (!touched) {
+        return -1;
+    }
+    for (size_t i = 0; i < dirty->count; i++) {
+        const bitmap_span_t *ds = &dirty->data[i], *is = &dirty->inode[i];
+        for (uint64_t g = ds->lo / BLOCKS_PER_GROUP; ds->hi && g <= (ds->hi - 1) / BLOCKS_PER_GROUP; g++) {
+            touched[g < ngroups ? g : ngroups - 1] = 1;
+        }
+        for (uint64_t g = is->lo / per_group; is->hi && g <= (is->hi - 1) / per_group; g++) {
+            touched[g] = 1;
+        }
+    }
+    for (uint32_t g = 0; g < ngroups; g++) {
+        if (!touched[g]) {
+            continue;
+        }
+        group_desc_t *gd = &img->groups[g];
+        uint64_t first = (uint64_t)g * BLOCKS_PER_GROUP;
+        gd->free_blocks = gd->data_blocks - (uint32_t)vsfs_bitmap_count_set(img->data_bitmap, sb->data_region_blocks,
+                                                                            first, first + gd->data_blocks);
+        gd->free_inodes = gd->inode_count - (uint32_t)vsfs_bitmap_count_set(img->inode_bitmap, sb->inode_count,
+                                                                            gd->first_inode - 1, gd->first_inode - 1 + gd->inode_count);
+        group_desc_finalize(gd);
+        region_mark(&img->gdt_dirty, (uint64_t)g * sizeof(*gd), sizeof(*gd));
+    }
+    free(touched);
+    return 0;
+}
+
+// Reserve an inode from bits [inode_first, inode_end) and data blocks from
+// ba for one job (a stream already has its data blocks, only its map blocks
+// are reserved). On failure nothing stays reserved; the message is left to
+// the caller, which may retry elsewhere.
+typedef enum { PLAN_OK = 0, PLAN_NO_INODE, PLAN_NO_SPACE, PLAN_NO_MEMORY } plan_status_t;
+
+static plan_status_t plan_job(add_job_t *job, uint8_t *inode_bitmap, uint64_t inode_first, uint64_t inode_end,
+                       uint32_t *inode_hint, bitmap_span_t *inode_dirty, block_alloc_t *ba) {
+    uint32_t inode_num = find_free_inode(inode_bitmap, inode_first, inode_end, *inode_hint);
+    if (inode_num == 0) {
+        return PLAN_NO_INODE;
+    }
+
+    // data first so it lands in one run, then its indirect blocks
+    free(job->meta);
+    job->meta = NULL;
+    if (job->fd < 0) {
+        free(job->blocks);
+        job->blocks = malloc((job->blocks_needed + 1) * sizeof(uint32_t));
+        if (!job->blocks) {
+            return PLAN_NO_MEMORY;
+        }
+        if (alloc_data_blocks(ba, job->blocks_needed, job->blocks) < 0) {
+            return PLAN_NO_SPACE;
+        }
+    }
+    job->use_extents = 0;
+    if (ba->sb->flags & SB_FLAG_EXTENTS) {
+        job->extent_count = count_runs(job->blocks, job->blocks_needed);
+        if (job->extent_count <= EXTENT_INLINE_MAX) {
+            job->use_extents = 1;
+            job->meta_needed = 0;
+        } else if (job->extent_count <= EXTENT_TREE_MAX) {
+            job->use_extents = 1;
+            job->meta_needed = 1;
+        } else {
+            job->meta_needed = indirect_blocks_needed(job->blocks_needed);
+        }
+    }
+    job->meta = malloc((job->meta_needed + 1) * sizeof(uint32_t));
+    if (!job->meta || alloc_data_blocks(ba, job->meta_needed, job->meta) < 0) {
+        for (uint64_t i = 0; job->fd < 0 && i < job->blocks_needed; i++) {
+            vsfs_bitmap_clear(ba->bitmap, job->blocks[i] - ba->sb->data_region_start);
+        }
+        return job->meta ? PLAN_NO_SPACE : PLAN_NO_MEMORY;
+    }
+
+    set_bit(inode_bitmap, inode_num - 1); // Convert to 0-indexed
+    span_add(inode_dirty, inode_num - 1, 1);
+    job->inode_num = inode_num;
+    *inode_hint = inode_num;
+    return PLAN_OK;
+}
+
+// Jobs of a batch bucketed by block group, and the groups one worker
+// thread allocates in (every stride-th group from first).
+typedef struct {
+    image_t *img;
+    job_list_t *list;
+    const size_t *order;           // job indices sorted by group
+    const size_t *group_start;     // order[group_start[g] .. group_start[g + 1]) are group g's jobs
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    dirty_map_t *dirty;
+    uint32_t first;
+    uint32_t stride;
+    int failed;
+} group_worker_t;
+
+// Allocate every job of the worker's groups inside its own group. Groups
+// own disjoint, word-aligned slices of both bitmaps, so workers never touch
+// the same byte. A job that does not fit after all (the descriptor counts
+// were stale) is released to the whole-image pass.
+static void *group_worker(void *arg) {
+    group_worker_t *w = arg;
+    const superblock_t *sb = w->img->sb;
+    for (uint32_t g = w->first; g < w->img->group_count; g += w->stride) {
+        const group_desc_t *gd = &w->img->groups[g];
+        uint64_t first = (uint64_t)g * BLOCKS_PER_GROUP;
+        block_alloc_t ba = { sb, w->data_bitmap, first, &w->dirty->data[1 + g], first, first + gd->data_blocks };
+        uint32_t hint = 0;
+        for (size_t i = w->group_start[g]; i < w->group_start[g + 1]; i++) {
+            add_job_t *job = &w->list->jobs[w->order[i]];
+            plan_status_t st = plan_job(job, w->inode_bitmap, gd->first_inode - 1, gd->first_inode - 1 + gd->inode_count,
+                                        &hint, &w->dirty->inode[1 + g], &ba);
+            if (st == PLAN_NO_MEMORY) {
+                w->failed = 1;
+                return NULL;
+            }
+            if (st != PLAN_OK) {
+                job->group = -1;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Place each job in a block group with room for its inode and blocks,
+// starting from a group picked by its name hash so independent files spread
+// over the image, then allocate all groups in parallel. The file's inode and
+// data end up in the same group. Jobs no group can take keep group -1.
+static int plan_groups(image_t *img, job_list_t *list, uint8_t *inode_bitmap, uint8_t *data_bitmap,
+                dirty_map_t *dirty) {
+    uint32_t ngroups = img->group_count;
+    uint64_t *free_blocks = malloc(ngroups * sizeof(uint64_t));
+    uint64_t *free_inodes = malloc(ngroups * sizeof(uint64_t));
+    size_t *group_start = calloc(ngroups + 2, sizeof(size_t));
+    size_t *order = malloc((list->count + 1) * sizeof(size_t));
+    if (!free_blocks || !free_inodes || !group_start || !order) {
+        free(free_blocks);
+        free(free_inodes);
+        free(group_start);
+        free(order);
+        vsfs_set_error("Out of memory");
+        return -1;
+    }
+    for (uint32_t g = 0; g < ngroups; g++) {
+        free_blocks[g] = img->groups[g].free_blocks;
+        free_inodes[g] = img->groups[g].free_inodes;
+    }
+    // With a lazy inode table, spread only over groups whose inodes are
+    // (partly) initialized so the high-water mark grows one group at a time
+    uint32_t spread = ngroups;
+    if (img->sb->flags & SB_FLAG_LAZY_ITABLE) {
+        uint64_t per_group = img->sb->inode_count / ngroups;
+        uint64_t ready = (img->sb_ext->itable_initialized * (BS / INODE_SIZE) + per_group - 1) / per_group;
+        spread = ready < ngroups ? (uint32_t)ready : ngroups;
+    }
+
+    for (size_t k = 0; k < list->count; k++) {
+        add_job_t *job = &list->jobs[k];
+        uint64_t need = job->blocks_needed + job->meta_needed + 1;   // +1: a possible extent block
+        uint32_t start = dir_hash(job->name) % spread;
+        job->group = -1;
+        if (job->fd >= 0) {
+            continue;   // its data is already placed, map it from the whole image
+        }
+        for (uint32_t i = 0; i < ngroups; i++) {
+            uint32_t g = (start + i) % ngroups;
+            if (free_inodes[g] > 0 && free_blocks[g] >= need) {
+                free_inodes[g]--;
+                free_blocks[g] -= need;
+                job->group = g;
+                group_start[g + 2]++;
+                break;
+            }
+        }
+    }
+    // counting sort of the jobs by group
+    for (uint32_t g = 0; g < ngroups; g++) {
+        group_start[g + 2] += group_start[g + 1];
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        if (list->jobs[k].group >= 0) {
+            order[group_start[list->jobs[k].group + 1]++] = k;
+        }
+    }
+
+    uint32_t busy = 0;
+    for (uint32_t g = 0; g < ngroups; g++) {
+        busy += group_start[g + 1] > group_start[g];
+    }
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nworkers = busy;
+    if (ncpu > 0 && nworkers > (uint32_t)ncpu) nworkers = (uint32_t)ncpu;
+    if (nworkers > GROUP_WORKERS_MAX) nworkers = GROUP_WORKERS_MAX;
+    if (nworkers == 0) nworkers = 1;
+
+    group_worker_t workers[GROUP_WORKERS_MAX];
+    pthread_t threads[GROUP_WORKERS_MAX];
+    uint32_t started = 0;
+    for (uint32_t t = 0; t < nworkers; t++) {
+        workers[t] = (group_worker_t){ img, list, order, group_start, inode_bitmap, data_bitmap, dirty, t, nworkers, 0 };
+        // the last worker runs on this thread
+        if (t + 1 < nworkers && pthread_create(&threads[t], NULL, group_worker, &workers[t]) == 0) {
+            started++;
+        } else {
+            group_worker(&workers[t]);
+        }
+    }
+    int failed = 0;
+    for (uint32_t t = 0; t < nworkers; t++) {
+        if (t < started) {
+            pthread_join(threads[t], NULL);
+        }
+        failed |= workers[t].failed;
+    }
+    free(free_blocks);
+    free(free_inodes);
+    free(group_start);
+    free(order);
+    if (failed) {
+        vsfs_set_error("Out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+// Reserve an inode, data blocks and a root directory slot for every job.
+// Allocation runs against in-memory copies of the bitmaps so nothing in the
+// image changes until all files are known to fit. On images with block
+// groups files are first placed group by group; anything left, and the
+// directory's own blocks, is allocated across the whole image. New entries
+// are added to idx; a full directory grows by one block at a time. The bits
+// changed in each bitmap are recorded in dirty.
+static int plan_batch(image_t *img, job_list_t *list, uint8_t *inode_bitmap, uint8_t *data_bitmap,
+               dirty_map_t *dirty, dir_index_t *idx, dir_plan_t *dp) {
+    const superblock_t *sb = img->sb;
+    block_alloc_t ba = { sb, data_bitmap, 0, &dirty->data[0], 0, sb->data_region_blocks };
+    uint32_t inode_hint = 0;
+    for (size_t k = 0; k < list->count; k++) {
+        list->jobs[k].group = -1;
+    }
+    if (img->groups && plan_groups(img, list, inode_bitmap, data_bitmap, dirty) != 0) {
+        return -1;
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        add_job_t *job = &list->jobs[k];
+        if (job->group >= 0) {
+            continue;
+        }
+        switch (plan_job(job, inode_bitmap, 0, sb->inode_count, &inode_hint, &dirty->inode[0], &ba)) {
+        case PLAN_OK:
+            break;
+        case PLAN_NO_INODE:
+            vsfs_set_error("No free inodes available");
+            return -1;
+        case PLAN_NO_SPACE:
+            vsfs_set_error("No free data blocks available");
+            return -1;
+        case PLAN_NO_MEMORY:
+            vsfs_set_error("Out of memory");
+            return -1;
+        }
+    }
+
+    // Hand out free directory slots from the index's next-free hint
+    inode_t root_inode;
+    if (image_read_inode(img, ROOT_INO, &root_inode) != 0) {
+        vsfs_set_error("Cannot read root inode");
+        return -1;
+    }
+    memset(dp, 0, sizeof(*dp));
+    uint32_t loc = idx->next_free;
+    for (size_t k = 0; k < list->count; k++, loc++) {
+        for (;; loc++) {
+            if (loc >= DIR_MAX_ENTRIES) {
+                vsfs_set_error("Root directory is full");
+                return -1;
+            }
+            uint32_t blk = loc / DIRENTS_PER_BLOCK;
+            if (root_inode.direct[blk] == 0) {
+                if (dp->new_dir_blocks[blk] == 0 &&
+                    alloc_data_blocks(&ba, 1, &dp->new_dir_blocks[blk]) < 0) {
+                    vsfs_set_error("No free data blocks available");
+                    return -1;
+                }
+                break; // fresh block, every slot is free
+            }
+            dirent64_t entry;
+            if (dir_entry_read(img, &root_inode, loc, &entry) <= 0) {
+                vsfs_set_error("Cannot read root directory block");
+                return -1;
+            }
+            if (entry.inode_no == 0) {
+                break;
+            }
+        }
+        list->jobs[k].dir_loc = loc;
+        dir_index_insert(idx, list->jobs[k].name, loc);
+    }
+    idx->next_free = loc;
+
+    // Keep using our index block if it is still allocated, else take a new one
+    uint64_t ib = root_inode.reserved_2;
+    if (!((sb->flags & SB_FLAG_DIR_INDEX) && ib >= sb->data_region_start && ib < sb->data_region_start + sb->data_region_blocks &&
+          vsfs_bitmap_test(data_bitmap, ib - sb->data_region_start))) {
+        if (alloc_data_blocks(&ba, 1, &dp->index_block) < 0) {
+            vsfs_set_error("No free data blocks available");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A stream's writer thread and the chunk handed to it, if any. busy is set
+// from when a chunk is handed over until it has been written.
+typedef struct {
+    image_t *img;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const uint8_t *buf;
+    const uint32_t *blocks;        // blocks[0..count) receive buf
+    uint64_t count;
+    int busy;
+    int done;                      // no more chunks are coming
+    int rc;
+} chunk_writer_t;
+
+static int write_chunk(image_t *img, const uint8_t *buf, const uint32_t *blocks, uint64_t count) {
+    for (uint64_t i = 0; i < count; ) {
+        uint64_t run = contiguous_blocks(blocks, i, count);
+        if (io_write(&img->io, buf + i * BS, run * BS, (uint64_t)blocks[i] * BS) != 0) {
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+static void *chunk_writer(void *arg) {
+    chunk_writer_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->busy && !w->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (!w->busy) {
+            break;
+        }
+        pthread_mutex_unlock(&w->lock);
+        int rc = write_chunk(w->img, w->buf, w->blocks, w->count);
+        pthread_mutex_lock(&w->lock);
+        w->rc |= rc;
+        w->busy = 0;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Wait until the chunk handed to the writer, if any, has been written.
+// Returns -1 if any chunk failed to write.
+static int chunk_wait(chunk_writer_t *w) {
+    pthread_mutex_lock(&w->lock);
+    while (w->busy) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    int rc = w->rc;
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+// Read up to len bytes, stopping early only at end of file. Returns the
+// number of bytes read or -1.
+static ssize_t read_chunk(int fd, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+// Read a stream job to end of file, whose length is not known up front.
+// Blocks are allocated from ba as each chunk arrives. One writer thread
+// per stream stores each chunk while the next is read into the other
+// buffer; without it, chunks are written in turn. Sets the job's size and
+// block counts from what was read.
+static int stream_file_data(image_t *img, add_job_t *job, block_alloc_t *ba) {
+    uint8_t *buf[2] = { NULL, NULL };
+    uint64_t cap = STREAM_CHUNK / BS;
+    free(job->blocks);
+    job->blocks = malloc(cap * sizeof(uint32_t));
+    if (!job->blocks || posix_memalign((void **)&buf[0], BS, STREAM_CHUNK) != 0 ||
+        posix_memalign((void **)&buf[1], BS, STREAM_CHUNK) != 0) {
+        free(buf[0]);
+        vsfs_set_error("Out of memory");
+        return -1;
+    }
+    job->size = 0;
+    job->blocks_needed = 0;
+
+    chunk_writer_t w = { .img = img };
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    pthread_t thread;
+    int threaded = pthread_create(&thread, NULL, chunk_writer, &w) == 0;
+    int eof = 0, rc = 0;
+    for (int cur = 0; rc == 0; cur ^= 1) {
+        ssize_t got = eof ? 0 : read_chunk(job->fd, buf[cur], STREAM_CHUNK);
+        // the other buffer, and job->blocks, are free again once its chunk
+        // is written
+        if (chunk_wait(&w) != 0) {
+            vsfs_set_error("Cannot write file data block");
+            rc = -1;
+            break;
+        }
+        if (got < 0) {
+            vsfs_set_error("Cannot read file data from '%s': %s", job->path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        eof = (size_t)got < STREAM_CHUNK;
+
+        uint64_t count = ((uint64_t)got + BS - 1) / BS;
+        if (job->blocks_needed + count > FILE_MAX_BLOCKS) {
+            vsfs_set_error("File '%s' is too large", job->path);
+            rc = -1;
+            break;
+        }
+        if (job->blocks_needed + count > cap) {
+            cap *= 2;
+            uint32_t *blocks = realloc(job->blocks, cap * sizeof(uint32_t));
+            if (!blocks) {
+                vsfs_set_error("Out of memory");
+                rc = -1;
+                break;
+            }
+            job->blocks = blocks;
+        }
+        if (alloc_data_blocks(ba, count, job->blocks + job->blocks_needed) < 0) {
+            vsfs_set_error("No free data blocks available");
+            rc = -1;
+            break;
+        }
+        memset(buf[cur] + got, 0, count * BS - (uint64_t)got);
+        const uint32_t *blocks = job->blocks + job->blocks_needed;
+        job->blocks_needed += count;
+        job->size += (uint64_t)got;
+        if (!threaded) {
+            w.rc = write_chunk(img, buf[cur], blocks, count);
+            continue;
+        }
+        pthread_mutex_lock(&w.lock);
+        w.buf = buf[cur];
+        w.blocks = blocks;
+        w.count = count;
+        w.busy = 1;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+    }
+    if (threaded) {
+        pthread_mutex_lock(&w.lock);
+        w.done = 1;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+        pthread_join(thread, NULL);
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    free(buf[0]);
+    free(buf[1]);
+    job->meta_needed = indirect_blocks_needed(job->blocks_needed);
+    return rc;
+}
+
+// Copy a host file into its reserved blocks, one piece per contiguous run
+// of blocks, through the image's I/O backend. In direct mode the source is
+// read with O_DIRECT too where its file system allows it, else it is read
+// through the page cache and dropped from it afterwards.
+static int write_file_data(image_t *img, const add_job_t *job) {
+    int direct = img->io.data_fd >= 0;
+    int file_fd = -1;
+    if (direct) {
+        file_fd = open(job->path, O_RDONLY | O_DIRECT);
+    }
+    if (file_fd < 0) {
+        file_fd = open(job->path, O_RDONLY);
+    }
+    if (file_fd < 0) {
+        vsfs_set_error("Cannot open file '%s' for reading: %s", job->path, strerror(errno));
+        return -1;
+    }
+    io_copy_t *copies = malloc((count_runs(job->blocks, job->blocks_needed) + 1) * sizeof(*copies));
+    if (!copies) {
+        vsfs_set_error("Out of memory");
+        close(file_fd);
+        return -1;
+    }
+    size_t n = 0;
+    for (uint64_t i = 0; i < job->blocks_needed; ) {
+        uint64_t run = contiguous_blocks(job->blocks, i, job->blocks_needed);
+        size_t bytes_to_read = run * BS;
+        if (i + run == job->blocks_needed) {
+            bytes_to_read = job->size - (i * BS);
+        }
+        copies[n++] = (io_copy_t){ i * BS, (uint64_t)job->blocks[i] * BS, bytes_to_read, run * BS };
+        i += run;
+    }
+
+    int rc = io_copy_in(&img->io, file_fd, copies, n);
+    if (rc == IO_COPY_SRC_ERROR) {
+        vsfs_set_error("Cannot read file data: %s", strerror(errno));
+    } else if (rc != 0) {
+        vsfs_set_error("Cannot write file data block: %s", strerror(errno));
+    }
+    if (direct) {
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    free(copies);
+    close(file_fd);
+    return rc == 0 ? 0 : -1;
+}
+
+// An open image. The bitmaps are cached as working copies that batches
+// allocate against; a batch copies only the spans it touched into the
+// image, or back out of it if the batch fails. The root directory index is
+// loaded (or rebuilt) once and kept current by every add.
+struct vsfs {
+    image_t img;
+    int flags;
+    uint8_t *inode_bitmap;         // NULL when read-only
+    uint8_t *data_bitmap;
+    dir_index_t *idx;
+    int failed;                    // a batch failed after committing its allocations; nothing more is written
+};
+
+static pthread_once_t lib_once = PTHREAD_ONCE_INIT;
+
+static void lib_init(void) {
+    crc32_init();
+    vsfs_bitmap_init();
+}
+
+static void vsfs_release(vsfs_t *fs) {
+    image_close(&fs->img);
+    free(fs->inode_bitmap);
+    free(fs->data_bitmap);
+    free(fs->idx);
+    free(fs);
+}
+
+vsfs_t *vsfs_open(const char *path, int flags) {
+    vsfs_open_opts_t opts = { flags, 0, VSFS_IO_PREAD };
+    return vsfs_open_with(path, &opts);
+}
+
+vsfs_t *vsfs_open_with(const char *path, const vsfs_open_opts_t *opts) {
+    pthread_once(&lib_once, lib_init);
+    vsfs_t *fs = calloc(1, sizeof(*fs));
+    if (!fs) {
+        vsfs_set_error("Out of memory");
+        return NULL;
+    }
+    fs->flags = opts->flags;
+    if (image_open(&fs->img, path, (opts->flags & VSFS_RDWR) != 0, opts->io, (opts->flags & VSFS_DIRECT) != 0,
+                   opts->cache_blocks) != 0) {
+        free(fs);
+        return NULL;
+    }
+    const superblock_t *sb = fs->img.sb;
+    inode_t root_inode;
+    if (image_read_inode(&fs->img, ROOT_INO, &root_inode) != 0) {
+        vsfs_set_error("Cannot read root inode");
+        goto fail;
+    }
+
+    // Load the directory index, rebuilding it if it is missing or stale
+    fs->idx = malloc(sizeof(dir_index_t));
+    if (!fs->idx) {
+        vsfs_set_error("Out of memory");
+        goto fail;
+    }
+    if (dir_index_load(&fs->img, &root_inode, fs->idx) != 0 && dir_index_build(&fs->img, &root_inode, fs->idx) != 0) {
+        vsfs_set_error("Cannot read root directory block");
+        goto fail;
+    }
+
+    if (fs->img.writable) {
+        size_t inode_bitmap_bytes = sb->inode_bitmap_blocks * BS;
+        size_t data_bitmap_bytes = sb->data_bitmap_blocks * BS;
+        fs->inode_bitmap = malloc(inode_bitmap_bytes);
+        fs->data_bitmap = malloc(data_bitmap_bytes);
+        if (!fs->inode_bitmap || !fs->data_bitmap) {
+            vsfs_set_error("Out of memory");
+            goto fail;
+        }
+        memcpy(fs->inode_bitmap, fs->img.inode_bitmap, inode_bitmap_bytes);
+        memcpy(fs->data_bitmap, fs->img.data_bitmap, data_bitmap_bytes);
+    }
+    return fs;
+
+fail:
+    vsfs_release(fs);
+    return NULL;
+}
+
+int vsfs_close(vsfs_t *fs) {
+    int rc = fs->failed ? 0 : image_commit(&fs->img);
+    if (rc != 0) {
+        vsfs_set_error("Cannot write image: %s", strerror(errno));
+    }
+    vsfs_release(fs);
+    return rc;
+}
+
+void vsfs_get_info(const vsfs_t *fs, vsfs_info_t *info) {
+    const superblock_t *sb = fs->img.sb;
+    info->total_blocks = sb->total_blocks;
+    info->inode_count = sb->inode_count;
+    info->inode_table_blocks = sb->inode_table_blocks;
+    info->data_region_start = sb->data_region_start;
+    info->data_region_blocks = sb->data_region_blocks;
+    info->group_count = fs->img.group_count;
+    info->inodes_per_group = fs->img.group_count ? sb->inode_count / fs->img.group_count : 0;
+}
+
+const char *vsfs_io_backend(const vsfs_t *fs) {
+    return fs->img.io.ops->name;
+}
+
+int vsfs_io_from_name(const char *name) {
+    static const char *const names[] = { "pread", "stdio", "mmap", "uring" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void vsfs_get_cache_stats(vsfs_t *fs, vsfs_cache_stats_t *stats) {
+    bcache_t *c = &fs->img.cache;
+    pthread_mutex_lock(&c->lock);
+    stats->blocks = c->nbufs;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->writebacks = c->writebacks;
+    stats->write_calls = c->write_calls;
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Inode number of name in the root directory, or 0 if it is not there.
+static uint32_t root_lookup(vsfs_t *fs, const char *name) {
+    char key[58] = {0};
+    strncpy(key, name, sizeof(key) - 1);
+    inode_t root_inode;
+    dirent64_t entry;
+    if (image_read_inode(&fs->img, ROOT_INO, &root_inode) != 0) {
+        return 0;
+    }
+    int loc = dir_index_lookup(&fs->img, &root_inode, fs->idx, key);
+    if (loc < 0 || dir_entry_read(&fs->img, &root_inode, (uint32_t)loc, &entry) <= 0) {
+        return 0;
+    }
+    return entry.inode_no;
+}
+
+// Copy inode inode_num if it lies in the initialized part of the inode
+// table. Returns 0, or -1 if it does not.
+static int initialized_inode(image_t *img, uint32_t inode_num, inode_t *out) {
+    if ((img->sb->flags & SB_FLAG_LAZY_ITABLE) && inode_num != 0 &&
+        (uint64_t)(inode_num - 1) * INODE_SIZE / BS >= img->sb_ext->itable_initialized) {
+        return -1;
+    }
+    return image_read_inode(img, inode_num, out);
+}
+
+// Look name up and copy its inode, setting the error for vsfs_read() and
+// vsfs_extract() if it is missing or not a regular file.
+static int lookup_file(vsfs_t *fs, const char *name, inode_t *inode) {
+    uint32_t inode_num = root_lookup(fs, name);
+    if (inode_num == 0) {
+        vsfs_set_error("File '%s' not found in the file system", name);
+        return -1;
+    }
+    if (initialized_inode(&fs->img, inode_num, inode) != 0) {
+        vsfs_set_error("Corrupt directory entry for '%s'", name);
+        return -1;
+    }
+    if ((inode->mode & 0170000) != 0100000) {
+        vsfs_set_error("'%s' is not a regular file", name);
+        return -1;
+    }
+    return 0;
+}
+
+int vsfs_stat(vsfs_t *fs, const char *name, vsfs_stat_t *st) {
+    uint32_t inode_num = root_lookup(fs, name);
+    if (inode_num == 0) {
+        return 0;
+    }
+    inode_t inode;
+    if (initialized_inode(&fs->img, inode_num, &inode) != 0) {
+        vsfs_set_error("Corrupt directory entry for '%s'", name);
+        return -1;
+    }
+    if (st) {
+        st->inode = inode_num;
+        st->mode = inode.mode;
+        st->size = inode.size_bytes;
+        st->mtime = inode.mtime;
+    }
+    return 1;
+}
+
+// File data is read straight from the image, one pread per run of
+// physically contiguous blocks.
+ssize_t vsfs_read(vsfs_t *fs, const char *name, void *buf, size_t len, uint64_t offset) {
+    inode_t inode;
+    if (lookup_file(fs, name, &inode) != 0) {
+        return -1;
+    }
+    if (offset >= inode.size_bytes) {
+        return 0;
+    }
+    if (len > inode.size_bytes - offset) len = (size_t)(inode.size_bytes - offset);
+    if (len > SSIZE_MAX) len = SSIZE_MAX;
+
+    image_t *img = &fs->img;
+    uint8_t *out = buf;
+    for (size_t done = 0; done < len; ) {
+        uint64_t pos = offset + done;
+        size_t in_block = (size_t)(pos % BS);
+        size_t chunk = BS - in_block < len - done ? BS - in_block : len - done;
+        uint32_t block = file_block_lookup(img, &inode, pos / BS);
+        // extend the chunk over following blocks that are adjacent on disk
+        while (block != 0 && done + chunk < len &&
+               file_block_lookup(img, &inode, (pos + chunk) / BS) == block + (in_block + chunk) / BS) {
+            chunk += len - done - chunk < BS ? len - done - chunk : BS;
+        }
+        if (block == 0) {
+            memset(out + done, 0, chunk); // hole
+        } else {
+            if (block + (in_block + chunk - 1) / BS >= img->sb->total_blocks) {
+                vsfs_set_error("Corrupt block map in '%s'", name);
+                return -1;
+            }
+            if (io_read(&img->io, out + done, chunk, (uint64_t)block * BS + in_block) != 0) {
+                vsfs_set_error("Cannot read '%s': %s", name, strerror(errno));
+                return -1;
+            }
+        }
+        done += chunk;
+    }
+    return (ssize_t)len;
+}
+
+int vsfs_readdir(vsfs_t *fs, int (*fn)(const vsfs_dirent_t *de, void *arg), void *arg) {
+    inode_t root_inode;
+    if (image_read_inode(&fs->img, ROOT_INO, &root_inode) != 0) {
+        vsfs_set_error("Cannot read root inode");
+        return -1;
+    }
+    dirent64_t entries[DIRENTS_PER_BLOCK];
+    for (uint32_t blk = 0; blk < DIRECT_MAX; blk++) {
+        if (root_inode.direct[blk] == 0) {
+            continue;
+        }
+        // copy the block out so fn may call back into the library
+        const uint8_t *block_data = image_block_get(&fs->img, root_inode.direct[blk], 0);
+        if (!block_data) {
+            vsfs_set_error("Cannot read root directory block");
+            return -1;
+        }
+        memcpy(entries, block_data, BS);
+        image_block_put(&fs->img, block_data, 0);
+
+        for (uint32_t e = 0; e < DIRENTS_PER_BLOCK; e++) {
+            const dirent64_t *entry = &entries[e];
+            if (entry->inode_no == 0 || strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+                continue;
+            }
+            vsfs_dirent_t de;
+            memcpy(de.name, entry->name, VSFS_NAME_MAX);
+            de.name[VSFS_NAME_MAX] = '\0';
+            inode_t inode;
+            if (initialized_inode(&fs->img, entry->inode_no, &inode) != 0) {
+                vsfs_set_error("Corrupt directory entry for '%s'", de.name);
+                return -1;
+            }
+            de.st.inode = entry->inode_no;
+            de.st.mode = inode.mode;
+            de.st.size = inode.size_bytes;
+            de.st.mtime = inode.mtime;
+            int rc = fn(&de, arg);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+// Copy the file's data to out_fd run by run: physically contiguous blocks
+// go out as one copy_range() from the image file, so the bytes never pass
+// through user space when the kernel can help. Holes are left as holes.
+int vsfs_extract(vsfs_t *fs, const char *name, int out_fd) {
+    inode_t inode;
+    if (lookup_file(fs, name, &inode) != 0) {
+        return -1;
+    }
+    image_t *img = &fs->img;
+
+    copy_mode_t mode = COPY_CFR;
+    uint64_t blocks = (inode.size_bytes + BS - 1) / BS;
+    for (uint64_t i = 0; i < blocks; ) {
+        uint32_t start = file_block_lookup(img, &inode, i);
+        uint64_t run = 1;
+        while (i + run < blocks && file_block_lookup(img, &inode, i + run) == (start ? start + run : 0)) {
+            run++;
+        }
+        if (start != 0) {
+            if (start + run > img->sb->total_blocks) {
+                vsfs_set_error("Corrupt block map in '%s'", name);
+                return -1;
+            }
+            uint64_t bytes = inode.size_bytes - i * BS < run * BS ? inode.size_bytes - i * BS : run * BS;
+            if (copy_range(img->fd, (off_t)start * BS, out_fd, (off_t)(i * BS), (off_t)bytes, &mode) != 0) {
+                vsfs_set_error("Cannot extract '%s': %s", name, strerror(errno));
+                return -1;
+            }
+        }
+        i += run;
+    }
+    if (ftruncate(out_fd, (off_t)inode.size_bytes) != 0) {
+        vsfs_set_error("Cannot extract '%s': %s", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Updates need a writable handle that no failed batch has left with
+// changes it could not take back.
+static int check_writable(vsfs_t *fs) {
+    if (!fs->img.writable) {
+        vsfs_set_error("Image is open read-only");
+        return -1;
+    }
+    if (fs->failed) {
+        vsfs_set_error("An earlier update failed; reopen the image to make changes");
+        return -1;
+    }
+    return 0;
+}
+
+int vsfs_init_itable(vsfs_t *fs) {
+    if (check_writable(fs) != 0) {
+        return -1;
+    }
+    if (itable_init_all(&fs->img, (fs->flags & VSFS_SYNC) != 0) != 0) {
+        vsfs_set_error("Cannot initialize inode table: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Stat every host file of a batch and reject anything that cannot be added
+// before a single block is allocated. FIFOs and character devices become
+// streams, opened only once everything else checked out since opening a
+// FIFO waits for its writer.
+static int prepare_jobs(vsfs_t *fs, job_list_t *list) {
+    for (size_t k = 0; k < list->count; k++) {
+        add_job_t *job = &list->jobs[k];
+        struct stat file_stat;
+        if (job->fd >= 0) {
+            // already a stream
+        } else if (stat(job->path, &file_stat) != 0) {
+            vsfs_set_error("File '%s' not found in current directory", job->path);
+            return -1;
+        } else if (S_ISFIFO(file_stat.st_mode) || S_ISCHR(file_stat.st_mode)) {
+            job->own_fd = 1;
+        } else if (!S_ISREG(file_stat.st_mode)) {
+            vsfs_set_error("'%s' is not a regular file", job->path);
+            return -1;
+        } else {
+            job->size = file_stat.st_size;
+            job->blocks_needed = (job->size + BS - 1) / BS;
+            if (job->blocks_needed > FILE_MAX_BLOCKS) {
+                vsfs_set_error("File '%s' is too large", job->path);
+                return -1;
+            }
+            job->meta_needed = indirect_blocks_needed(job->blocks_needed);
+        }
+
+        for (size_t m = 0; m < k; m++) {
+            if (strcmp(list->jobs[m].name, job->name) == 0) {
+                vsfs_set_error("File '%s' is listed more than once", job->path);
+                return -1;
+            }
+        }
+        if (root_lookup(fs, job->name) != 0) {
+            vsfs_set_error("File '%s' already exists in the file system", job->path);
+            return -1;
+        }
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        add_job_t *job = &list->jobs[k];
+        if (job->own_fd) {
+            job->fd = open(job->path, O_RDONLY);
+            if (job->fd < 0) {
+                vsfs_set_error("Cannot open file '%s' for reading: %s", job->path, strerror(errno));
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Undo a failed batch in the cached bitmaps by copying the spans it touched
+// back from the image, which the batch had not changed yet.
+static void revert_bitmaps(vsfs_t *fs, const dirty_map_t *dirty) {
+    for (size_t i = 0; i < dirty->count; i++) {
+        size_t off;
+        size_t len = span_bytes(&dirty->inode[i], &off);
+        memcpy(fs->inode_bitmap + off, fs->img.inode_bitmap + off, len);
+        len = span_bytes(&dirty->data[i], &off);
+        memcpy(fs->data_bitmap + off, fs->img.data_bitmap + off, len);
+    }
+}
+
+// Clear what a failed and discarded batch may have had evicted to the
+// image before the failure: its inodes and its entries in directory blocks
+// the image's root inode has. The image's bitmaps never marked either, and
+// earlier batches were written out first, so this restores those blocks.
+// Best effort; the error that failed the batch is the one reported.
+static void scrub_batch(vsfs_t *fs, const job_list_t *list) {
+    image_t *img = &fs->img;
+    inode_t root_inode;
+    inode_update_t *updates = calloc(list->count, sizeof(inode_update_t));
+    if (!updates || image_read_inode(img, ROOT_INO, &root_inode) != 0) {
+        free(updates);
+        return;
+    }
+    const dirent64_t empty = {0};
+    for (size_t k = 0; k < list->count; k++) {
+        updates[k].num = list->jobs[k].inode_num;
+        dir_entry_write(img, &root_inode, list->jobs[k].dir_loc, &empty);
+    }
+    image_write_inodes(img, updates, list->count);
+    free(updates);
+    image_commit(img);
+    image_discard(img);
+}
+
+// Allocate, write and link every job of a prepared batch. *committed is
+// set once the batch's allocations have reached the image's bitmaps.
+static int add_jobs(vsfs_t *fs, job_list_t *list, dirty_map_t *dirty, int *committed) {
+    image_t *img = &fs->img;
+    superblock_t *sb = img->sb;
+    int in_place = (fs->flags & VSFS_SYNC) != 0;
+    inode_t root_inode;
+    if (image_read_inode(img, ROOT_INO, &root_inode) != 0) {
+        vsfs_set_error("Cannot read root inode");
+        return -1;
+    }
+
+    // Streams are read to the end first, taking blocks as data arrives;
+    // their size is only known (and recorded in the inode) once they end
+    block_alloc_t ba = { sb, fs->data_bitmap, 0, &dirty->data[0], 0, sb->data_region_blocks };
+    for (size_t k = 0; k < list->count; k++) {
+        if (list->jobs[k].fd >= 0 && stream_file_data(img, &list->jobs[k], &ba) != 0) {
+            return -1;
+        }
+    }
+
+    dir_plan_t dp;
+    if (plan_batch(img, list, fs->inode_bitmap, fs->data_bitmap, dirty, fs->idx, &dp) != 0) {
+        return -1;
+    }
+
+    // Write the other files' data straight to its blocks and build the
+    // indirect blocks in the cache, pointed at from scratch inodes
+    inode_update_t *updates = calloc(list->count, sizeof(inode_update_t));
+    if (!updates) {
+        vsfs_set_error("Out of memory");
+        return -1;
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        if (list->jobs[k].fd < 0 && write_file_data(img, &list->jobs[k]) != 0) {
+            free(updates);
+            return -1;
+        }
+        if (build_block_map(img, &list->jobs[k], &updates[k].inode) != 0) {
+            vsfs_set_error("Cannot write file data block");
+            free(updates);
+            return -1;
+        }
+    }
+
+    // Update bitmaps, once for the whole batch and only where they changed,
+    // then the free counts of the groups involved. From here on the cached
+    // bitmaps match the image.
+    commit_bitmaps(img, fs->inode_bitmap, fs->data_bitmap, dirty);
+    *committed = 1;
+    if (update_group_descs(img, dirty) != 0) {
+        vsfs_set_error("Cannot write group descriptors");
+        free(updates);
+        return -1;
+    }
+
+    // Create new inodes
+    time_t now = time(NULL);
+    uint32_t highest_inode = 0;
+    for (size_t k = 0; k < list->count; k++) {
+        if (list->jobs[k].inode_num > highest_inode) highest_inode = list->jobs[k].inode_num;
+    }
+    // a moved high-water mark goes out with the inodes it covers
+    if (itable_extend(img, highest_inode, in_place) != 0) {
+        vsfs_set_error("Cannot initialize inode table: %s", strerror(errno));
+        free(updates);
+        return -1;
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        const add_job_t *job = &list->jobs[k];
+        inode_t *new_inode = &updates[k].inode; // direct[] and indirect pointers already set
+        updates[k].num = job->inode_num;
+        new_inode->mode = 0100000;
+        new_inode->links = 1;
+        new_inode->uid = 0;
+        new_inode->gid = 0;
+        new_inode->size_bytes = job->size;
+        new_inode->atime = now;
+        new_inode->mtime = now;
+        new_inode->ctime = now;
+        new_inode->proj_id = 2;
+    }
+    if (image_write_inodes(img, updates, list->count) != 0) {
+        vsfs_set_error("Cannot write new inode");
+        free(updates);
+        return -1;
+    }
+    free(updates);
+
+    // With VSFS_SYNC there is no pristine copy to fall back to, so the batch
+    // is made durable in dependency order, one gathered commit per step:
+    // everything nothing points at yet (data, block maps, bitmaps, inodes,
+    // and the inode table high-water mark, whose zeroed blocks
+    // itable_extend() already synced), then the directory, then the
+    // superblock's mtime and flags. A crash at any point leaves at worst
+    // allocated-but-unreferenced blocks/inodes, never a directory entry
+    // pointing at garbage. Otherwise it all goes out on vsfs_close().
+    if (in_place && image_commit(img) != 0) {
+        vsfs_set_error("Cannot write new inode");
+        return -1;
+    }
+
+    // Update root directory. New directory blocks are zeroed and hooked into
+    // a scratch copy of the root inode first so entries can be addressed; the
+    // real root inode is only rewritten after the entries are on disk.
+    inode_t new_root = root_inode;
+    for (uint32_t b = 0; b < DIRECT_MAX; b++) {
+        if (dp.new_dir_blocks[b] != 0) {
+            uint8_t *block_data = image_block_get(img, dp.new_dir_blocks[b], BCACHE_NOREAD);
+            if (!block_data) {
+                vsfs_set_error("Cannot write root directory block");
+                return -1;
+            }
+            memset(block_data, 0, BS);
+            image_block_put(img, block_data, 1);
+            new_root.direct[b] = dp.new_dir_blocks[b];
+        }
+    }
+    for (size_t k = 0; k < list->count; k++) {
+        add_job_t *job = &list->jobs[k];
+        dirent64_t entry = {0};
+        entry.inode_no = job->inode_num;
+        entry.type = 1;
+        memcpy(entry.name, job->name, sizeof(entry.name));
+        dirent_checksum_finalize(&entry);
+        if (dir_entry_write(img, &new_root, job->dir_loc, &entry) != 0) {
+            vsfs_set_error("Cannot write root directory block");
+            return -1;
+        }
+    }
+
+    if (dp.index_block != 0) {
+        new_root.reserved_2 = dp.index_block;
+    }
+    new_root.size_bytes += list->count * sizeof(dirent64_t);
+    new_root.mtime = now;
+    new_root.ctime = now;
+    inode_crc_finalize(&new_root);
+    dir_index_finalize(fs->idx, new_root.mtime);
+    uint8_t *index_data = image_block_get(img, new_root.reserved_2, BCACHE_NOREAD);
+    if (!index_data) {
+        vsfs_set_error("Cannot write root directory block");
+        return -1;
+    }
+    memcpy(index_data, fs->idx, BS);
+    image_block_put(img, index_data, 1);
+
+    // New directory blocks must be zeroed on disk before the root inode
+    // points at them; entries in existing blocks can go with it
+    int grew = 0;
+    for (uint32_t b = 0; b < DIRECT_MAX; b++) {
+        grew |= dp.new_dir_blocks[b] != 0;
+    }
+    if (in_place && grew && image_commit(img) != 0) {
+        vsfs_set_error("Cannot write root directory block");
+        return -1;
+    }
+    if (image_write_inode(img, ROOT_INO, &new_root) != 0) {
+        vsfs_set_error("Cannot write root directory block");
+        return -1;
+    }
+
+    // mtime_epoch and flags are adjacent, so this patches one 12-byte range
+    struct {
+        uint64_t mtime_epoch;
+        uint32_t flags;
+    } __attribute__((packed)) sb_update = { (uint64_t)now, sb->flags | SB_FLAG_DIR_INDEX };
+    _Static_assert(offsetof(superblock_t, flags) == offsetof(superblock_t, mtime_epoch) + 8, "superblock layout");
+    image_sb_update(img, offsetof(superblock_t, mtime_epoch), &sb_update, sizeof(sb_update));
+    if (in_place && image_commit(img) != 0) {
+        vsfs_set_error("Cannot write image: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Add a batch whose jobs have their path, name and fd set, then release
+// the jobs.
+static int add_batch(vsfs_t *fs, job_list_t *list) {
+    dirty_map_t dirty;
+    dirty.count = 1 + fs->img.group_count;
+    dirty.inode = calloc(dirty.count, sizeof(bitmap_span_t));
+    dirty.data = calloc(dirty.count, sizeof(bitmap_span_t));
+    dir_index_t *saved_idx = malloc(sizeof(dir_index_t));
+    int rc = -1, committed = 0;
+    if (!dirty.inode || !dirty.data || !saved_idx) {
+        vsfs_set_error("Out of memory");
+        goto out;
+    }
+    if (prepare_jobs(fs, list) != 0) {
+        goto out;
+    }
+
+    // Write out what earlier batches left pending (VSFS_SYNC has already
+    // done so), so that if this one has to be discarded, nothing but its
+    // own changes go with it
+    if (image_flush(&fs->img) != 0) {
+        vsfs_set_error("Cannot write image: %s", strerror(errno));
+        goto out;
+    }
+    memcpy(saved_idx, fs->idx, sizeof(dir_index_t));
+    rc = add_jobs(fs, list, &dirty, &committed);
+    if (rc != 0) {
+        // the on-disk index is only replaced at the very end
+        memcpy(fs->idx, saved_idx, sizeof(dir_index_t));
+        if (!committed) {
+            revert_bitmaps(fs, &dirty);
+        } else {
+            // the image's bitmaps, descriptors and superblock now hold the
+            // batch's allocations in memory only; everything pending is this
+            // batch's (see the flush above), so dropping it keeps them off
+            // the image, and the handle takes no more updates since its
+            // in-memory state is past the image's
+            image_discard(&fs->img);
+            if (!(fs->flags & VSFS_SYNC)) {
+                scrub_batch(fs, list);
+            }
+            fs->failed = 1;
+        }
+    }
+
+out:
+    for (size_t k = 0; k < list->count; k++) {
+        if (list->jobs[k].own_fd && list->jobs[k].fd >= 0) {
+            close(list->jobs[k].fd);
+        }
+        free(list->jobs[k].blocks);
+        free(list->jobs[k].meta);
+    }
+    free(dirty.inode);
+    free(dirty.data);
+    free(saved_idx);
+    return rc;
+}
+
+static void job_init(add_job_t *job, const char *path, const char *name, int fd) {
+    job->path = path;
+    strncpy(job->name, name, VSFS_NAME_MAX);
+    job->name[VSFS_NAME_MAX] = '\0';
+    job->fd = fd;
+}
+
+int vsfs_add_batch(vsfs_t *fs, const char *const *host_paths, size_t count) {
+    if (check_writable(fs) != 0) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    job_list_t list = { calloc(count, sizeof(add_job_t)), count, count };
+    if (!list.jobs) {
+        vsfs_set_error("Out of memory");
+        return -1;
+    }
+    for (size_t k = 0; k < count; k++) {
+        job_init(&list.jobs[k], host_paths[k], host_paths[k], -1);
+    }
+    int rc = add_batch(fs, &list);
+    free(list.jobs);
+    return rc;
+}
+
+int vsfs_add(vsfs_t *fs, const char *host_path) {
+    return vsfs_add_batch(fs, &host_path, 1);
+}
+
+int vsfs_add_stream(vsfs_t *fs, int fd, const char *name) {
+    if (check_writable(fs) != 0) {
+        return -1;
+    }
+    add_job_t job = {0};
+    job_init(&job, name, name, fd);
+    job_list_t list = { &job, 1, 1 };
+    return add_batch(fs, &list);
+}
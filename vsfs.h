@@ -0,0 +1,190 @@
+// libminivsfs: create, extend and read MiniVSFS images in-process.
+//
+// mkfs_builder and mkfs_adder are thin command-line wrappers around this
+// library; a service can link it and work on images without running them.
+// An open image is a vsfs_t handle that keeps the bitmaps and the root
+// directory index in memory and other metadata blocks in an LRU buffer
+// cache, so a sequence of vsfs_add() and vsfs_read() calls does not re-read
+// or re-validate metadata.
+//
+// Functions return 0 (or a count) on success and -1 on error;
+// vsfs_last_error() then describes the failure. A handle may be used by one
+// thread at a time, except that the read-only calls (vsfs_stat, vsfs_read,
+// vsfs_readdir, vsfs_extract) may run concurrently with each other.
+// Nothing else should modify the image while it is open.
+//
+// Build:
+//   gcc -O2 -std=c17 -Wall -Wextra -fPIC -pthread -c vsfs.c vsfs_mkfs.c vsfs_cache.c vsfs_io.c vsfs_check.c
+//   ar rcs libminivsfs.a vsfs.o vsfs_mkfs.o vsfs_cache.o vsfs_io.o vsfs_check.o                (static)
+//   gcc -shared -pthread -o libminivsfs.so vsfs.o vsfs_mkfs.o vsfs_cache.o vsfs_io.o vsfs_check.o (shared)
+#ifndef VSFS_H
+#define VSFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct vsfs vsfs_t;
+
+// vsfs_format_opts_t.flags
+#define VSFS_FORMAT_SPARSE      0x1u   // leave the data region as a hole
+#define VSFS_FORMAT_EXTENTS     0x2u   // map files by extents
+#define VSFS_FORMAT_GROUPS      0x4u   // ext2-style block groups
+#define VSFS_FORMAT_LAZY_ITABLE 0x8u   // write only the root inode's table block
+
+// vsfs_open() flags
+#define VSFS_RDONLY 0x0
+#define VSFS_RDWR   0x1
+#define VSFS_SYNC   0x2   // vsfs_add() is durable, in dependency order, when it returns
+#define VSFS_DIRECT 0x4   // vsfs_add() moves file data with O_DIRECT, bypassing the page cache
+
+#define VSFS_NAME_MAX 57
+
+// vsfs_format() limits. Block pointers and inode numbers are 32-bit, which
+// bounds an image at 2^32 - 1 blocks (16 TiB) and 2^32 - 1 inodes.
+#define VSFS_MIN_SIZE_KIB 180ull
+#define VSFS_MAX_SIZE_KIB ((uint64_t)UINT32_MAX * 4u)
+#define VSFS_MIN_INODES 128ull
+#define VSFS_MAX_INODES ((uint64_t)UINT32_MAX)
+
+typedef struct {
+    uint64_t size_kib;
+    uint64_t inodes;
+    uint32_t flags;
+} vsfs_format_opts_t;
+
+typedef struct {
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t group_count;          // 0 without block groups
+    uint64_t inodes_per_group;
+} vsfs_info_t;
+
+typedef struct {
+    uint32_t inode;
+    uint16_t mode;
+    uint64_t size;
+    uint64_t mtime;
+} vsfs_stat_t;
+
+// Create (or truncate) an image at path. info, if not NULL, receives the
+// resulting geometry.
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, vsfs_info_t *info);
+
+// Copy an image file, sharing extents where the host filesystem can.
+int vsfs_copy_image(const char *src, const char *dst);
+
+// vsfs_open_opts_t.io: how the image file is accessed
+#define VSFS_IO_PREAD 0   // pread/pwritev (the default)
+#define VSFS_IO_STDIO 1   // a stdio stream
+#define VSFS_IO_MMAP  2   // a shared mapping of the image
+#define VSFS_IO_URING 3   // io_uring, file data copied with many requests in flight
+
+typedef struct {
+    int flags;                     // VSFS_RDONLY, VSFS_RDWR, VSFS_SYNC
+    size_t cache_blocks;           // metadata buffer cache size in blocks (at least 4), 0 = default (1024)
+    int io;                        // VSFS_IO_*; falls back to VSFS_IO_PREAD if unavailable
+} vsfs_open_opts_t;
+
+vsfs_t *vsfs_open(const char *path, int flags);
+vsfs_t *vsfs_open_with(const char *path, const vsfs_open_opts_t *opts);
+
+// Write back all changes and release the handle. Returns -1 if the final
+// write-back failed; the handle is released either way. Nothing is written
+// back after a failed batch (see vsfs_add()).
+int vsfs_close(vsfs_t *fs);
+
+void vsfs_get_info(const vsfs_t *fs, vsfs_info_t *info);
+
+// Name of the I/O backend a handle uses ("pread", "stdio", "mmap",
+// "uring"), and the VSFS_IO_* value for such a name (-1 if unknown).
+const char *vsfs_io_backend(const vsfs_t *fs);
+int vsfs_io_from_name(const char *name);
+
+typedef struct {
+    uint64_t blocks;               // cache size
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;           // blocks written back by evictions and flushes
+    uint64_t write_calls;          // write system calls those took
+} vsfs_cache_stats_t;
+
+void vsfs_get_cache_stats(vsfs_t *fs, vsfs_cache_stats_t *stats);
+
+// Look up name in the root directory: 1 if it exists (st filled in when
+// not NULL), 0 if it does not, -1 on error.
+int vsfs_stat(vsfs_t *fs, const char *name, vsfs_stat_t *st);
+
+typedef struct {
+    char name[VSFS_NAME_MAX + 1];
+    vsfs_stat_t st;
+} vsfs_dirent_t;
+
+// Call fn for every entry of the root directory except "." and "..".
+// Stops at the first nonzero return of fn and returns it.
+int vsfs_readdir(vsfs_t *fs, int (*fn)(const vsfs_dirent_t *de, void *arg), void *arg);
+
+// Add host files to the root directory, each under its path as given
+// (truncated to VSFS_NAME_MAX characters). Before a batch starts, what
+// earlier ones left pending is written to the image, so a failed batch
+// takes only its own changes with it. As long as the image can still be
+// written, it is then left as it was, except that free data blocks may hold
+// what the batch had copied into them. If a batch fails after its
+// allocations were made, the handle refuses further updates; reads and
+// vsfs_close() still work, and close writes nothing more. (With VSFS_SYNC,
+// steps already made durable stay, so a write error part way through can
+// leave blocks and inodes allocated that nothing references, as a crash
+// would.) FIFOs and character devices are read to end of file, like
+// vsfs_add_stream().
+int vsfs_add(vsfs_t *fs, const char *host_path);
+int vsfs_add_batch(vsfs_t *fs, const char *const *host_paths, size_t count);
+
+// Add the data read from fd until end of file (a pipe, FIFO or socket as
+// well as a regular file) as name. The length need not be known up front:
+// blocks are allocated as data arrives and the size is recorded at the end.
+int vsfs_add_stream(vsfs_t *fs, int fd, const char *name);
+
+// Read up to len bytes of name starting at offset. Returns the number of
+// bytes read (0 at or past end of file), or -1.
+ssize_t vsfs_read(vsfs_t *fs, const char *name, void *buf, size_t len, uint64_t offset);
+
+// Write the contents of name to out_fd at the same offsets, copying in the
+// kernel (copy_file_range, sendfile) where possible, and truncate out_fd to
+// the file size.
+int vsfs_extract(vsfs_t *fs, const char *name, int out_fd);
+
+// Initialize the rest of a lazily initialized inode table (see
+// VSFS_FORMAT_LAZY_ITABLE). A no-op on fully initialized images.
+int vsfs_init_itable(vsfs_t *fs);
+
+// One inconsistency found by vsfs_check(). kind is a short, stable
+// identifier ("inode_crc", "block_leaked", ...) and object names what index
+// counts: "superblock", "group", "inode", "dirent" (root directory slot) or
+// "block" (first block of a run). detail holds key=value pairs.
+typedef struct {
+    const char *kind;
+    const char *object;
+    uint64_t index;
+    char detail[96];
+} vsfs_problem_t;
+
+typedef struct {
+    unsigned threads;              // 0 = one per CPU (at most 16)
+} vsfs_check_opts_t;
+
+// Verify the image at path without opening it for writing: the superblock,
+// group descriptor, inode and directory entry checksums, both bitmaps
+// against what the inodes and directory reference, blocks mapped twice and
+// link counts. report, if not NULL, is called for every problem, ordered by
+// object and index. Returns the number of problems, or -1 if the image
+// cannot be checked at all (unreadable, or no usable superblock).
+int64_t vsfs_check(const char *path, const vsfs_check_opts_t *opts,
+                   void (*report)(const vsfs_problem_t *p, void *arg), void *arg);
+
+// Description of the last error on this thread.
+const char *vsfs_last_error(void);
+
+#endif // VSFS_H
@@ -0,0 +1,201 @@
+// Allocation bitmap helpers shared by the MiniVSFS tools.
+//
+// Bit i lives in byte i/8, bit i%8 (LSB first), i.e. the on-disk layout the
+// builder writes. Searches load 64 bits at a time and use count-trailing-zeros
+// instead of testing one bit per iteration; on CPUs with AVX2 the search for
+// a free bit skips fully allocated 256-bit runs with one compare each.
+//
+// Header-only, like vsfs_crc32.h. Call vsfs_bitmap_init() once to enable
+// the AVX2 path; without it the portable path is used.
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VSFS_BITMAP_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define VSFS_BITMAP_NONE UINT64_MAX
+
+static inline int vsfs_bitmap_test(const uint8_t *bm, uint64_t bit) {
+    return (bm[bit / 8] >> (bit % 8)) & 1;
+}
+
+static inline void vsfs_bitmap_set(uint8_t *bm, uint64_t bit) {
+    bm[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+
+static inline void vsfs_bitmap_clear(uint8_t *bm, uint64_t bit) {
+    bm[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+}
+
+// Set bits [bit, bit+count).
+static inline void vsfs_bitmap_set_range(uint8_t *bm, uint64_t bit, uint64_t count) {
+    while (count > 0 && bit % 8 != 0) {
+        vsfs_bitmap_set(bm, bit++);
+        count--;
+    }
+    if (count >= 8) {
+        memset(bm + bit / 8, 0xFF, count / 8);
+        bit += count / 8 * 8;
+        count %= 8;
+    }
+    while (count-- > 0) {
+        vsfs_bitmap_set(bm, bit++);
+    }
+}
+
+// 64-bit word w of the bitmap, little-endian bit order. Bytes past nbits
+// are never read; bits past nbits come back as 0.
+static inline uint64_t vsfs_bitmap_word(const uint8_t *bm, uint64_t nbits, uint64_t w) {
+    uint64_t v = 0;
+    uint64_t first = w * 64;
+    if (first + 64 <= nbits) {
+        memcpy(&v, bm + w * 8, 8);
+    } else {
+        uint64_t tail = nbits - first;
+        memcpy(&v, bm + w * 8, (size_t)((tail + 7) / 8));
+        v &= (1ULL << tail) - 1; // tail < 64 here
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Returns the first word index in [w, wend) that is not all ones, stepping
+// four words (256 bits) at a time; wend if every chunk is full.
+typedef uint64_t (*vsfs_bitmap_skip_fn)(const uint8_t *bm, uint64_t w, uint64_t wend);
+
+static uint64_t vsfs_bitmap_skip_full_scalar(const uint8_t *bm, uint64_t w, uint64_t wend) {
+    while (w + 4 <= wend) {
+        uint64_t a[4];
+        memcpy(a, bm + w * 8, sizeof(a));
+        if ((a[0] & a[1] & a[2] & a[3]) != UINT64_MAX) {
+            break;
+        }
+        w += 4;
+    }
+    return w;
+}
+
+#ifdef VSFS_BITMAP_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint64_t vsfs_bitmap_skip_full_avx2(const uint8_t *bm, uint64_t w, uint64_t wend) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    while (w + 4 <= wend) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bm + w * 8));
+        if (!_mm256_testc_si256(v, ones)) {
+            break; // some bit in this chunk is clear
+        }
+        w += 4;
+    }
+    return w;
+}
+#endif
+
+static vsfs_bitmap_skip_fn vsfs_bitmap_skip_full = vsfs_bitmap_skip_full_scalar;
+
+static inline void vsfs_bitmap_init(void) {
+    vsfs_bitmap_skip_full = vsfs_bitmap_skip_full_scalar;
+#ifdef VSFS_BITMAP_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vsfs_bitmap_skip_full = vsfs_bitmap_skip_full_avx2;
+    }
+#endif
+}
+
+// First clear bit in [start, nbits), or VSFS_BITMAP_NONE.
+static inline uint64_t vsfs_bitmap_find_zero(const uint8_t *bm, uint64_t nbits, uint64_t start) {
+    if (start >= nbits) {
+        return VSFS_BITMAP_NONE;
+    }
+    uint64_t nwords = (nbits + 63) / 64;
+    uint64_t full_words = nbits / 64;
+    uint64_t w = start / 64;
+    uint64_t v = ~vsfs_bitmap_word(bm, nbits, w) & (UINT64_MAX << (start % 64));
+    for (;;) {
+        if (v) {
+            uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return bit < nbits ? bit : VSFS_BITMAP_NONE;
+        }
+        if (++w >= nwords) {
+            return VSFS_BITMAP_NONE;
+        }
+        if (w < full_words) {
+            w = vsfs_bitmap_skip_full(bm, w, full_words);
+            if (w >= nwords) {
+                return VSFS_BITMAP_NONE;
+            }
+        }
+        v = ~vsfs_bitmap_word(bm, nbits, w);
+    }
+}
+
+// First set bit in [start, limit), or limit if there is none.
+static inline uint64_t vsfs_bitmap_find_set(const uint8_t *bm, uint64_t nbits, uint64_t start, uint64_t limit) {
+    if (limit > nbits) {
+        limit = nbits;
+    }
+    if (start >= limit) {
+        return limit;
+    }
+    uint64_t w = start / 64;
+    uint64_t v = vsfs_bitmap_word(bm, nbits, w) & (UINT64_MAX << (start % 64));
+    for (;;) {
+        if (v) {
+            uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return bit < limit ? bit : limit;
+        }
+        if (++w * 64 >= limit) {
+            return limit;
+        }
+        v = vsfs_bitmap_word(bm, nbits, w);
+    }
+}
+
+// Number of set bits in [start, end).
+static inline uint64_t vsfs_bitmap_count_set(const uint8_t *bm, uint64_t nbits, uint64_t start, uint64_t end) {
+    if (end > nbits) {
+        end = nbits;
+    }
+    uint64_t n = 0;
+    while (start < end && start % 64 != 0) {
+        n += (uint64_t)vsfs_bitmap_test(bm, start++);
+    }
+    for (; start + 64 <= end; start += 64) {
+        n += (uint64_t)__builtin_popcountll(vsfs_bitmap_word(bm, nbits, start / 64));
+    }
+    while (start < end) {
+        n += (uint64_t)vsfs_bitmap_test(bm, start++);
+    }
+    return n;
+}
+
+// First run of len clear bits starting at or after start, found in a single
+// forward pass; VSFS_BITMAP_NONE if there is no such run.
+static inline uint64_t vsfs_bitmap_find_zero_run(const uint8_t *bm, uint64_t nbits, uint64_t start, uint64_t len) {
+    if (len == 0) {
+        return start < nbits ? start : VSFS_BITMAP_NONE;
+    }
+    uint64_t i = start;
+    while (i < nbits) {
+        i = vsfs_bitmap_find_zero(bm, nbits, i);
+        if (i == VSFS_BITMAP_NONE || nbits - i < len) {
+            return VSFS_BITMAP_NONE;
+        }
+        uint64_t end = vsfs_bitmap_find_set(bm, nbits, i, i + len);
+        if (end - i >= len) {
+            return i;
+        }
+        i = end;
+    }
+    return VSFS_BITMAP_NONE;
+}
+
+#endif // VSFS_BITMAP_H
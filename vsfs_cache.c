@@ -0,0 +1,280 @@
+// Block buffer cache, see vsfs_cache.h.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "vsfs_internal.h"
+#include "vsfs_cache.h"
+
+static size_t hash_slot(const bcache_t *c, uint64_t block) {
+    return (size_t)((block * 0x9E3779B97F4A7C15ull) >> 20) & c->hash_mask;
+}
+
+static uint8_t *buf_data(const bcache_t *c, const bcache_buf_t *b) {
+    return c->pool + (size_t)(b - c->bufs) * BS;
+}
+
+static void lru_unlink(bcache_t *c, bcache_buf_t *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next; else c->lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev; else c->lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_head(bcache_t *c, bcache_buf_t *b) {
+    b->lru_prev = NULL;
+    b->lru_next = c->lru_head;
+    if (c->lru_head) c->lru_head->lru_prev = b; else c->lru_tail = b;
+    c->lru_head = b;
+}
+
+static void lru_push_tail(bcache_t *c, bcache_buf_t *b) {
+    b->lru_next = NULL;
+    b->lru_prev = c->lru_tail;
+    if (c->lru_tail) c->lru_tail->lru_next = b; else c->lru_head = b;
+    c->lru_tail = b;
+}
+
+static void hash_remove(bcache_t *c, bcache_buf_t *b) {
+    bcache_buf_t **p = &c->hash[hash_slot(c, b->block)];
+    while (*p != b) {
+        p = &(*p)->hash_next;
+    }
+    *p = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static bcache_buf_t *hash_find(const bcache_t *c, uint64_t block) {
+    bcache_buf_t *b = c->hash[hash_slot(c, block)];
+    while (b && b->block != block) {
+        b = b->hash_next;
+    }
+    return b;
+}
+
+// Run I/O on a buffer the caller has pinned with the lock dropped. Lookups
+// that find it wait on c->idle until it is done.
+static int buf_io_unlocked(bcache_t *c, bcache_buf_t *b, int write) {
+    b->busy = 1;
+    pthread_mutex_unlock(&c->lock);
+    int rc = write ? io_write(c->io, buf_data(c, b), BS, b->block * BS)
+                   : io_read(c->io, buf_data(c, b), BS, b->block * BS);
+    int saved = errno;
+    pthread_mutex_lock(&c->lock);
+    b->busy = 0;
+    pthread_cond_broadcast(&c->idle);
+    errno = saved;
+    return rc;
+}
+
+int bcache_init(bcache_t *c, vsfs_io_t *io, size_t nbufs) {
+    memset(c, 0, sizeof(*c));
+    if (nbufs == 0) nbufs = BCACHE_DEFAULT_BLOCKS;
+    if (nbufs < BCACHE_MIN_BLOCKS) nbufs = BCACHE_MIN_BLOCKS;
+    size_t hash_size = 1;
+    while (hash_size < nbufs * 2) hash_size <<= 1;
+    c->io = io;
+    c->nbufs = nbufs;
+    c->hash_mask = hash_size - 1;
+    c->bufs = calloc(nbufs, sizeof(bcache_buf_t));
+    c->hash = calloc(hash_size, sizeof(bcache_buf_t *));
+    if (!c->bufs || !c->hash || posix_memalign((void **)&c->pool, BS, nbufs * BS) != 0) {
+        free(c->bufs);
+        free(c->hash);
+        c->bufs = NULL;
+        c->hash = NULL;
+        c->pool = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < nbufs; i++) {
+        lru_push_tail(c, &c->bufs[i]);
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->idle, NULL);
+    return 0;
+}
+
+void bcache_destroy(bcache_t *c) {
+    if (!c->bufs) {
+        return;
+    }
+    pthread_cond_destroy(&c->idle);
+    pthread_mutex_destroy(&c->lock);
+    free(c->bufs);
+    free(c->hash);
+    free(c->pool);
+    memset(c, 0, sizeof(*c));
+}
+
+uint8_t *bcache_get(bcache_t *c, uint64_t block, int flags) {
+    pthread_mutex_lock(&c->lock);
+    bcache_buf_t *b;
+    for (;;) {
+        b = hash_find(c, block);
+        if (b && b->busy) {
+            pthread_cond_wait(&c->idle, &c->lock);
+            continue;
+        }
+        if (b) {
+            if (b->pins++ == 0) {
+                lru_unlink(c, b);
+            }
+            c->hits++;
+            pthread_mutex_unlock(&c->lock);
+            return buf_data(c, b);
+        }
+
+        // Recycle the least recently used unpinned buffer
+        b = c->lru_tail;
+        if (!b) {
+            pthread_mutex_unlock(&c->lock);
+            errno = ENOBUFS;
+            return NULL;
+        }
+        if (!(b->valid && b->dirty)) {
+            break;
+        }
+        // A dirty victim is written back first, still hashed under its old
+        // block; block may be cached by someone else meanwhile, so look again
+        lru_unlink(c, b);
+        b->pins = 1;
+        int rc = buf_io_unlocked(c, b, 1);
+        b->pins = 0;
+        lru_push_tail(c, b);
+        if (rc != 0) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        b->dirty = 0;
+        c->writebacks++;
+        c->write_calls++;
+    }
+
+    if (b->valid) {
+        hash_remove(c, b);
+    }
+    lru_unlink(c, b);
+    b->block = block;
+    b->valid = 1;
+    b->pins = 1;
+    size_t slot = hash_slot(c, block);
+    b->hash_next = c->hash[slot];
+    c->hash[slot] = b;
+    c->misses++;
+    if (!(flags & BCACHE_NOREAD) && buf_io_unlocked(c, b, 0) != 0) {
+        hash_remove(c, b);
+        b->valid = 0;
+        b->pins = 0;
+        lru_push_tail(c, b);
+        pthread_mutex_unlock(&c->lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return buf_data(c, b);
+}
+
+void bcache_put(bcache_t *c, const uint8_t *data, int dirty) {
+    pthread_mutex_lock(&c->lock);
+    bcache_buf_t *b = &c->bufs[(size_t)(data - c->pool) / BS];
+    if (dirty) {
+        b->dirty = 1;
+    }
+    if (--b->pins == 0) {
+        lru_push_head(c, b);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// One piece of a flush: a dirty buffer (buf set) or a caller region.
+typedef struct {
+    uint64_t block;
+    uint64_t count;
+    const uint8_t *data;
+    bcache_buf_t *buf;
+} flush_item_t;
+
+static int cmp_item(const void *a, const void *b) {
+    uint64_t x = ((const flush_item_t *)a)->block, y = ((const flush_item_t *)b)->block;
+    return x < y ? -1 : x > y;
+}
+
+int bcache_flush(bcache_t *c, const bcache_region_t *regions, size_t nregions) {
+    pthread_mutex_lock(&c->lock);
+    size_t n = nregions;
+    for (size_t i = 0; i < c->nbufs; i++) {
+        n += c->bufs[i].valid && c->bufs[i].dirty;
+    }
+    if (n == 0) {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    size_t max_iov = IOV_MAX < n ? IOV_MAX : n;
+    flush_item_t *items = malloc(n * sizeof(*items));
+    struct iovec *iov = malloc(max_iov * sizeof(*iov));
+    if (!items || !iov) {
+        free(items);
+        free(iov);
+        pthread_mutex_unlock(&c->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    n = 0;
+    for (size_t i = 0; i < nregions; i++) {
+        if (regions[i].count > 0) {
+            items[n++] = (flush_item_t){ regions[i].block, regions[i].count, regions[i].data, NULL };
+        }
+    }
+    for (size_t i = 0; i < c->nbufs; i++) {
+        bcache_buf_t *b = &c->bufs[i];
+        if (b->valid && b->dirty) {
+            items[n++] = (flush_item_t){ b->block, 1, buf_data(c, b), b };
+        }
+    }
+    qsort(items, n, sizeof(*items), cmp_item);
+
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; ) {
+        uint64_t start = items[i].block, next = start;
+        size_t first = i;
+        int iovcnt = 0;
+        while (i < n && items[i].block == next && (size_t)iovcnt < max_iov) {
+            iov[iovcnt].iov_base = (void *)items[i].data;
+            iov[iovcnt].iov_len = items[i].count * BS;
+            iovcnt++;
+            next += items[i].count;
+            i++;
+        }
+        rc = io_writev(c->io, iov, iovcnt, start * BS);
+        if (rc == 0) {
+            c->write_calls++;
+            c->writebacks += next - start;
+            for (size_t k = first; k < i; k++) {
+                if (items[k].buf) {
+                    items[k].buf->dirty = 0;
+                }
+            }
+        }
+    }
+    free(items);
+    free(iov);
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+void bcache_discard(bcache_t *c, uint64_t first, uint64_t end) {
+    pthread_mutex_lock(&c->lock);
+    for (size_t i = 0; i < c->nbufs; i++) {
+        bcache_buf_t *b = &c->bufs[i];
+        if (b->valid && b->pins == 0 && b->block >= first && b->block < end) {
+            hash_remove(c, b);
+            b->valid = 0;
+            b->dirty = 0;
+            lru_unlink(c, b);
+            lru_push_tail(c, b);   // reused first
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
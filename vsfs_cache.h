@@ -0,0 +1,85 @@
+// Block buffer cache for libminivsfs (internal, see vsfs_cache.c).
+//
+// Metadata blocks (inode table, directory, index, extent and indirect
+// blocks) are read into fixed-size, BS-aligned buffers keyed by block
+// number. A buffer is pinned between bcache_get() and bcache_put() and is
+// never evicted while pinned; unpinned buffers are recycled least recently
+// used first. Writes only mark a buffer dirty: bcache_flush() writes all
+// dirty buffers back in block-number order, gathering adjacent blocks into
+// one write (a pwritev() with the default backend), and a dirty buffer that
+// has to be evicted first is written back on its own. All I/O goes through
+// the image's vsfs_io_t backend. A miss reads its block (and writes back a
+// dirty victim) with the cache lock dropped, the buffer marked busy so that
+// other lookups of it wait, so concurrent readers only serialize on the
+// lookup itself.
+#ifndef VSFS_CACHE_H
+#define VSFS_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "vsfs_io.h"
+
+#define BCACHE_DEFAULT_BLOCKS 1024   // 4 MiB of buffers
+#define BCACHE_MIN_BLOCKS 4          // most buffers any caller pins at once, plus one
+#define BCACHE_NOREAD 0x1            // caller overwrites the whole block, skip the read
+
+typedef struct bcache_buf {
+    uint64_t block;
+    uint32_t pins;
+    uint8_t valid;
+    uint8_t dirty;
+    uint8_t busy;                    // I/O in flight without the lock, see bcache_get()
+    struct bcache_buf *hash_next;
+    struct bcache_buf *lru_prev;     // unpinned buffers, most recently used first
+    struct bcache_buf *lru_next;
+} bcache_buf_t;
+
+typedef struct {
+    vsfs_io_t *io;
+    size_t nbufs;
+    uint8_t *pool;                   // nbufs * BS bytes; buffer i is pool + i * BS
+    bcache_buf_t *bufs;
+    bcache_buf_t **hash;
+    size_t hash_mask;
+    bcache_buf_t *lru_head;
+    bcache_buf_t *lru_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;             // signalled when a busy buffer's I/O completes
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;             // blocks written by evictions and flushes
+    uint64_t write_calls;            // write system calls issued for them
+} bcache_t;
+
+// A run of blocks the caller keeps outside the cache, written back by
+// bcache_flush() together with the dirty buffers.
+typedef struct {
+    uint64_t block;
+    uint64_t count;
+    const uint8_t *data;             // count * BS bytes
+} bcache_region_t;
+
+// nbufs 0 selects BCACHE_DEFAULT_BLOCKS; smaller sizes are raised to
+// BCACHE_MIN_BLOCKS.
+int bcache_init(bcache_t *c, vsfs_io_t *io, size_t nbufs);
+void bcache_destroy(bcache_t *c);
+
+// Pinned buffer holding block, or NULL with errno set (ENOBUFS if every
+// buffer is pinned).
+uint8_t *bcache_get(bcache_t *c, uint64_t block, int flags);
+
+// Unpin a buffer returned by bcache_get(), marking it dirty if modified.
+void bcache_put(bcache_t *c, const uint8_t *data, int dirty);
+
+// Write back every dirty buffer and the nregions caller regions in
+// ascending block order, one gathered write per run of adjacent blocks (up
+// to IOV_MAX buffers). Regions must not overlap cached dirty blocks.
+int bcache_flush(bcache_t *c, const bcache_region_t *regions, size_t nregions);
+
+// Forget blocks [first, end) without writing them back, e.g. after the
+// range was zeroed underneath the cache. Pinned buffers are kept.
+void bcache_discard(bcache_t *c, uint64_t first, uint64_t end);
+
+#endif // VSFS_CACHE_H
@@ -0,0 +1,725 @@
+// vsfs_check(): verify a MiniVSFS image without modifying it.
+//
+// The check reads the image in two parallel passes. The first shards the
+// inode table into CHECK_ITABLE_PIECE-block pieces that a pool of threads
+// claims one at a time: each piece is read with one pread, every inode in
+// it is checksummed and compared with the inode bitmap, and the blocks the
+// in-use inodes map are recorded in a reference bitmap with atomic ORs, so
+// no locks are taken and a second atomic bitmap catches blocks referenced
+// twice. The second pass shards the data bitmap the same way and compares
+// it word by word with the reference bitmaps. The superblock, group
+// descriptors and the root directory are small and checked on this thread.
+//
+// Findings go into per-thread lists and are handed to the caller sorted, so
+// the report does not depend on the number of threads.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "vsfs.h"
+#include "vsfs_internal.h"
+
+#define CHECK_THREADS_MAX 16
+#define CHECK_ITABLE_PIECE 256u          // inode table blocks per work item (8192 inodes, 1 MiB)
+#define CHECK_BITMAP_PIECE (1u << 20)    // data bitmap bits per work item
+
+typedef struct {
+    vsfs_problem_t *items;
+    size_t count;
+    size_t cap;
+    int oom;
+} problem_list_t;
+
+// Shared state of one check.
+typedef struct {
+    int fd;
+    const superblock_t *sb;
+    uint64_t itable_blocks;        // inode table blocks that are initialized, i.e. scanned
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    _Atomic uint64_t *refs;        // data region blocks referenced at least once
+    _Atomic uint64_t *shared;      // ... and more than once
+    uint64_t *live;                // inodes in use; each piece owns whole words
+    size_t nitems;
+    atomic_size_t next;
+    atomic_int err;                // errno of a failed read
+} checker_t;
+
+typedef struct {
+    checker_t *c;
+    problem_list_t problems;
+    uint8_t *buf;                  // one inode table piece
+    uint32_t *level1;              // pointer blocks being walked
+    uint32_t *level2;
+} check_worker_t;
+
+static pthread_once_t check_once = PTHREAD_ONCE_INIT;
+
+static void check_init(void) {
+    crc32_init();
+    vsfs_bitmap_init();
+}
+
+static void problem(problem_list_t *list, const char *kind, const char *object, uint64_t index, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+static void problem(problem_list_t *list, const char *kind, const char *object, uint64_t index, const char *fmt, ...) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        vsfs_problem_t *items = realloc(list->items, cap * sizeof(*items));
+        if (!items) {
+            list->oom = 1;
+            return;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    vsfs_problem_t *p = &list->items[list->count++];
+    p->kind = kind;
+    p->object = object;
+    p->index = index;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(p->detail, sizeof(p->detail), fmt, ap);
+    va_end(ap);
+}
+
+// Read all of len bytes at offset; a short file counts as an error.
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int read_block(checker_t *c, void *buf, uint32_t block) {
+    if (pread_full(c->fd, buf, BS, (uint64_t)block * BS) != 0) {
+        atomic_store(&c->err, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// Note that inode ino maps block. Returns 0 if the block is in the data
+// region (and may be followed), -1 if not.
+static int ref_block(check_worker_t *w, uint64_t ino, uint64_t block) {
+    const superblock_t *sb = w->c->sb;
+    if (block < sb->data_region_start || block >= sb->data_region_start + sb->data_region_blocks) {
+        problem(&w->problems, "block_range", "inode", ino, "block=%" PRIu64, block);
+        return -1;
+    }
+    uint64_t bit = block - sb->data_region_start;
+    uint64_t mask = 1ull << (bit % 64);
+    if (atomic_fetch_or_explicit(&w->c->refs[bit / 64], mask, memory_order_relaxed) & mask) {
+        atomic_fetch_or_explicit(&w->c->shared[bit / 64], mask, memory_order_relaxed);
+    }
+    return 0;
+}
+
+static int ref_run(check_worker_t *w, uint64_t ino, uint64_t start, uint64_t len) {
+    const superblock_t *sb = w->c->sb;
+    if (start < sb->data_region_start || start + len > sb->data_region_start + sb->data_region_blocks) {
+        problem(&w->problems, "block_range", "inode", ino, "block=%" PRIu64 " count=%" PRIu64, start, len);
+        return -1;
+    }
+    for (uint64_t i = 0; i < len; i++) {
+        ref_block(w, ino, start + i);
+    }
+    return 0;
+}
+
+// Record the blocks of an extent-mapped file and return how many data
+// blocks it maps, or -1 if a block could not be read.
+static int64_t walk_extents(check_worker_t *w, uint64_t ino, const inode_t *inode) {
+    uint32_t depth = (inode->reserved_0 >> 16) & 0xFF;
+    uint32_t count = inode->reserved_0 >> 24;
+    int64_t mapped = 0;
+    if (depth == 0 && count <= EXTENT_INLINE_MAX) {
+        if (count > 0 && ref_run(w, ino, inode->reserved_1, inode->reserved_2) == 0) {
+            mapped += inode->reserved_2;
+        }
+        if (count > 1 && ref_run(w, ino, extent_inline2_start(inode), extent_inline2_len(inode)) == 0) {
+            mapped += extent_inline2_len(inode);
+        }
+        return mapped;
+    }
+    if (depth != 1) {
+        problem(&w->problems, "extent_header", "inode", ino, "depth=%" PRIu32 " count=%" PRIu32, depth, count);
+        return 0;
+    }
+    if (ref_block(w, ino, inode->reserved_1) != 0) {
+        return 0;
+    }
+    const extent_block_t *tree = (const extent_block_t *)w->level1;
+    if (read_block(w->c, w->level1, inode->reserved_1) != 0) {
+        return -1;
+    }
+    // the header's count field is 0 at depth 1; images written before that
+    // rule hold the block's count truncated to 8 bits
+    if (tree->magic != EXTENT_MAGIC || tree->count > EXTENT_TREE_MAX || tree->count != inode->reserved_2 ||
+        (count != 0 && count != (tree->count & 0xFF))) {
+        problem(&w->problems, "extent_header", "inode", ino, "block=%" PRIu32 " magic=0x%08" PRIx32 " count=%" PRIu32
+                " header_count=%" PRIu32, inode->reserved_1, tree->magic, tree->count, count);
+        return 0;
+    }
+    for (uint32_t i = 0; i < tree->count; i++) {
+        const extent_t *e = &tree->ext[i];
+        if (e->logical != (uint64_t)mapped) {
+            problem(&w->problems, "extent_order", "inode", ino, "extent=%" PRIu32 " logical=%" PRIu32 " expected=%" PRId64,
+                    i, e->logical, mapped);
+        }
+        if (ref_run(w, ino, e->start, e->len) == 0) {
+            mapped += e->len;
+        }
+    }
+    return mapped;
+}
+
+// Record the nonzero pointers of a pointer block; returns how many.
+static int64_t walk_ptrs(check_worker_t *w, uint64_t ino, const uint32_t *ptrs) {
+    int64_t mapped = 0;
+    for (uint32_t i = 0; i < PTRS_PER_BLOCK; i++) {
+        if (ptrs[i] != 0) {
+            ref_block(w, ino, ptrs[i]);
+            mapped++;
+        }
+    }
+    return mapped;
+}
+
+// Same for a file mapped by direct, single and double indirect pointers.
+static int64_t walk_block_map(check_worker_t *w, uint64_t ino, const inode_t *inode) {
+    int64_t mapped = 0;
+    for (uint32_t i = 0; i < DIRECT_MAX; i++) {
+        if (inode->direct[i] != 0) {
+            ref_block(w, ino, inode->direct[i]);
+            mapped++;
+        }
+    }
+    if (inode->reserved_0 != 0 && ref_block(w, ino, inode->reserved_0) == 0) {
+        if (read_block(w->c, w->level2, inode->reserved_0) != 0) {
+            return -1;
+        }
+        mapped += walk_ptrs(w, ino, w->level2);
+    }
+    if (inode->reserved_1 != 0 && ref_block(w, ino, inode->reserved_1) == 0) {
+        if (read_block(w->c, w->level1, inode->reserved_1) != 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < PTRS_PER_BLOCK; i++) {
+            if (w->level1[i] == 0 || ref_block(w, ino, w->level1[i]) != 0) {
+                continue;
+            }
+            if (read_block(w->c, w->level2, w->level1[i]) != 0) {
+                return -1;
+            }
+            mapped += walk_ptrs(w, ino, w->level2);
+        }
+    }
+    return mapped;
+}
+
+static int check_inode(check_worker_t *w, uint64_t ino, const inode_t *inode) {
+    checker_t *c = w->c;
+    int marked = vsfs_bitmap_test(c->inode_bitmap, ino - 1);
+    if (!marked) {
+        if (inode->mode != 0) {
+            problem(&w->problems, "inode_unmarked", "inode", ino, "mode=0%" PRIo16, inode->mode);
+        }
+        return 0;
+    }
+    if (inode->mode == 0) {
+        problem(&w->problems, "inode_empty", "inode", ino, "links=%" PRIu16, inode->links);
+        return 0;
+    }
+    c->live[(ino - 1) / 64] |= 1ull << ((ino - 1) % 64);
+
+    inode_t tmp = *inode;
+    inode_crc_finalize(&tmp);
+    if (tmp.inode_crc != inode->inode_crc) {
+        problem(&w->problems, "inode_crc", "inode", ino, "stored=0x%08" PRIx64 " computed=0x%08" PRIx64,
+                inode->inode_crc, tmp.inode_crc);
+    }
+
+    if (ino == ROOT_INO) {
+        // the root directory: dirent blocks in direct[], its index in reserved_2
+        if ((inode->mode & 0170000) != 0040000) {
+            problem(&w->problems, "inode_mode", "inode", ino, "mode=0%" PRIo16 " expected=directory", inode->mode);
+        }
+        for (uint32_t i = 0; i < DIRECT_MAX; i++) {
+            if (inode->direct[i] != 0) {
+                ref_block(w, ino, inode->direct[i]);
+            }
+        }
+        if ((c->sb->flags & SB_FLAG_DIR_INDEX) && inode->reserved_2 != 0) {
+            ref_block(w, ino, inode->reserved_2);
+        }
+        return 0;
+    }
+
+    if ((inode->mode & 0170000) != 0100000) {
+        problem(&w->problems, "inode_mode", "inode", ino, "mode=0%" PRIo16 " expected=regular", inode->mode);
+    }
+    int64_t mapped = inode_is_extent_mapped(c->sb, inode) ? walk_extents(w, ino, inode)
+                                                          : walk_block_map(w, ino, inode);
+    if (mapped < 0) {
+        return -1;
+    }
+    uint64_t expected = (inode->size_bytes + BS - 1) / BS;
+    if ((uint64_t)mapped != expected) {
+        problem(&w->problems, "inode_size", "inode", ino, "size=%" PRIu64 " blocks=%" PRId64 " expected=%" PRIu64,
+                inode->size_bytes, mapped, expected);
+    }
+    return 0;
+}
+
+static void *inode_worker(void *arg) {
+    check_worker_t *w = arg;
+    checker_t *c = w->c;
+    const superblock_t *sb = c->sb;
+    for (;;) {
+        size_t piece = atomic_fetch_add(&c->next, 1);
+        if (piece >= c->nitems || atomic_load(&c->err) != 0) {
+            return NULL;
+        }
+        uint64_t first = (uint64_t)piece * CHECK_ITABLE_PIECE;
+        uint64_t blocks = c->itable_blocks - first < CHECK_ITABLE_PIECE ? c->itable_blocks - first : CHECK_ITABLE_PIECE;
+        if (pread_full(c->fd, w->buf, blocks * BS, (sb->inode_table_start + first) * BS) != 0) {
+            atomic_store(&c->err, errno);
+            return NULL;
+        }
+        uint64_t ino = first * (BS / INODE_SIZE) + 1;
+        for (uint64_t i = 0; i < blocks * (BS / INODE_SIZE) && ino <= sb->inode_count; i++, ino++) {
+            if (check_inode(w, ino, (const inode_t *)(w->buf + i * INODE_SIZE)) != 0) {
+                return NULL;
+            }
+        }
+    }
+}
+
+// Coalesces consecutive flagged blocks into one finding.
+typedef struct {
+    const char *kind;
+    uint64_t start;
+    uint64_t len;
+} run_t;
+
+static void run_flush(problem_list_t *list, run_t *r) {
+    if (r->len > 0) {
+        problem(list, r->kind, "block", r->start, "count=%" PRIu64, r->len);
+        r->len = 0;
+    }
+}
+
+static void run_add(problem_list_t *list, run_t *r, uint64_t block) {
+    if (r->len > 0 && r->start + r->len == block) {
+        r->len++;
+        return;
+    }
+    run_flush(list, r);
+    r->start = block;
+    r->len = 1;
+}
+
+static void run_add_word(problem_list_t *list, run_t *r, uint64_t bits, uint64_t first_block) {
+    while (bits) {
+        run_add(list, r, first_block + (uint64_t)__builtin_ctzll(bits));
+        bits &= bits - 1;
+    }
+}
+
+static void *bitmap_worker(void *arg) {
+    check_worker_t *w = arg;
+    checker_t *c = w->c;
+    const superblock_t *sb = c->sb;
+    uint64_t nbits = sb->data_region_blocks;
+    for (;;) {
+        size_t piece = atomic_fetch_add(&c->next, 1);
+        if (piece >= c->nitems) {
+            return NULL;
+        }
+        uint64_t first = (uint64_t)piece * CHECK_BITMAP_PIECE;
+        uint64_t end = nbits - first < CHECK_BITMAP_PIECE ? nbits : first + CHECK_BITMAP_PIECE;
+        run_t leaked = { "block_leaked", 0, 0 };
+        run_t unmarked = { "block_unmarked", 0, 0 };
+        run_t shared = { "block_shared", 0, 0 };
+        for (uint64_t word = first / 64; word < (end + 63) / 64; word++) {
+            uint64_t stored = vsfs_bitmap_word(c->data_bitmap, nbits, word);
+            uint64_t refs = atomic_load_explicit(&c->refs[word], memory_order_relaxed);
+            uint64_t twice = atomic_load_explicit(&c->shared[word], memory_order_relaxed);
+            uint64_t block = sb->data_region_start + word * 64;
+            run_add_word(&w->problems, &leaked, stored & ~refs, block);
+            run_add_word(&w->problems, &unmarked, refs & ~stored, block);
+            run_add_word(&w->problems, &shared, twice, block);
+        }
+        run_flush(&w->problems, &leaked);
+        run_flush(&w->problems, &unmarked);
+        run_flush(&w->problems, &shared);
+    }
+}
+
+// Run fn on nthreads threads (this one included) over c->nitems pieces.
+static void run_workers(check_worker_t *workers, size_t nthreads, void *(*fn)(void *)) {
+    checker_t *c = workers[0].c;
+    atomic_store(&c->next, 0);
+    if (nthreads > c->nitems) nthreads = c->nitems ? c->nitems : 1;
+    pthread_t threads[CHECK_THREADS_MAX];
+    size_t started = 0;
+    while (started + 1 < nthreads && pthread_create(&threads[started], NULL, fn, &workers[started + 1]) == 0) {
+        started++;
+    }
+    fn(&workers[0]);   // this thread works too
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void check_superblock(problem_list_t *list, uint8_t *sb_block) {
+    superblock_t *sb = (superblock_t *)sb_block;
+    uint32_t stored = sb->checksum;
+    uint32_t computed = superblock_crc_finalize(sb);
+    sb->checksum = stored;
+    if (stored != computed) {
+        problem(list, "superblock_crc", "superblock", 0, "stored=0x%08" PRIx32 " computed=0x%08" PRIx32, stored, computed);
+    }
+    if (sb->root_inode != ROOT_INO) {
+        problem(list, "superblock_root", "superblock", 0, "root_inode=%" PRIu64, sb->root_inode);
+    }
+}
+
+// Group descriptors: checksums, layout, and free counts against the bitmaps.
+static int check_groups(problem_list_t *list, int fd, const superblock_t *sb, const uint8_t *inode_bitmap,
+                        const uint8_t *data_bitmap) {
+    uint64_t count = group_count_for(sb->data_region_blocks);
+    uint64_t gdt_blocks = sb->inode_bitmap_start - 1;
+    if (count * sizeof(group_desc_t) > gdt_blocks * BS || sb->inode_count % count != 0) {
+        problem(list, "group_layout", "superblock", 0, "groups=%" PRIu64 " gdt_blocks=%" PRIu64, count, gdt_blocks);
+        return 0;
+    }
+    group_desc_t *groups = malloc(gdt_blocks * BS);
+    if (!groups) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pread_full(fd, groups, gdt_blocks * BS, BS) != 0) {
+        free(groups);
+        return -1;
+    }
+    uint64_t per_group = sb->inode_count / count;
+    for (uint64_t g = 0; g < count; g++) {
+        const group_desc_t *gd = &groups[g];
+        uint64_t blocks = g + 1 == count ? sb->data_region_blocks - g * BLOCKS_PER_GROUP : BLOCKS_PER_GROUP;
+        uint32_t crc = crc32(gd, offsetof(group_desc_t, checksum));
+        if (crc != gd->checksum) {
+            problem(list, "group_crc", "group", g, "stored=0x%08" PRIx32 " computed=0x%08" PRIx32, gd->checksum, crc);
+        }
+        if (gd->first_data_block != sb->data_region_start + g * BLOCKS_PER_GROUP || gd->data_blocks != blocks ||
+            gd->inode_count != per_group || gd->first_inode != g * per_group + 1) {
+            problem(list, "group_layout", "group", g, "first_data_block=%" PRIu32 " data_blocks=%" PRIu32
+                    " first_inode=%" PRIu32 " inode_count=%" PRIu32,
+                    gd->first_data_block, gd->data_blocks, gd->first_inode, gd->inode_count);
+            continue;
+        }
+        uint64_t first = g * BLOCKS_PER_GROUP;
+        uint64_t free_blocks = blocks - vsfs_bitmap_count_set(data_bitmap, sb->data_region_blocks, first, first + blocks);
+        uint64_t free_inodes = per_group - vsfs_bitmap_count_set(inode_bitmap, sb->inode_count,
+                                                                  g * per_group, (g + 1) * per_group);
+        if (gd->free_blocks != free_blocks) {
+            problem(list, "group_free_blocks", "group", g, "stored=%" PRIu32 " counted=%" PRIu64, gd->free_blocks, free_blocks);
+        }
+        if (gd->free_inodes != free_inodes) {
+            problem(list, "group_free_inodes", "group", g, "stored=%" PRIu32 " counted=%" PRIu64, gd->free_inodes, free_inodes);
+        }
+    }
+    free(groups);
+    return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int is_live(const checker_t *c, uint64_t ino) {
+    return ino >= 1 && ino <= c->sb->inode_count && (c->live[(ino - 1) / 64] >> ((ino - 1) % 64) & 1);
+}
+
+// Root directory entries: checksums, targets and duplicate names, then
+// every live inode's link count against the entries naming it.
+static int check_directory(problem_list_t *list, checker_t *c) {
+    const superblock_t *sb = c->sb;
+    inode_t root;
+    if (pread_full(c->fd, &root, INODE_SIZE, sb->inode_table_start * BS) != 0) {
+        return -1;
+    }
+    dirent64_t *entries = malloc((size_t)DIR_MAX_ENTRIES * sizeof(dirent64_t));
+    uint32_t *targets = malloc(((size_t)DIR_MAX_ENTRIES + 1) * sizeof(uint32_t));
+    if (!entries || !targets) {
+        free(entries);
+        free(targets);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t ntargets = 0;
+    if (is_live(c, ROOT_INO)) {
+        for (uint32_t blk = 0; blk < DIRECT_MAX; blk++) {
+            dirent64_t *block = &entries[blk * DIRENTS_PER_BLOCK];
+            uint64_t b = root.direct[blk];
+            if (b < sb->data_region_start || b >= sb->data_region_start + sb->data_region_blocks) {
+                memset(block, 0, BS);   // no block, or already reported as out of range
+                continue;
+            }
+            if (pread_full(c->fd, block, BS, b * BS) != 0) {
+                free(entries);
+                free(targets);
+                return -1;
+            }
+        }
+        for (uint32_t loc = 0; loc < DIR_MAX_ENTRIES; loc++) {
+            dirent64_t *e = &entries[loc];
+            if (e->inode_no == 0) {
+                continue;
+            }
+            uint8_t stored = e->checksum;
+            dirent_checksum_finalize(e);
+            if (e->checksum != stored) {
+                problem(list, "dirent_checksum", "dirent", loc, "stored=0x%02x computed=0x%02x", stored, e->checksum);
+            }
+            if (!is_live(c, e->inode_no)) {
+                problem(list, "dirent_inode", "dirent", loc, "inode=%" PRIu32, e->inode_no);
+                continue;
+            }
+            targets[ntargets++] = e->inode_no;
+            for (uint32_t prev = 0; prev < loc; prev++) {
+                if (entries[prev].inode_no != 0 && strncmp(entries[prev].name, e->name, sizeof(e->name)) == 0) {
+                    problem(list, "dirent_duplicate", "dirent", loc, "same_as=%" PRIu32, prev);
+                    break;
+                }
+            }
+        }
+    }
+    qsort(targets, ntargets, sizeof(uint32_t), cmp_u32);
+
+    uint64_t words = (sb->inode_count + 63) / 64;
+    size_t t = 0;
+    for (uint64_t word = 0; word < words; word++) {
+        for (uint64_t bits = c->live[word]; bits; bits &= bits - 1) {
+            uint64_t ino = word * 64 + (uint64_t)__builtin_ctzll(bits) + 1;
+            while (t < ntargets && targets[t] < ino) {
+                t++;
+            }
+            uint64_t refs = 0;
+            while (t + refs < ntargets && targets[t + refs] == ino) {
+                refs++;
+            }
+            if (refs == 0) {
+                problem(list, "inode_orphan", "inode", ino, "links=0");
+                continue;
+            }
+            inode_t inode;
+            if (pread_full(c->fd, &inode, INODE_SIZE, sb->inode_table_start * BS + (ino - 1) * INODE_SIZE) != 0) {
+                free(entries);
+                free(targets);
+                return -1;
+            }
+            if (inode.links != refs) {
+                problem(list, "inode_links", "inode", ino, "links=%" PRIu16 " entries=%" PRIu64, inode.links, refs);
+            }
+        }
+    }
+    free(entries);
+    free(targets);
+    return 0;
+}
+
+static int object_rank(const char *object) {
+    static const char *const order[] = { "superblock", "group", "inode", "dirent", "block" };
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(object, order[i]) == 0) {
+            return i;
+        }
+    }
+    return 5;
+}
+
+static int cmp_problem(const void *a, const void *b) {
+    const vsfs_problem_t *x = a, *y = b;
+    int rx = object_rank(x->object), ry = object_rank(y->object);
+    if (rx != ry) {
+        return rx - ry;
+    }
+    if (x->index != y->index) {
+        return x->index < y->index ? -1 : 1;
+    }
+    int k = strcmp(x->kind, y->kind);
+    return k != 0 ? k : strcmp(x->detail, y->detail);
+}
+
+int64_t vsfs_check(const char *path, const vsfs_check_opts_t *opts,
+                   void (*report)(const vsfs_problem_t *p, void *arg), void *arg) {
+    pthread_once(&check_once, check_init);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        vsfs_set_error("Cannot open image '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    off_t size = lseek(fd, 0, SEEK_END);
+
+    int64_t rc = -1;
+    uint8_t *sb_block = NULL;
+    uint8_t *inode_bitmap = NULL, *data_bitmap = NULL;
+    checker_t c = { .fd = fd };
+    check_worker_t workers[CHECK_THREADS_MAX];
+    memset(workers, 0, sizeof(workers));
+    problem_list_t main_list = {0};
+
+    sb_block = malloc(BS);
+    if (!sb_block || size < (off_t)BS || pread_full(fd, sb_block, BS, 0) != 0) {
+        vsfs_set_error("Cannot read superblock");
+        goto out;
+    }
+    const superblock_t *sb = (const superblock_t *)sb_block;
+    const superblock_ext_t *sb_ext = (const superblock_ext_t *)(sb_block + SB_EXT_OFFSET);
+    if (sb->magic != VSFS_MAGIC) {
+        vsfs_set_error("Invalid file system magic number");
+        goto out;
+    }
+    // Without a usable geometry nothing else can be located
+    if (sb->block_size != BS || sb->total_blocks > (uint64_t)size / BS ||
+        sb->inode_bitmap_start + sb->inode_bitmap_blocks > sb->total_blocks ||
+        sb->data_bitmap_start + sb->data_bitmap_blocks > sb->total_blocks ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->total_blocks ||
+        sb->data_region_start + sb->data_region_blocks > sb->total_blocks ||
+        sb->inode_count > sb->inode_table_blocks * (BS / INODE_SIZE) ||
+        sb->inode_count > sb->inode_bitmap_blocks * BS * 8 ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * BS * 8 ||
+        ((sb->flags & SB_FLAG_LAZY_ITABLE) &&
+         (sb_ext->itable_initialized == 0 || sb_ext->itable_initialized > sb->inode_table_blocks))) {
+        vsfs_set_error("Corrupt superblock in '%s'", path);
+        goto out;
+    }
+    check_superblock(&main_list, sb_block);
+
+    inode_bitmap = malloc(sb->inode_bitmap_blocks * BS);
+    data_bitmap = malloc(sb->data_bitmap_blocks * BS);
+    uint64_t data_words = (sb->data_region_blocks + 63) / 64;
+    c.sb = sb;
+    c.refs = calloc(data_words + 1, sizeof(uint64_t));
+    c.shared = calloc(data_words + 1, sizeof(uint64_t));
+    c.live = calloc((sb->inode_count + 63) / 64 + 1, sizeof(uint64_t));
+    if (!inode_bitmap || !data_bitmap || !c.refs || !c.shared || !c.live) {
+        vsfs_set_error("Out of memory");
+        goto out;
+    }
+    if (pread_full(fd, inode_bitmap, sb->inode_bitmap_blocks * BS, sb->inode_bitmap_start * BS) != 0 ||
+        pread_full(fd, data_bitmap, sb->data_bitmap_blocks * BS, sb->data_bitmap_start * BS) != 0) {
+        vsfs_set_error("Cannot read bitmaps of '%s': %s", path, strerror(errno));
+        goto out;
+    }
+    c.inode_bitmap = inode_bitmap;
+    c.data_bitmap = data_bitmap;
+    if ((sb->flags & SB_FLAG_GROUPS) && check_groups(&main_list, fd, sb, inode_bitmap, data_bitmap) != 0) {
+        vsfs_set_error("Cannot read group descriptors of '%s': %s", path, strerror(errno));
+        goto out;
+    }
+
+    // Inodes past a lazy table's high-water mark must all be free
+    c.itable_blocks = (sb->flags & SB_FLAG_LAZY_ITABLE) ? sb_ext->itable_initialized : sb->inode_table_blocks;
+    uint64_t scanned = c.itable_blocks * (BS / INODE_SIZE);
+    if (scanned < sb->inode_count) {
+        uint64_t n = vsfs_bitmap_count_set(inode_bitmap, sb->inode_count, scanned, sb->inode_count);
+        if (n > 0) {
+            uint64_t first = vsfs_bitmap_find_set(inode_bitmap, sb->inode_count, scanned, sb->inode_count);
+            problem(&main_list, "inode_uninitialized", "inode", first + 1, "count=%" PRIu64, n);
+        }
+    }
+
+    size_t nthreads = opts->threads;
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+    if (nthreads > CHECK_THREADS_MAX) nthreads = CHECK_THREADS_MAX;
+    for (size_t t = 0; t < nthreads; t++) {
+        workers[t].c = &c;
+        workers[t].buf = malloc((size_t)CHECK_ITABLE_PIECE * BS);
+        workers[t].level1 = malloc(BS);
+        workers[t].level2 = malloc(BS);
+        if (!workers[t].buf || !workers[t].level1 || !workers[t].level2) {
+            vsfs_set_error("Out of memory");
+            goto out;
+        }
+    }
+    atomic_init(&c.err, 0);
+    c.nitems = (size_t)((c.itable_blocks + CHECK_ITABLE_PIECE - 1) / CHECK_ITABLE_PIECE);
+    run_workers(workers, nthreads, inode_worker);
+    if (atomic_load(&c.err) != 0) {
+        vsfs_set_error("Cannot read '%s': %s", path, strerror(atomic_load(&c.err)));
+        goto out;
+    }
+    c.nitems = (size_t)((sb->data_region_blocks + CHECK_BITMAP_PIECE - 1) / CHECK_BITMAP_PIECE);
+    run_workers(workers, nthreads, bitmap_worker);
+    if (check_directory(&main_list, &c) != 0) {
+        vsfs_set_error("Cannot read root directory of '%s': %s", path, strerror(errno));
+        goto out;
+    }
+
+    // Merge and sort so the report is the same for any thread count
+    for (size_t t = 0; t < nthreads; t++) {
+        problem_list_t *l = &workers[t].problems;
+        for (size_t i = 0; i < l->count; i++) {
+            problem(&main_list, l->items[i].kind, l->items[i].object, l->items[i].index, "%s", l->items[i].detail);
+        }
+        main_list.oom |= l->oom;
+    }
+    if (main_list.oom) {
+        vsfs_set_error("Out of memory");
+        goto out;
+    }
+    qsort(main_list.items, main_list.count, sizeof(vsfs_problem_t), cmp_problem);
+    for (size_t i = 0; report && i < main_list.count; i++) {
+        report(&main_list.items[i], arg);
+    }
+    rc = (int64_t)main_list.count;
+
+out:
+    for (size_t t = 0; t < CHECK_THREADS_MAX; t++) {
+        free(workers[t].buf);
+        free(workers[t].level1);
+        free(workers[t].level2);
+        free(workers[t].problems.items);
+    }
+    free(main_list.items);
+    free(c.refs);
+    free(c.shared);
+    free(c.live);
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(sb_block);
+    close(fd);
+    return rc;
+}
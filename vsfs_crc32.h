@@ -0,0 +1,212 @@
+// CRC32 engine shared by the MiniVSFS tools.
+//
+// Same IEEE polynomial (0xEDB88320, reflected) and same output as the
+// byte-at-a-time CRC32_TAB loop, but with:
+//   - tables generated at build time (vsfs_crc32_table.h), so there is no
+//     table construction at startup
+//   - a slicing-by-16 software path (16 bytes per iteration)
+//   - a PCLMULQDQ folding path on x86, picked at runtime by vsfs_crc32_init()
+//   - zlib-style combine, and patching a crc for a few changed bytes
+//     without rehashing the rest of the buffer
+//
+// Header-only so each tool can still be built with a single gcc command.
+#ifndef VSFS_CRC32_H
+#define VSFS_CRC32_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "vsfs_crc32_table.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VSFS_CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+// All kernels take and return the raw (pre-inverted) crc register.
+typedef uint32_t (*vsfs_crc32_fn)(uint32_t c, const uint8_t *p, size_t n);
+
+static inline uint32_t vsfs_crc32_bytewise(uint32_t c, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = VSFS_CRC32_TABLE[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static inline uint32_t vsfs_crc32_load_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint32_t vsfs_crc32_slice16(uint32_t c, const uint8_t *p, size_t n) {
+    const uint32_t (*t)[256] = VSFS_CRC32_TABLE;
+    while (n >= 16) {
+        uint32_t w0 = vsfs_crc32_load_le32(p) ^ c;
+        uint32_t w1 = vsfs_crc32_load_le32(p + 4);
+        uint32_t w2 = vsfs_crc32_load_le32(p + 8);
+        uint32_t w3 = vsfs_crc32_load_le32(p + 12);
+        c = t[15][w0 & 0xFF] ^ t[14][(w0 >> 8) & 0xFF] ^ t[13][(w0 >> 16) & 0xFF] ^ t[12][w0 >> 24]
+          ^ t[11][w1 & 0xFF] ^ t[10][(w1 >> 8) & 0xFF] ^ t[9][(w1 >> 16) & 0xFF]  ^ t[8][w1 >> 24]
+          ^ t[7][w2 & 0xFF]  ^ t[6][(w2 >> 8) & 0xFF]  ^ t[5][(w2 >> 16) & 0xFF]  ^ t[4][w2 >> 24]
+          ^ t[3][w3 & 0xFF]  ^ t[2][(w3 >> 8) & 0xFF]  ^ t[1][(w3 >> 16) & 0xFF]  ^ t[0][w3 >> 24];
+        p += 16;
+        n -= 16;
+    }
+    return vsfs_crc32_bytewise(c, p, n);
+}
+
+#ifdef VSFS_CRC32_HAVE_PCLMUL
+// Carry-less multiply folding ("Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ", Intel 2009), bit-reflected constants for 0xEDB88320.
+// Folds 4x128 bits per iteration, then reduces with Barrett.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t vsfs_crc32_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    if (n < 64) return vsfs_crc32_slice16(c, p, n);
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64;
+    n -= 64;
+
+    // fold 512 bits at a time
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        n -= 64;
+    }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold remaining 16-byte blocks
+    while (n >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return vsfs_crc32_slice16(c, p, n);
+}
+#endif
+
+static vsfs_crc32_fn vsfs_crc32_impl = vsfs_crc32_slice16;
+
+// Picks the fastest kernel the CPU supports. Safe to call more than once.
+static inline void vsfs_crc32_init(void) {
+    vsfs_crc32_impl = vsfs_crc32_slice16;
+#ifdef VSFS_CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        vsfs_crc32_impl = vsfs_crc32_pclmul;
+    }
+#endif
+}
+
+// zlib-style update: crc is the previous result (0 to start), so
+// vsfs_crc32(vsfs_crc32(0, a, n), b, m) == crc of a||b.
+static inline uint32_t vsfs_crc32(uint32_t crc, const void *data, size_t n) {
+    return vsfs_crc32_impl(crc ^ 0xFFFFFFFFu, (const uint8_t *)data, n) ^ 0xFFFFFFFFu;
+}
+
+// Polynomial arithmetic modulo P, bit-reflected like the crc register (as
+// in zlib): running a raw register over n zero bytes multiplies it by
+// x^(8n), which takes O(log n) multiplications instead of n table steps.
+static inline uint32_t vsfs_crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m != 0 && a != 0; m >>= 1) {
+        if (a & m) {
+            p ^= b;
+            a ^= m;
+        }
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320u : b >> 1;
+    }
+    return p;
+}
+
+// x^(8n) mod P
+static inline uint32_t vsfs_crc32_x8nmodp(uint64_t n) {
+    uint32_t p = 1u << 31;   // x^0
+    for (int k = 3; n != 0; n >>= 1, k++) {
+        if (n & 1) {
+            p = vsfs_crc32_multmodp(VSFS_CRC32_X2N[k & 31], p);
+        }
+    }
+    return p;
+}
+
+// crc of a||b from crc1 = crc of a and crc2 = crc of b (len2 bytes).
+static inline uint32_t vsfs_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    return vsfs_crc32_multmodp(vsfs_crc32_x8nmodp(len2), crc1) ^ crc2;
+}
+
+// crc of a len-byte buffer after the n bytes at off change from old to new,
+// given its crc before. The crc is affine in the data, so the difference is
+// the raw crc of old ^ new shifted past the len - off - n bytes after it;
+// nothing outside the changed bytes is read.
+static inline uint32_t vsfs_crc32_patch(uint32_t crc, uint64_t len, uint64_t off,
+                                        const void *old, const void *new, size_t n) {
+    const uint8_t *a = old, *b = new;
+    uint8_t delta[64];
+    uint32_t d = 0;
+    for (size_t done = 0; done < n; ) {
+        size_t k = n - done < sizeof(delta) ? n - done : sizeof(delta);
+        for (size_t i = 0; i < k; i++) {
+            delta[i] = a[done + i] ^ b[done + i];
+        }
+        d = vsfs_crc32_impl(d, delta, k);
+        done += k;
+    }
+    return crc ^ vsfs_crc32_multmodp(vsfs_crc32_x8nmodp(len - off - n), d);
+}
+
+#endif // VSFS_CRC32_H
@@ -0,0 +1,69 @@
+// Generates vsfs_crc32_table.h, the slicing-by-16 tables and the
+// x^(2^k) mod P powers (for vsfs_crc32_combine()) used by vsfs_crc32.h.
+// Build: gcc -O2 -std=c17 -Wall -Wextra vsfs_crc32_gen.c -o vsfs_crc32_gen
+// Usage: ./vsfs_crc32_gen > vsfs_crc32_table.h
+#include <stdio.h>
+#include <stdint.h>
+
+#define CRC32_POLY 0xEDB88320u   // reflected IEEE 802.3 polynomial
+#define SLICES 16
+
+static uint32_t table[SLICES][256];
+static uint32_t x2n[32];
+
+// a * b mod P, bit-reflected (bit 31 is x^0)
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t p = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) p ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+int main(void) {
+    // table[0] is the classic byte-at-a-time table (same as crc32_init())
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        table[0][i] = c;
+    }
+    // table[k][i] is the crc of byte i followed by k zero bytes
+    for (int k = 1; k < SLICES; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = table[k - 1][i];
+            table[k][i] = (c >> 8) ^ table[0][c & 0xFF];
+        }
+    }
+
+    // x2n[k] is x^(2^k) mod P; x^1 is bit 30
+    x2n[0] = 1u << 30;
+    for (int k = 1; k < 32; k++) {
+        x2n[k] = multmodp(x2n[k - 1], x2n[k - 1]);
+    }
+
+    printf("// Generated by vsfs_crc32_gen.c -- DO NOT EDIT.\n");
+    printf("// CRC32 (poly 0x%08X, reflected) slicing-by-%d lookup tables.\n", CRC32_POLY, SLICES);
+    printf("#ifndef VSFS_CRC32_TABLE_H\n#define VSFS_CRC32_TABLE_H\n\n");
+    printf("#include <stdint.h>\n\n");
+    printf("static const uint32_t VSFS_CRC32_TABLE[%d][256] = {\n", SLICES);
+    for (int k = 0; k < SLICES; k++) {
+        printf("    {\n");
+        for (int i = 0; i < 256; i++) {
+            if (i % 6 == 0) printf("       ");
+            printf(" 0x%08Xu,", table[k][i]);
+            if (i % 6 == 5 || i == 255) printf("\n");
+        }
+        printf("    },\n");
+    }
+    printf("};\n\n");
+    printf("// x^(2^k) mod P, bit-reflected\n");
+    printf("static const uint32_t VSFS_CRC32_X2N[32] = {\n");
+    for (int k = 0; k < 32; k++) {
+        if (k % 6 == 0) printf("   ");
+        printf(" 0x%08Xu,", x2n[k]);
+        if (k % 6 == 5 || k == 31) printf("\n");
+    }
+    printf("};\n\n#endif // VSFS_CRC32_TABLE_H\n");
+    return 0;
+}
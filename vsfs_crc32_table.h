@@ -0,0 +1,741 @@
+// Generated by vsfs_crc32_gen.c -- DO NOT EDIT.
+// CRC32 (poly 0xEDB88320, reflected) slicing-by-16 lookup tables.
+#ifndef VSFS_CRC32_TABLE_H
+#define VSFS_CRC32_TABLE_H
+
+#include <stdint.h>
+
+static const uint32_t VSFS_CRC32_TABLE[16][256] = {
+    {
+        0x00000000u, 0x77073096u, 0xEE0E612Cu, 0x990951BAu, 0x076DC419u, 0x706AF48Fu,
+        0xE963A535u, 0x9E6495A3u, 0x0EDB8832u, 0x79DCB8A4u, 0xE0D5E91Eu, 0x97D2D988u,
+        0x09B64C2Bu, 0x7EB17CBDu, 0xE7B82D07u, 0x90BF1D91u, 0x1DB71064u, 0x6AB020F2u,
+        0xF3B97148u, 0x84BE41DEu, 0x1ADAD47Du, 0x6DDDE4EBu, 0xF4D4B551u, 0x83D385C7u,
+        0x136C9856u, 0x646BA8C0u, 0xFD62F97Au, 0x8A65C9ECu, 0x14015C4Fu, 0x63066CD9u,
+        0xFA0F3D63u, 0x8D080DF5u, 0x3B6E20C8u, 0x4C69105Eu, 0xD56041E4u, 0xA2677172u,
+        0x3C03E4D1u, 0x4B04D447u, 0xD20D85FDu, 0xA50AB56Bu, 0x35B5A8FAu, 0x42B2986Cu,
+        0xDBBBC9D6u, 0xACBCF940u, 0x32D86CE3u, 0x45DF5C75u, 0xDCD60DCFu, 0xABD13D59u,
+        0x26D930ACu, 0x51DE003Au, 0xC8D75180u, 0xBFD06116u, 0x21B4F4B5u, 0x56B3C423u,
+        0xCFBA9599u, 0xB8BDA50Fu, 0x2802B89Eu, 0x5F058808u, 0xC60CD9B2u, 0xB10BE924u,
+        0x2F6F7C87u, 0x58684C11u, 0xC1611DABu, 0xB6662D3Du, 0x76DC4190u, 0x01DB7106u,
+        0x98D220BCu, 0xEFD5102Au, 0x71B18589u, 0x06B6B51Fu, 0x9FBFE4A5u, 0xE8B8D433u,
+        0x7807C9A2u, 0x0F00F934u, 0x9609A88Eu, 0xE10E9818u, 0x7F6A0DBBu, 0x086D3D2Du,
+        0x91646C97u, 0xE6635C01u, 0x6B6B51F4u, 0x1C6C6162u, 0x856530D8u, 0xF262004Eu,
+        0x6C0695EDu, 0x1B01A57Bu, 0x8208F4C1u, 0xF50FC457u, 0x65B0D9C6u, 0x12B7E950u,
+        0x8BBEB8EAu, 0xFCB9887Cu, 0x62DD1DDFu, 0x15DA2D49u, 0x8CD37CF3u, 0xFBD44C65u,
+        0x4DB26158u, 0x3AB551CEu, 0xA3BC0074u, 0xD4BB30E2u, 0x4ADFA541u, 0x3DD895D7u,
+        0xA4D1C46Du, 0xD3D6F4FBu, 0x4369E96Au, 0x346ED9FCu, 0xAD678846u, 0xDA60B8D0u,
+        0x44042D73u, 0x33031DE5u, 0xAA0A4C5Fu, 0xDD0D7CC9u, 0x5005713Cu, 0x270241AAu,
+        0xBE0B1010u, 0xC90C2086u, 0x5768B525u, 0x206F85B3u, 0xB966D409u, 0xCE61E49Fu,
+        0x5EDEF90Eu, 0x29D9C998u, 0xB0D09822u, 0xC7D7A8B4u, 0x59B33D17u, 0x2EB40D81u,
+        0xB7BD5C3Bu, 0xC0BA6CADu, 0xEDB88320u, 0x9ABFB3B6u, 0x03B6E20Cu, 0x74B1D29Au,
+        0xEAD54739u, 0x9DD277AFu, 0x04DB2615u, 0x73DC1683u, 0xE3630B12u, 0x94643B84u,
+        0x0D6D6A3Eu, 0x7A6A5AA8u, 0xE40ECF0Bu, 0x9309FF9Du, 0x0A00AE27u, 0x7D079EB1u,
+        0xF00F9344u, 0x8708A3D2u, 0x1E01F268u, 0x6906C2FEu, 0xF762575Du, 0x806567CBu,
+        0x196C3671u, 0x6E6B06E7u, 0xFED41B76u, 0x89D32BE0u, 0x10DA7A5Au, 0x67DD4ACCu,
+        0xF9B9DF6Fu, 0x8EBEEFF9u, 0x17B7BE43u, 0x60B08ED5u, 0xD6D6A3E8u, 0xA1D1937Eu,
+        0x38D8C2C4u, 0x4FDFF252u, 0xD1BB67F1u, 0xA6BC5767u, 0x3FB506DDu, 0x48B2364Bu,
+        0xD80D2BDAu, 0xAF0A1B4Cu, 0x36034AF6u, 0x41047A60u, 0xDF60EFC3u, 0xA867DF55u,
+        0x316E8EEFu, 0x4669BE79u, 0xCB61B38Cu, 0xBC66831Au, 0x256FD2A0u, 0x5268E236u,
+        0xCC0C7795u, 0xBB0B4703u, 0x220216B9u, 0x5505262Fu, 0xC5BA3BBEu, 0xB2BD0B28u,
+        0x2BB45A92u, 0x5CB36A04u, 0xC2D7FFA7u, 0xB5D0CF31u, 0x2CD99E8Bu, 0x5BDEAE1Du,
+        0x9B64C2B0u, 0xEC63F226u, 0x756AA39Cu, 0x026D930Au, 0x9C0906A9u, 0xEB0E363Fu,
+        0x72076785u, 0x05005713u, 0x95BF4A82u, 0xE2B87A14u, 0x7BB12BAEu, 0x0CB61B38u,
+        0x92D28E9Bu, 0xE5D5BE0Du, 0x7CDCEFB7u, 0x0BDBDF21u, 0x86D3D2D4u, 0xF1D4E242u,
+        0x68DDB3F8u, 0x1FDA836Eu, 0x81BE16CDu, 0xF6B9265Bu, 0x6FB077E1u, 0x18B74777u,
+        0x88085AE6u, 0xFF0F6A70u, 0x66063BCAu, 0x11010B5Cu, 0x8F659EFFu, 0xF862AE69u,
+        0x616BFFD3u, 0x166CCF45u, 0xA00AE278u, 0xD70DD2EEu, 0x4E048354u, 0x3903B3C2u,
+        0xA7672661u, 0xD06016F7u, 0x4969474Du, 0x3E6E77DBu, 0xAED16A4Au, 0xD9D65ADCu,
+        0x40DF0B66u, 0x37D83BF0u, 0xA9BCAE53u, 0xDEBB9EC5u, 0x47B2CF7Fu, 0x30B5FFE9u,
+        0xBDBDF21Cu, 0xCABAC28Au, 0x53B39330u, 0x24B4A3A6u, 0xBAD03605u, 0xCDD70693u,
+        0x54DE5729u, 0x23D967BFu, 0xB3667A2Eu, 0xC4614AB8u, 0x5D681B02u, 0x2A6F2B94u,
+        0xB40BBE37u, 0xC30C8EA1u, 0x5A05DF1Bu, 0x2D02EF8Du,
+    },
+    {
+        0x00000000u, 0x191B3141u, 0x32366282u, 0x2B2D53C3u, 0x646CC504u, 0x7D77F445u,
+        0x565AA786u, 0x4F4196C7u, 0xC8D98A08u, 0xD1C2BB49u, 0xFAEFE88Au, 0xE3F4D9CBu,
+        0xACB54F0Cu, 0xB5AE7E4Du, 0x9E832D8Eu, 0x87981CCFu, 0x4AC21251u, 0x53D92310u,
+        0x78F470D3u, 0x61EF4192u, 0x2EAED755u, 0x37B5E614u, 0x1C98B5D7u, 0x05838496u,
+        0x821B9859u, 0x9B00A918u, 0xB02DFADBu, 0xA936CB9Au, 0xE6775D5Du, 0xFF6C6C1Cu,
+        0xD4413FDFu, 0xCD5A0E9Eu, 0x958424A2u, 0x8C9F15E3u, 0xA7B24620u, 0xBEA97761u,
+        0xF1E8E1A6u, 0xE8F3D0E7u, 0xC3DE8324u, 0xDAC5B265u, 0x5D5DAEAAu, 0x44469FEBu,
+        0x6F6BCC28u, 0x7670FD69u, 0x39316BAEu, 0x202A5AEFu, 0x0B07092Cu, 0x121C386Du,
+        0xDF4636F3u, 0xC65D07B2u, 0xED705471u, 0xF46B6530u, 0xBB2AF3F7u, 0xA231C2B6u,
+        0x891C9175u, 0x9007A034u, 0x179FBCFBu, 0x0E848DBAu, 0x25A9DE79u, 0x3CB2EF38u,
+        0x73F379FFu, 0x6AE848BEu, 0x41C51B7Du, 0x58DE2A3Cu, 0xF0794F05u, 0xE9627E44u,
+        0xC24F2D87u, 0xDB541CC6u, 0x94158A01u, 0x8D0EBB40u, 0xA623E883u, 0xBF38D9C2u,
+        0x38A0C50Du, 0x21BBF44Cu, 0x0A96A78Fu, 0x138D96CEu, 0x5CCC0009u, 0x45D73148u,
+        0x6EFA628Bu, 0x77E153CAu, 0xBABB5D54u, 0xA3A06C15u, 0x888D3FD6u, 0x91960E97u,
+        0xDED79850u, 0xC7CCA911u, 0xECE1FAD2u, 0xF5FACB93u, 0x7262D75Cu, 0x6B79E61Du,
+        0x4054B5DEu, 0x594F849Fu, 0x160E1258u, 0x0F152319u, 0x243870DAu, 0x3D23419Bu,
+        0x65FD6BA7u, 0x7CE65AE6u, 0x57CB0925u, 0x4ED03864u, 0x0191AEA3u, 0x188A9FE2u,
+        0x33A7CC21u, 0x2ABCFD60u, 0xAD24E1AFu, 0xB43FD0EEu, 0x9F12832Du, 0x8609B26Cu,
+        0xC94824ABu, 0xD05315EAu, 0xFB7E4629u, 0xE2657768u, 0x2F3F79F6u, 0x362448B7u,
+        0x1D091B74u, 0x04122A35u, 0x4B53BCF2u, 0x52488DB3u, 0x7965DE70u, 0x607EEF31u,
+        0xE7E6F3FEu, 0xFEFDC2BFu, 0xD5D0917Cu, 0xCCCBA03Du, 0x838A36FAu, 0x9A9107BBu,
+        0xB1BC5478u, 0xA8A76539u, 0x3B83984Bu, 0x2298A90Au, 0x09B5FAC9u, 0x10AECB88u,
+        0x5FEF5D4Fu, 0x46F46C0Eu, 0x6DD93FCDu, 0x74C20E8Cu, 0xF35A1243u, 0xEA412302u,
+        0xC16C70C1u, 0xD8774180u, 0x9736D747u, 0x8E2DE606u, 0xA500B5C5u, 0xBC1B8484u,
+        0x71418A1Au, 0x685ABB5Bu, 0x4377E898u, 0x5A6CD9D9u, 0x152D4F1Eu, 0x0C367E5Fu,
+        0x271B2D9Cu, 0x3E001CDDu, 0xB9980012u, 0xA0833153u, 0x8BAE6290u, 0x92B553D1u,
+        0xDDF4C516u, 0xC4EFF457u, 0xEFC2A794u, 0xF6D996D5u, 0xAE07BCE9u, 0xB71C8DA8u,
+        0x9C31DE6Bu, 0x852AEF2Au, 0xCA6B79EDu, 0xD37048ACu, 0xF85D1B6Fu, 0xE1462A2Eu,
+        0x66DE36E1u, 0x7FC507A0u, 0x54E85463u, 0x4DF36522u, 0x02B2F3E5u, 0x1BA9C2A4u,
+        0x30849167u, 0x299FA026u, 0xE4C5AEB8u, 0xFDDE9FF9u, 0xD6F3CC3Au, 0xCFE8FD7Bu,
+        0x80A96BBCu, 0x99B25AFDu, 0xB29F093Eu, 0xAB84387Fu, 0x2C1C24B0u, 0x350715F1u,
+        0x1E2A4632u, 0x07317773u, 0x4870E1B4u, 0x516BD0F5u, 0x7A468336u, 0x635DB277u,
+        0xCBFAD74Eu, 0xD2E1E60Fu, 0xF9CCB5CCu, 0xE0D7848Du, 0xAF96124Au, 0xB68D230Bu,
+        0x9DA070C8u, 0x84BB4189u, 0x03235D46u, 0x1A386C07u, 0x31153FC4u, 0x280E0E85u,
+        0x674F9842u, 0x7E54A903u, 0x5579FAC0u, 0x4C62CB81u, 0x8138C51Fu, 0x9823F45Eu,
+        0xB30EA79Du, 0xAA1596DCu, 0xE554001Bu, 0xFC4F315Au, 0xD7626299u, 0xCE7953D8u,
+        0x49E14F17u, 0x50FA7E56u, 0x7BD72D95u, 0x62CC1CD4u, 0x2D8D8A13u, 0x3496BB52u,
+        0x1FBBE891u, 0x06A0D9D0u, 0x5E7EF3ECu, 0x4765C2ADu, 0x6C48916Eu, 0x7553A02Fu,
+        0x3A1236E8u, 0x230907A9u, 0x0824546Au, 0x113F652Bu, 0x96A779E4u, 0x8FBC48A5u,
+        0xA4911B66u, 0xBD8A2A27u, 0xF2CBBCE0u, 0xEBD08DA1u, 0xC0FDDE62u, 0xD9E6EF23u,
+        0x14BCE1BDu, 0x0DA7D0FCu, 0x268A833Fu, 0x3F91B27Eu, 0x70D024B9u, 0x69CB15F8u,
+        0x42E6463Bu, 0x5BFD777Au, 0xDC656BB5u, 0xC57E5AF4u, 0xEE530937u, 0xF7483876u,
+        0xB809AEB1u, 0xA1129FF0u, 0x8A3FCC33u, 0x9324FD72u,
+    },
+    {
+        0x00000000u, 0x01C26A37u, 0x0384D46Eu, 0x0246BE59u, 0x0709A8DCu, 0x06CBC2EBu,
+        0x048D7CB2u, 0x054F1685u, 0x0E1351B8u, 0x0FD13B8Fu, 0x0D9785D6u, 0x0C55EFE1u,
+        0x091AF964u, 0x08D89353u, 0x0A9E2D0Au, 0x0B5C473Du, 0x1C26A370u, 0x1DE4C947u,
+        0x1FA2771Eu, 0x1E601D29u, 0x1B2F0BACu, 0x1AED619Bu, 0x18ABDFC2u, 0x1969B5F5u,
+        0x1235F2C8u, 0x13F798FFu, 0x11B126A6u, 0x10734C91u, 0x153C5A14u, 0x14FE3023u,
+        0x16B88E7Au, 0x177AE44Du, 0x384D46E0u, 0x398F2CD7u, 0x3BC9928Eu, 0x3A0BF8B9u,
+        0x3F44EE3Cu, 0x3E86840Bu, 0x3CC03A52u, 0x3D025065u, 0x365E1758u, 0x379C7D6Fu,
+        0x35DAC336u, 0x3418A901u, 0x3157BF84u, 0x3095D5B3u, 0x32D36BEAu, 0x331101DDu,
+        0x246BE590u, 0x25A98FA7u, 0x27EF31FEu, 0x262D5BC9u, 0x23624D4Cu, 0x22A0277Bu,
+        0x20E69922u, 0x2124F315u, 0x2A78B428u, 0x2BBADE1Fu, 0x29FC6046u, 0x283E0A71u,
+        0x2D711CF4u, 0x2CB376C3u, 0x2EF5C89Au, 0x2F37A2ADu, 0x709A8DC0u, 0x7158E7F7u,
+        0x731E59AEu, 0x72DC3399u, 0x7793251Cu, 0x76514F2Bu, 0x7417F172u, 0x75D59B45u,
+        0x7E89DC78u, 0x7F4BB64Fu, 0x7D0D0816u, 0x7CCF6221u, 0x798074A4u, 0x78421E93u,
+        0x7A04A0CAu, 0x7BC6CAFDu, 0x6CBC2EB0u, 0x6D7E4487u, 0x6F38FADEu, 0x6EFA90E9u,
+        0x6BB5866Cu, 0x6A77EC5Bu, 0x68315202u, 0x69F33835u, 0x62AF7F08u, 0x636D153Fu,
+        0x612BAB66u, 0x60E9C151u, 0x65A6D7D4u, 0x6464BDE3u, 0x662203BAu, 0x67E0698Du,
+        0x48D7CB20u, 0x4915A117u, 0x4B531F4Eu, 0x4A917579u, 0x4FDE63FCu, 0x4E1C09CBu,
+        0x4C5AB792u, 0x4D98DDA5u, 0x46C49A98u, 0x4706F0AFu, 0x45404EF6u, 0x448224C1u,
+        0x41CD3244u, 0x400F5873u, 0x4249E62Au, 0x438B8C1Du, 0x54F16850u, 0x55330267u,
+        0x5775BC3Eu, 0x56B7D609u, 0x53F8C08Cu, 0x523AAABBu, 0x507C14E2u, 0x51BE7ED5u,
+        0x5AE239E8u, 0x5B2053DFu, 0x5966ED86u, 0x58A487B1u, 0x5DEB9134u, 0x5C29FB03u,
+        0x5E6F455Au, 0x5FAD2F6Du, 0xE1351B80u, 0xE0F771B7u, 0xE2B1CFEEu, 0xE373A5D9u,
+        0xE63CB35Cu, 0xE7FED96Bu, 0xE5B86732u, 0xE47A0D05u, 0xEF264A38u, 0xEEE4200Fu,
+        0xECA29E56u, 0xED60F461u, 0xE82FE2E4u, 0xE9ED88D3u, 0xEBAB368Au, 0xEA695CBDu,
+        0xFD13B8F0u, 0xFCD1D2C7u, 0xFE976C9Eu, 0xFF5506A9u, 0xFA1A102Cu, 0xFBD87A1Bu,
+        0xF99EC442u, 0xF85CAE75u, 0xF300E948u, 0xF2C2837Fu, 0xF0843D26u, 0xF1465711u,
+        0xF4094194u, 0xF5CB2BA3u, 0xF78D95FAu, 0xF64FFFCDu, 0xD9785D60u, 0xD8BA3757u,
+        0xDAFC890Eu, 0xDB3EE339u, 0xDE71F5BCu, 0xDFB39F8Bu, 0xDDF521D2u, 0xDC374BE5u,
+        0xD76B0CD8u, 0xD6A966EFu, 0xD4EFD8B6u, 0xD52DB281u, 0xD062A404u, 0xD1A0CE33u,
+        0xD3E6706Au, 0xD2241A5Du, 0xC55EFE10u, 0xC49C9427u, 0xC6DA2A7Eu, 0xC7184049u,
+        0xC25756CCu, 0xC3953CFBu, 0xC1D382A2u, 0xC011E895u, 0xCB4DAFA8u, 0xCA8FC59Fu,
+        0xC8C97BC6u, 0xC90B11F1u, 0xCC440774u, 0xCD866D43u, 0xCFC0D31Au, 0xCE02B92Du,
+        0x91AF9640u, 0x906DFC77u, 0x922B422Eu, 0x93E92819u, 0x96A63E9Cu, 0x976454ABu,
+        0x9522EAF2u, 0x94E080C5u, 0x9FBCC7F8u, 0x9E7EADCFu, 0x9C381396u, 0x9DFA79A1u,
+        0x98B56F24u, 0x99770513u, 0x9B31BB4Au, 0x9AF3D17Du, 0x8D893530u, 0x8C4B5F07u,
+        0x8E0DE15Eu, 0x8FCF8B69u, 0x8A809DECu, 0x8B42F7DBu, 0x89044982u, 0x88C623B5u,
+        0x839A6488u, 0x82580EBFu, 0x801EB0E6u, 0x81DCDAD1u, 0x8493CC54u, 0x8551A663u,
+        0x8717183Au, 0x86D5720Du, 0xA9E2D0A0u, 0xA820BA97u, 0xAA6604CEu, 0xABA46EF9u,
+        0xAEEB787Cu, 0xAF29124Bu, 0xAD6FAC12u, 0xACADC625u, 0xA7F18118u, 0xA633EB2Fu,
+        0xA4755576u, 0xA5B73F41u, 0xA0F829C4u, 0xA13A43F3u, 0xA37CFDAAu, 0xA2BE979Du,
+        0xB5C473D0u, 0xB40619E7u, 0xB640A7BEu, 0xB782CD89u, 0xB2CDDB0Cu, 0xB30FB13Bu,
+        0xB1490F62u, 0xB08B6555u, 0xBBD72268u, 0xBA15485Fu, 0xB853F606u, 0xB9919C31u,
+        0xBCDE8AB4u, 0xBD1CE083u, 0xBF5A5EDAu, 0xBE9834EDu,
+    },
+    {
+        0x00000000u, 0xB8BC6765u, 0xAA09C88Bu, 0x12B5AFEEu, 0x8F629757u, 0x37DEF032u,
+        0x256B5FDCu, 0x9DD738B9u, 0xC5B428EFu, 0x7D084F8Au, 0x6FBDE064u, 0xD7018701u,
+        0x4AD6BFB8u, 0xF26AD8DDu, 0xE0DF7733u, 0x58631056u, 0x5019579Fu, 0xE8A530FAu,
+        0xFA109F14u, 0x42ACF871u, 0xDF7BC0C8u, 0x67C7A7ADu, 0x75720843u, 0xCDCE6F26u,
+        0x95AD7F70u, 0x2D111815u, 0x3FA4B7FBu, 0x8718D09Eu, 0x1ACFE827u, 0xA2738F42u,
+        0xB0C620ACu, 0x087A47C9u, 0xA032AF3Eu, 0x188EC85Bu, 0x0A3B67B5u, 0xB28700D0u,
+        0x2F503869u, 0x97EC5F0Cu, 0x8559F0E2u, 0x3DE59787u, 0x658687D1u, 0xDD3AE0B4u,
+        0xCF8F4F5Au, 0x7733283Fu, 0xEAE41086u, 0x525877E3u, 0x40EDD80Du, 0xF851BF68u,
+        0xF02BF8A1u, 0x48979FC4u, 0x5A22302Au, 0xE29E574Fu, 0x7F496FF6u, 0xC7F50893u,
+        0xD540A77Du, 0x6DFCC018u, 0x359FD04Eu, 0x8D23B72Bu, 0x9F9618C5u, 0x272A7FA0u,
+        0xBAFD4719u, 0x0241207Cu, 0x10F48F92u, 0xA848E8F7u, 0x9B14583Du, 0x23A83F58u,
+        0x311D90B6u, 0x89A1F7D3u, 0x1476CF6Au, 0xACCAA80Fu, 0xBE7F07E1u, 0x06C36084u,
+        0x5EA070D2u, 0xE61C17B7u, 0xF4A9B859u, 0x4C15DF3Cu, 0xD1C2E785u, 0x697E80E0u,
+        0x7BCB2F0Eu, 0xC377486Bu, 0xCB0D0FA2u, 0x73B168C7u, 0x6104C729u, 0xD9B8A04Cu,
+        0x446F98F5u, 0xFCD3FF90u, 0xEE66507Eu, 0x56DA371Bu, 0x0EB9274Du, 0xB6054028u,
+        0xA4B0EFC6u, 0x1C0C88A3u, 0x81DBB01Au, 0x3967D77Fu, 0x2BD27891u, 0x936E1FF4u,
+        0x3B26F703u, 0x839A9066u, 0x912F3F88u, 0x299358EDu, 0xB4446054u, 0x0CF80731u,
+        0x1E4DA8DFu, 0xA6F1CFBAu, 0xFE92DFECu, 0x462EB889u, 0x549B1767u, 0xEC277002u,
+        0x71F048BBu, 0xC94C2FDEu, 0xDBF98030u, 0x6345E755u, 0x6B3FA09Cu, 0xD383C7F9u,
+        0xC1366817u, 0x798A0F72u, 0xE45D37CBu, 0x5CE150AEu, 0x4E54FF40u, 0xF6E89825u,
+        0xAE8B8873u, 0x1637EF16u, 0x048240F8u, 0xBC3E279Du, 0x21E91F24u, 0x99557841u,
+        0x8BE0D7AFu, 0x335CB0CAu, 0xED59B63Bu, 0x55E5D15Eu, 0x47507EB0u, 0xFFEC19D5u,
+        0x623B216Cu, 0xDA874609u, 0xC832E9E7u, 0x708E8E82u, 0x28ED9ED4u, 0x9051F9B1u,
+        0x82E4565Fu, 0x3A58313Au, 0xA78F0983u, 0x1F336EE6u, 0x0D86C108u, 0xB53AA66Du,
+        0xBD40E1A4u, 0x05FC86C1u, 0x1749292Fu, 0xAFF54E4Au, 0x322276F3u, 0x8A9E1196u,
+        0x982BBE78u, 0x2097D91Du, 0x78F4C94Bu, 0xC048AE2Eu, 0xD2FD01C0u, 0x6A4166A5u,
+        0xF7965E1Cu, 0x4F2A3979u, 0x5D9F9697u, 0xE523F1F2u, 0x4D6B1905u, 0xF5D77E60u,
+        0xE762D18Eu, 0x5FDEB6EBu, 0xC2098E52u, 0x7AB5E937u, 0x680046D9u, 0xD0BC21BCu,
+        0x88DF31EAu, 0x3063568Fu, 0x22D6F961u, 0x9A6A9E04u, 0x07BDA6BDu, 0xBF01C1D8u,
+        0xADB46E36u, 0x15080953u, 0x1D724E9Au, 0xA5CE29FFu, 0xB77B8611u, 0x0FC7E174u,
+        0x9210D9CDu, 0x2AACBEA8u, 0x38191146u, 0x80A57623u, 0xD8C66675u, 0x607A0110u,
+        0x72CFAEFEu, 0xCA73C99Bu, 0x57A4F122u, 0xEF189647u, 0xFDAD39A9u, 0x45115ECCu,
+        0x764DEE06u, 0xCEF18963u, 0xDC44268Du, 0x64F841E8u, 0xF92F7951u, 0x41931E34u,
+        0x5326B1DAu, 0xEB9AD6BFu, 0xB3F9C6E9u, 0x0B45A18Cu, 0x19F00E62u, 0xA14C6907u,
+        0x3C9B51BEu, 0x842736DBu, 0x96929935u, 0x2E2EFE50u, 0x2654B999u, 0x9EE8DEFCu,
+        0x8C5D7112u, 0x34E11677u, 0xA9362ECEu, 0x118A49ABu, 0x033FE645u, 0xBB838120u,
+        0xE3E09176u, 0x5B5CF613u, 0x49E959FDu, 0xF1553E98u, 0x6C820621u, 0xD43E6144u,
+        0xC68BCEAAu, 0x7E37A9CFu, 0xD67F4138u, 0x6EC3265Du, 0x7C7689B3u, 0xC4CAEED6u,
+        0x591DD66Fu, 0xE1A1B10Au, 0xF3141EE4u, 0x4BA87981u, 0x13CB69D7u, 0xAB770EB2u,
+        0xB9C2A15Cu, 0x017EC639u, 0x9CA9FE80u, 0x241599E5u, 0x36A0360Bu, 0x8E1C516Eu,
+        0x866616A7u, 0x3EDA71C2u, 0x2C6FDE2Cu, 0x94D3B949u, 0x090481F0u, 0xB1B8E695u,
+        0xA30D497Bu, 0x1BB12E1Eu, 0x43D23E48u, 0xFB6E592Du, 0xE9DBF6C3u, 0x516791A6u,
+        0xCCB0A91Fu, 0x740CCE7Au, 0x66B96194u, 0xDE0506F1u,
+    },
+    {
+        0x00000000u, 0x3D6029B0u, 0x7AC05360u, 0x47A07AD0u, 0xF580A6C0u, 0xC8E08F70u,
+        0x8F40F5A0u, 0xB220DC10u, 0x30704BC1u, 0x0D106271u, 0x4AB018A1u, 0x77D03111u,
+        0xC5F0ED01u, 0xF890C4B1u, 0xBF30BE61u, 0x825097D1u, 0x60E09782u, 0x5D80BE32u,
+        0x1A20C4E2u, 0x2740ED52u, 0x95603142u, 0xA80018F2u, 0xEFA06222u, 0xD2C04B92u,
+        0x5090DC43u, 0x6DF0F5F3u, 0x2A508F23u, 0x1730A693u, 0xA5107A83u, 0x98705333u,
+        0xDFD029E3u, 0xE2B00053u, 0xC1C12F04u, 0xFCA106B4u, 0xBB017C64u, 0x866155D4u,
+        0x344189C4u, 0x0921A074u, 0x4E81DAA4u, 0x73E1F314u, 0xF1B164C5u, 0xCCD14D75u,
+        0x8B7137A5u, 0xB6111E15u, 0x0431C205u, 0x3951EBB5u, 0x7EF19165u, 0x4391B8D5u,
+        0xA121B886u, 0x9C419136u, 0xDBE1EBE6u, 0xE681C256u, 0x54A11E46u, 0x69C137F6u,
+        0x2E614D26u, 0x13016496u, 0x9151F347u, 0xAC31DAF7u, 0xEB91A027u, 0xD6F18997u,
+        0x64D15587u, 0x59B17C37u, 0x1E1106E7u, 0x23712F57u, 0x58F35849u, 0x659371F9u,
+        0x22330B29u, 0x1F532299u, 0xAD73FE89u, 0x9013D739u, 0xD7B3ADE9u, 0xEAD38459u,
+        0x68831388u, 0x55E33A38u, 0x124340E8u, 0x2F236958u, 0x9D03B548u, 0xA0639CF8u,
+        0xE7C3E628u, 0xDAA3CF98u, 0x3813CFCBu, 0x0573E67Bu, 0x42D39CABu, 0x7FB3B51Bu,
+        0xCD93690Bu, 0xF0F340BBu, 0xB7533A6Bu, 0x8A3313DBu, 0x0863840Au, 0x3503ADBAu,
+        0x72A3D76Au, 0x4FC3FEDAu, 0xFDE322CAu, 0xC0830B7Au, 0x872371AAu, 0xBA43581Au,
+        0x9932774Du, 0xA4525EFDu, 0xE3F2242Du, 0xDE920D9Du, 0x6CB2D18Du, 0x51D2F83Du,
+        0x167282EDu, 0x2B12AB5Du, 0xA9423C8Cu, 0x9422153Cu, 0xD3826FECu, 0xEEE2465Cu,
+        0x5CC29A4Cu, 0x61A2B3FCu, 0x2602C92Cu, 0x1B62E09Cu, 0xF9D2E0CFu, 0xC4B2C97Fu,
+        0x8312B3AFu, 0xBE729A1Fu, 0x0C52460Fu, 0x31326FBFu, 0x7692156Fu, 0x4BF23CDFu,
+        0xC9A2AB0Eu, 0xF4C282BEu, 0xB362F86Eu, 0x8E02D1DEu, 0x3C220DCEu, 0x0142247Eu,
+        0x46E25EAEu, 0x7B82771Eu, 0xB1E6B092u, 0x8C869922u, 0xCB26E3F2u, 0xF646CA42u,
+        0x44661652u, 0x79063FE2u, 0x3EA64532u, 0x03C66C82u, 0x8196FB53u, 0xBCF6D2E3u,
+        0xFB56A833u, 0xC6368183u, 0x74165D93u, 0x49767423u, 0x0ED60EF3u, 0x33B62743u,
+        0xD1062710u, 0xEC660EA0u, 0xABC67470u, 0x96A65DC0u, 0x248681D0u, 0x19E6A860u,
+        0x5E46D2B0u, 0x6326FB00u, 0xE1766CD1u, 0xDC164561u, 0x9BB63FB1u, 0xA6D61601u,
+        0x14F6CA11u, 0x2996E3A1u, 0x6E369971u, 0x5356B0C1u, 0x70279F96u, 0x4D47B626u,
+        0x0AE7CCF6u, 0x3787E546u, 0x85A73956u, 0xB8C710E6u, 0xFF676A36u, 0xC2074386u,
+        0x4057D457u, 0x7D37FDE7u, 0x3A978737u, 0x07F7AE87u, 0xB5D77297u, 0x88B75B27u,
+        0xCF1721F7u, 0xF2770847u, 0x10C70814u, 0x2DA721A4u, 0x6A075B74u, 0x576772C4u,
+        0xE547AED4u, 0xD8278764u, 0x9F87FDB4u, 0xA2E7D404u, 0x20B743D5u, 0x1DD76A65u,
+        0x5A7710B5u, 0x67173905u, 0xD537E515u, 0xE857CCA5u, 0xAFF7B675u, 0x92979FC5u,
+        0xE915E8DBu, 0xD475C16Bu, 0x93D5BBBBu, 0xAEB5920Bu, 0x1C954E1Bu, 0x21F567ABu,
+        0x66551D7Bu, 0x5B3534CBu, 0xD965A31Au, 0xE4058AAAu, 0xA3A5F07Au, 0x9EC5D9CAu,
+        0x2CE505DAu, 0x11852C6Au, 0x562556BAu, 0x6B457F0Au, 0x89F57F59u, 0xB49556E9u,
+        0xF3352C39u, 0xCE550589u, 0x7C75D999u, 0x4115F029u, 0x06B58AF9u, 0x3BD5A349u,
+        0xB9853498u, 0x84E51D28u, 0xC34567F8u, 0xFE254E48u, 0x4C059258u, 0x7165BBE8u,
+        0x36C5C138u, 0x0BA5E888u, 0x28D4C7DFu, 0x15B4EE6Fu, 0x521494BFu, 0x6F74BD0Fu,
+        0xDD54611Fu, 0xE03448AFu, 0xA794327Fu, 0x9AF41BCFu, 0x18A48C1Eu, 0x25C4A5AEu,
+        0x6264DF7Eu, 0x5F04F6CEu, 0xED242ADEu, 0xD044036Eu, 0x97E479BEu, 0xAA84500Eu,
+        0x4834505Du, 0x755479EDu, 0x32F4033Du, 0x0F942A8Du, 0xBDB4F69Du, 0x80D4DF2Du,
+        0xC774A5FDu, 0xFA148C4Du, 0x78441B9Cu, 0x4524322Cu, 0x028448FCu, 0x3FE4614Cu,
+        0x8DC4BD5Cu, 0xB0A494ECu, 0xF704EE3Cu, 0xCA64C78Cu,
+    },
+    {
+        0x00000000u, 0xCB5CD3A5u, 0x4DC8A10Bu, 0x869472AEu, 0x9B914216u, 0x50CD91B3u,
+        0xD659E31Du, 0x1D0530B8u, 0xEC53826Du, 0x270F51C8u, 0xA19B2366u, 0x6AC7F0C3u,
+        0x77C2C07Bu, 0xBC9E13DEu, 0x3A0A6170u, 0xF156B2D5u, 0x03D6029Bu, 0xC88AD13Eu,
+        0x4E1EA390u, 0x85427035u, 0x9847408Du, 0x531B9328u, 0xD58FE186u, 0x1ED33223u,
+        0xEF8580F6u, 0x24D95353u, 0xA24D21FDu, 0x6911F258u, 0x7414C2E0u, 0xBF481145u,
+        0x39DC63EBu, 0xF280B04Eu, 0x07AC0536u, 0xCCF0D693u, 0x4A64A43Du, 0x81387798u,
+        0x9C3D4720u, 0x57619485u, 0xD1F5E62Bu, 0x1AA9358Eu, 0xEBFF875Bu, 0x20A354FEu,
+        0xA6372650u, 0x6D6BF5F5u, 0x706EC54Du, 0xBB3216E8u, 0x3DA66446u, 0xF6FAB7E3u,
+        0x047A07ADu, 0xCF26D408u, 0x49B2A6A6u, 0x82EE7503u, 0x9FEB45BBu, 0x54B7961Eu,
+        0xD223E4B0u, 0x197F3715u, 0xE82985C0u, 0x23755665u, 0xA5E124CBu, 0x6EBDF76Eu,
+        0x73B8C7D6u, 0xB8E41473u, 0x3E7066DDu, 0xF52CB578u, 0x0F580A6Cu, 0xC404D9C9u,
+        0x4290AB67u, 0x89CC78C2u, 0x94C9487Au, 0x5F959BDFu, 0xD901E971u, 0x125D3AD4u,
+        0xE30B8801u, 0x28575BA4u, 0xAEC3290Au, 0x659FFAAFu, 0x789ACA17u, 0xB3C619B2u,
+        0x35526B1Cu, 0xFE0EB8B9u, 0x0C8E08F7u, 0xC7D2DB52u, 0x4146A9FCu, 0x8A1A7A59u,
+        0x971F4AE1u, 0x5C439944u, 0xDAD7EBEAu, 0x118B384Fu, 0xE0DD8A9Au, 0x2B81593Fu,
+        0xAD152B91u, 0x6649F834u, 0x7B4CC88Cu, 0xB0101B29u, 0x36846987u, 0xFDD8BA22u,
+        0x08F40F5Au, 0xC3A8DCFFu, 0x453CAE51u, 0x8E607DF4u, 0x93654D4Cu, 0x58399EE9u,
+        0xDEADEC47u, 0x15F13FE2u, 0xE4A78D37u, 0x2FFB5E92u, 0xA96F2C3Cu, 0x6233FF99u,
+        0x7F36CF21u, 0xB46A1C84u, 0x32FE6E2Au, 0xF9A2BD8Fu, 0x0B220DC1u, 0xC07EDE64u,
+        0x46EAACCAu, 0x8DB67F6Fu, 0x90B34FD7u, 0x5BEF9C72u, 0xDD7BEEDCu, 0x16273D79u,
+        0xE7718FACu, 0x2C2D5C09u, 0xAAB92EA7u, 0x61E5FD02u, 0x7CE0CDBAu, 0xB7BC1E1Fu,
+        0x31286CB1u, 0xFA74BF14u, 0x1EB014D8u, 0xD5ECC77Du, 0x5378B5D3u, 0x98246676u,
+        0x852156CEu, 0x4E7D856Bu, 0xC8E9F7C5u, 0x03B52460u, 0xF2E396B5u, 0x39BF4510u,
+        0xBF2B37BEu, 0x7477E41Bu, 0x6972D4A3u, 0xA22E0706u, 0x24BA75A8u, 0xEFE6A60Du,
+        0x1D661643u, 0xD63AC5E6u, 0x50AEB748u, 0x9BF264EDu, 0x86F75455u, 0x4DAB87F0u,
+        0xCB3FF55Eu, 0x006326FBu, 0xF135942Eu, 0x3A69478Bu, 0xBCFD3525u, 0x77A1E680u,
+        0x6AA4D638u, 0xA1F8059Du, 0x276C7733u, 0xEC30A496u, 0x191C11EEu, 0xD240C24Bu,
+        0x54D4B0E5u, 0x9F886340u, 0x828D53F8u, 0x49D1805Du, 0xCF45F2F3u, 0x04192156u,
+        0xF54F9383u, 0x3E134026u, 0xB8873288u, 0x73DBE12Du, 0x6EDED195u, 0xA5820230u,
+        0x2316709Eu, 0xE84AA33Bu, 0x1ACA1375u, 0xD196C0D0u, 0x5702B27Eu, 0x9C5E61DBu,
+        0x815B5163u, 0x4A0782C6u, 0xCC93F068u, 0x07CF23CDu, 0xF6999118u, 0x3DC542BDu,
+        0xBB513013u, 0x700DE3B6u, 0x6D08D30Eu, 0xA65400ABu, 0x20C07205u, 0xEB9CA1A0u,
+        0x11E81EB4u, 0xDAB4CD11u, 0x5C20BFBFu, 0x977C6C1Au, 0x8A795CA2u, 0x41258F07u,
+        0xC7B1FDA9u, 0x0CED2E0Cu, 0xFDBB9CD9u, 0x36E74F7Cu, 0xB0733DD2u, 0x7B2FEE77u,
+        0x662ADECFu, 0xAD760D6Au, 0x2BE27FC4u, 0xE0BEAC61u, 0x123E1C2Fu, 0xD962CF8Au,
+        0x5FF6BD24u, 0x94AA6E81u, 0x89AF5E39u, 0x42F38D9Cu, 0xC467FF32u, 0x0F3B2C97u,
+        0xFE6D9E42u, 0x35314DE7u, 0xB3A53F49u, 0x78F9ECECu, 0x65FCDC54u, 0xAEA00FF1u,
+        0x28347D5Fu, 0xE368AEFAu, 0x16441B82u, 0xDD18C827u, 0x5B8CBA89u, 0x90D0692Cu,
+        0x8DD55994u, 0x46898A31u, 0xC01DF89Fu, 0x0B412B3Au, 0xFA1799EFu, 0x314B4A4Au,
+        0xB7DF38E4u, 0x7C83EB41u, 0x6186DBF9u, 0xAADA085Cu, 0x2C4E7AF2u, 0xE712A957u,
+        0x15921919u, 0xDECECABCu, 0x585AB812u, 0x93066BB7u, 0x8E035B0Fu, 0x455F88AAu,
+        0xC3CBFA04u, 0x089729A1u, 0xF9C19B74u, 0x329D48D1u, 0xB4093A7Fu, 0x7F55E9DAu,
+        0x6250D962u, 0xA90C0AC7u, 0x2F987869u, 0xE4C4ABCCu,
+    },
+    {
+        0x00000000u, 0xA6770BB4u, 0x979F1129u, 0x31E81A9Du, 0xF44F2413u, 0x52382FA7u,
+        0x63D0353Au, 0xC5A73E8Eu, 0x33EF4E67u, 0x959845D3u, 0xA4705F4Eu, 0x020754FAu,
+        0xC7A06A74u, 0x61D761C0u, 0x503F7B5Du, 0xF64870E9u, 0x67DE9CCEu, 0xC1A9977Au,
+        0xF0418DE7u, 0x56368653u, 0x9391B8DDu, 0x35E6B369u, 0x040EA9F4u, 0xA279A240u,
+        0x5431D2A9u, 0xF246D91Du, 0xC3AEC380u, 0x65D9C834u, 0xA07EF6BAu, 0x0609FD0Eu,
+        0x37E1E793u, 0x9196EC27u, 0xCFBD399Cu, 0x69CA3228u, 0x582228B5u, 0xFE552301u,
+        0x3BF21D8Fu, 0x9D85163Bu, 0xAC6D0CA6u, 0x0A1A0712u, 0xFC5277FBu, 0x5A257C4Fu,
+        0x6BCD66D2u, 0xCDBA6D66u, 0x081D53E8u, 0xAE6A585Cu, 0x9F8242C1u, 0x39F54975u,
+        0xA863A552u, 0x0E14AEE6u, 0x3FFCB47Bu, 0x998BBFCFu, 0x5C2C8141u, 0xFA5B8AF5u,
+        0xCBB39068u, 0x6DC49BDCu, 0x9B8CEB35u, 0x3DFBE081u, 0x0C13FA1Cu, 0xAA64F1A8u,
+        0x6FC3CF26u, 0xC9B4C492u, 0xF85CDE0Fu, 0x5E2BD5BBu, 0x440B7579u, 0xE27C7ECDu,
+        0xD3946450u, 0x75E36FE4u, 0xB044516Au, 0x16335ADEu, 0x27DB4043u, 0x81AC4BF7u,
+        0x77E43B1Eu, 0xD19330AAu, 0xE07B2A37u, 0x460C2183u, 0x83AB1F0Du, 0x25DC14B9u,
+        0x14340E24u, 0xB2430590u, 0x23D5E9B7u, 0x85A2E203u, 0xB44AF89Eu, 0x123DF32Au,
+        0xD79ACDA4u, 0x71EDC610u, 0x4005DC8Du, 0xE672D739u, 0x103AA7D0u, 0xB64DAC64u,
+        0x87A5B6F9u, 0x21D2BD4Du, 0xE47583C3u, 0x42028877u, 0x73EA92EAu, 0xD59D995Eu,
+        0x8BB64CE5u, 0x2DC14751u, 0x1C295DCCu, 0xBA5E5678u, 0x7FF968F6u, 0xD98E6342u,
+        0xE86679DFu, 0x4E11726Bu, 0xB8590282u, 0x1E2E0936u, 0x2FC613ABu, 0x89B1181Fu,
+        0x4C162691u, 0xEA612D25u, 0xDB8937B8u, 0x7DFE3C0Cu, 0xEC68D02Bu, 0x4A1FDB9Fu,
+        0x7BF7C102u, 0xDD80CAB6u, 0x1827F438u, 0xBE50FF8Cu, 0x8FB8E511u, 0x29CFEEA5u,
+        0xDF879E4Cu, 0x79F095F8u, 0x48188F65u, 0xEE6F84D1u, 0x2BC8BA5Fu, 0x8DBFB1EBu,
+        0xBC57AB76u, 0x1A20A0C2u, 0x8816EAF2u, 0x2E61E146u, 0x1F89FBDBu, 0xB9FEF06Fu,
+        0x7C59CEE1u, 0xDA2EC555u, 0xEBC6DFC8u, 0x4DB1D47Cu, 0xBBF9A495u, 0x1D8EAF21u,
+        0x2C66B5BCu, 0x8A11BE08u, 0x4FB68086u, 0xE9C18B32u, 0xD82991AFu, 0x7E5E9A1Bu,
+        0xEFC8763Cu, 0x49BF7D88u, 0x78576715u, 0xDE206CA1u, 0x1B87522Fu, 0xBDF0599Bu,
+        0x8C184306u, 0x2A6F48B2u, 0xDC27385Bu, 0x7A5033EFu, 0x4BB82972u, 0xEDCF22C6u,
+        0x28681C48u, 0x8E1F17FCu, 0xBFF70D61u, 0x198006D5u, 0x47ABD36Eu, 0xE1DCD8DAu,
+        0xD034C247u, 0x7643C9F3u, 0xB3E4F77Du, 0x1593FCC9u, 0x247BE654u, 0x820CEDE0u,
+        0x74449D09u, 0xD23396BDu, 0xE3DB8C20u, 0x45AC8794u, 0x800BB91Au, 0x267CB2AEu,
+        0x1794A833u, 0xB1E3A387u, 0x20754FA0u, 0x86024414u, 0xB7EA5E89u, 0x119D553Du,
+        0xD43A6BB3u, 0x724D6007u, 0x43A57A9Au, 0xE5D2712Eu, 0x139A01C7u, 0xB5ED0A73u,
+        0x840510EEu, 0x22721B5Au, 0xE7D525D4u, 0x41A22E60u, 0x704A34FDu, 0xD63D3F49u,
+        0xCC1D9F8Bu, 0x6A6A943Fu, 0x5B828EA2u, 0xFDF58516u, 0x3852BB98u, 0x9E25B02Cu,
+        0xAFCDAAB1u, 0x09BAA105u, 0xFFF2D1ECu, 0x5985DA58u, 0x686DC0C5u, 0xCE1ACB71u,
+        0x0BBDF5FFu, 0xADCAFE4Bu, 0x9C22E4D6u, 0x3A55EF62u, 0xABC30345u, 0x0DB408F1u,
+        0x3C5C126Cu, 0x9A2B19D8u, 0x5F8C2756u, 0xF9FB2CE2u, 0xC813367Fu, 0x6E643DCBu,
+        0x982C4D22u, 0x3E5B4696u, 0x0FB35C0Bu, 0xA9C457BFu, 0x6C636931u, 0xCA146285u,
+        0xFBFC7818u, 0x5D8B73ACu, 0x03A0A617u, 0xA5D7ADA3u, 0x943FB73Eu, 0x3248BC8Au,
+        0xF7EF8204u, 0x519889B0u, 0x6070932Du, 0xC6079899u, 0x304FE870u, 0x9638E3C4u,
+        0xA7D0F959u, 0x01A7F2EDu, 0xC400CC63u, 0x6277C7D7u, 0x539FDD4Au, 0xF5E8D6FEu,
+        0x647E3AD9u, 0xC209316Du, 0xF3E12BF0u, 0x55962044u, 0x90311ECAu, 0x3646157Eu,
+        0x07AE0FE3u, 0xA1D90457u, 0x579174BEu, 0xF1E67F0Au, 0xC00E6597u, 0x66796E23u,
+        0xA3DE50ADu, 0x05A95B19u, 0x34414184u, 0x92364A30u,
+    },
+    {
+        0x00000000u, 0xCCAA009Eu, 0x4225077Du, 0x8E8F07E3u, 0x844A0EFAu, 0x48E00E64u,
+        0xC66F0987u, 0x0AC50919u, 0xD3E51BB5u, 0x1F4F1B2Bu, 0x91C01CC8u, 0x5D6A1C56u,
+        0x57AF154Fu, 0x9B0515D1u, 0x158A1232u, 0xD92012ACu, 0x7CBB312Bu, 0xB01131B5u,
+        0x3E9E3656u, 0xF23436C8u, 0xF8F13FD1u, 0x345B3F4Fu, 0xBAD438ACu, 0x767E3832u,
+        0xAF5E2A9Eu, 0x63F42A00u, 0xED7B2DE3u, 0x21D12D7Du, 0x2B142464u, 0xE7BE24FAu,
+        0x69312319u, 0xA59B2387u, 0xF9766256u, 0x35DC62C8u, 0xBB53652Bu, 0x77F965B5u,
+        0x7D3C6CACu, 0xB1966C32u, 0x3F196BD1u, 0xF3B36B4Fu, 0x2A9379E3u, 0xE639797Du,
+        0x68B67E9Eu, 0xA41C7E00u, 0xAED97719u, 0x62737787u, 0xECFC7064u, 0x205670FAu,
+        0x85CD537Du, 0x496753E3u, 0xC7E85400u, 0x0B42549Eu, 0x01875D87u, 0xCD2D5D19u,
+        0x43A25AFAu, 0x8F085A64u, 0x562848C8u, 0x9A824856u, 0x140D4FB5u, 0xD8A74F2Bu,
+        0xD2624632u, 0x1EC846ACu, 0x9047414Fu, 0x5CED41D1u, 0x299DC2EDu, 0xE537C273u,
+        0x6BB8C590u, 0xA712C50Eu, 0xADD7CC17u, 0x617DCC89u, 0xEFF2CB6Au, 0x2358CBF4u,
+        0xFA78D958u, 0x36D2D9C6u, 0xB85DDE25u, 0x74F7DEBBu, 0x7E32D7A2u, 0xB298D73Cu,
+        0x3C17D0DFu, 0xF0BDD041u, 0x5526F3C6u, 0x998CF358u, 0x1703F4BBu, 0xDBA9F425u,
+        0xD16CFD3Cu, 0x1DC6FDA2u, 0x9349FA41u, 0x5FE3FADFu, 0x86C3E873u, 0x4A69E8EDu,
+        0xC4E6EF0Eu, 0x084CEF90u, 0x0289E689u, 0xCE23E617u, 0x40ACE1F4u, 0x8C06E16Au,
+        0xD0EBA0BBu, 0x1C41A025u, 0x92CEA7C6u, 0x5E64A758u, 0x54A1AE41u, 0x980BAEDFu,
+        0x1684A93Cu, 0xDA2EA9A2u, 0x030EBB0Eu, 0xCFA4BB90u, 0x412BBC73u, 0x8D81BCEDu,
+        0x8744B5F4u, 0x4BEEB56Au, 0xC561B289u, 0x09CBB217u, 0xAC509190u, 0x60FA910Eu,
+        0xEE7596EDu, 0x22DF9673u, 0x281A9F6Au, 0xE4B09FF4u, 0x6A3F9817u, 0xA6959889u,
+        0x7FB58A25u, 0xB31F8ABBu, 0x3D908D58u, 0xF13A8DC6u, 0xFBFF84DFu, 0x37558441u,
+        0xB9DA83A2u, 0x7570833Cu, 0x533B85DAu, 0x9F918544u, 0x111E82A7u, 0xDDB48239u,
+        0xD7718B20u, 0x1BDB8BBEu, 0x95548C5Du, 0x59FE8CC3u, 0x80DE9E6Fu, 0x4C749EF1u,
+        0xC2FB9912u, 0x0E51998Cu, 0x04949095u, 0xC83E900Bu, 0x46B197E8u, 0x8A1B9776u,
+        0x2F80B4F1u, 0xE32AB46Fu, 0x6DA5B38Cu, 0xA10FB312u, 0xABCABA0Bu, 0x6760BA95u,
+        0xE9EFBD76u, 0x2545BDE8u, 0xFC65AF44u, 0x30CFAFDAu, 0xBE40A839u, 0x72EAA8A7u,
+        0x782FA1BEu, 0xB485A120u, 0x3A0AA6C3u, 0xF6A0A65Du, 0xAA4DE78Cu, 0x66E7E712u,
+        0xE868E0F1u, 0x24C2E06Fu, 0x2E07E976u, 0xE2ADE9E8u, 0x6C22EE0Bu, 0xA088EE95u,
+        0x79A8FC39u, 0xB502FCA7u, 0x3B8DFB44u, 0xF727FBDAu, 0xFDE2F2C3u, 0x3148F25Du,
+        0xBFC7F5BEu, 0x736DF520u, 0xD6F6D6A7u, 0x1A5CD639u, 0x94D3D1DAu, 0x5879D144u,
+        0x52BCD85Du, 0x9E16D8C3u, 0x1099DF20u, 0xDC33DFBEu, 0x0513CD12u, 0xC9B9CD8Cu,
+        0x4736CA6Fu, 0x8B9CCAF1u, 0x8159C3E8u, 0x4DF3C376u, 0xC37CC495u, 0x0FD6C40Bu,
+        0x7AA64737u, 0xB60C47A9u, 0x3883404Au, 0xF42940D4u, 0xFEEC49CDu, 0x32464953u,
+        0xBCC94EB0u, 0x70634E2Eu, 0xA9435C82u, 0x65E95C1Cu, 0xEB665BFFu, 0x27CC5B61u,
+        0x2D095278u, 0xE1A352E6u, 0x6F2C5505u, 0xA386559Bu, 0x061D761Cu, 0xCAB77682u,
+        0x44387161u, 0x889271FFu, 0x825778E6u, 0x4EFD7878u, 0xC0727F9Bu, 0x0CD87F05u,
+        0xD5F86DA9u, 0x19526D37u, 0x97DD6AD4u, 0x5B776A4Au, 0x51B26353u, 0x9D1863CDu,
+        0x1397642Eu, 0xDF3D64B0u, 0x83D02561u, 0x4F7A25FFu, 0xC1F5221Cu, 0x0D5F2282u,
+        0x079A2B9Bu, 0xCB302B05u, 0x45BF2CE6u, 0x89152C78u, 0x50353ED4u, 0x9C9F3E4Au,
+        0x121039A9u, 0xDEBA3937u, 0xD47F302Eu, 0x18D530B0u, 0x965A3753u, 0x5AF037CDu,
+        0xFF6B144Au, 0x33C114D4u, 0xBD4E1337u, 0x71E413A9u, 0x7B211AB0u, 0xB78B1A2Eu,
+        0x39041DCDu, 0xF5AE1D53u, 0x2C8E0FFFu, 0xE0240F61u, 0x6EAB0882u, 0xA201081Cu,
+        0xA8C40105u, 0x646E019Bu, 0xEAE10678u, 0x264B06E6u,
+    },
+    {
+        0x00000000u, 0x177B1443u, 0x2EF62886u, 0x398D3CC5u, 0x5DEC510Cu, 0x4A97454Fu,
+        0x731A798Au, 0x64616DC9u, 0xBBD8A218u, 0xACA3B65Bu, 0x952E8A9Eu, 0x82559EDDu,
+        0xE634F314u, 0xF14FE757u, 0xC8C2DB92u, 0xDFB9CFD1u, 0xACC04271u, 0xBBBB5632u,
+        0x82366AF7u, 0x954D7EB4u, 0xF12C137Du, 0xE657073Eu, 0xDFDA3BFBu, 0xC8A12FB8u,
+        0x1718E069u, 0x0063F42Au, 0x39EEC8EFu, 0x2E95DCACu, 0x4AF4B165u, 0x5D8FA526u,
+        0x640299E3u, 0x73798DA0u, 0x82F182A3u, 0x958A96E0u, 0xAC07AA25u, 0xBB7CBE66u,
+        0xDF1DD3AFu, 0xC866C7ECu, 0xF1EBFB29u, 0xE690EF6Au, 0x392920BBu, 0x2E5234F8u,
+        0x17DF083Du, 0x00A41C7Eu, 0x64C571B7u, 0x73BE65F4u, 0x4A335931u, 0x5D484D72u,
+        0x2E31C0D2u, 0x394AD491u, 0x00C7E854u, 0x17BCFC17u, 0x73DD91DEu, 0x64A6859Du,
+        0x5D2BB958u, 0x4A50AD1Bu, 0x95E962CAu, 0x82927689u, 0xBB1F4A4Cu, 0xAC645E0Fu,
+        0xC80533C6u, 0xDF7E2785u, 0xE6F31B40u, 0xF1880F03u, 0xDE920307u, 0xC9E91744u,
+        0xF0642B81u, 0xE71F3FC2u, 0x837E520Bu, 0x94054648u, 0xAD887A8Du, 0xBAF36ECEu,
+        0x654AA11Fu, 0x7231B55Cu, 0x4BBC8999u, 0x5CC79DDAu, 0x38A6F013u, 0x2FDDE450u,
+        0x1650D895u, 0x012BCCD6u, 0x72524176u, 0x65295535u, 0x5CA469F0u, 0x4BDF7DB3u,
+        0x2FBE107Au, 0x38C50439u, 0x014838FCu, 0x16332CBFu, 0xC98AE36Eu, 0xDEF1F72Du,
+        0xE77CCBE8u, 0xF007DFABu, 0x9466B262u, 0x831DA621u, 0xBA909AE4u, 0xADEB8EA7u,
+        0x5C6381A4u, 0x4B1895E7u, 0x7295A922u, 0x65EEBD61u, 0x018FD0A8u, 0x16F4C4EBu,
+        0x2F79F82Eu, 0x3802EC6Du, 0xE7BB23BCu, 0xF0C037FFu, 0xC94D0B3Au, 0xDE361F79u,
+        0xBA5772B0u, 0xAD2C66F3u, 0x94A15A36u, 0x83DA4E75u, 0xF0A3C3D5u, 0xE7D8D796u,
+        0xDE55EB53u, 0xC92EFF10u, 0xAD4F92D9u, 0xBA34869Au, 0x83B9BA5Fu, 0x94C2AE1Cu,
+        0x4B7B61CDu, 0x5C00758Eu, 0x658D494Bu, 0x72F65D08u, 0x169730C1u, 0x01EC2482u,
+        0x38611847u, 0x2F1A0C04u, 0x6655004Fu, 0x712E140Cu, 0x48A328C9u, 0x5FD83C8Au,
+        0x3BB95143u, 0x2CC24500u, 0x154F79C5u, 0x02346D86u, 0xDD8DA257u, 0xCAF6B614u,
+        0xF37B8AD1u, 0xE4009E92u, 0x8061F35Bu, 0x971AE718u, 0xAE97DBDDu, 0xB9ECCF9Eu,
+        0xCA95423Eu, 0xDDEE567Du, 0xE4636AB8u, 0xF3187EFBu, 0x97791332u, 0x80020771u,
+        0xB98F3BB4u, 0xAEF42FF7u, 0x714DE026u, 0x6636F465u, 0x5FBBC8A0u, 0x48C0DCE3u,
+        0x2CA1B12Au, 0x3BDAA569u, 0x025799ACu, 0x152C8DEFu, 0xE4A482ECu, 0xF3DF96AFu,
+        0xCA52AA6Au, 0xDD29BE29u, 0xB948D3E0u, 0xAE33C7A3u, 0x97BEFB66u, 0x80C5EF25u,
+        0x5F7C20F4u, 0x480734B7u, 0x718A0872u, 0x66F11C31u, 0x029071F8u, 0x15EB65BBu,
+        0x2C66597Eu, 0x3B1D4D3Du, 0x4864C09Du, 0x5F1FD4DEu, 0x6692E81Bu, 0x71E9FC58u,
+        0x15889191u, 0x02F385D2u, 0x3B7EB917u, 0x2C05AD54u, 0xF3BC6285u, 0xE4C776C6u,
+        0xDD4A4A03u, 0xCA315E40u, 0xAE503389u, 0xB92B27CAu, 0x80A61B0Fu, 0x97DD0F4Cu,
+        0xB8C70348u, 0xAFBC170Bu, 0x96312BCEu, 0x814A3F8Du, 0xE52B5244u, 0xF2504607u,
+        0xCBDD7AC2u, 0xDCA66E81u, 0x031FA150u, 0x1464B513u, 0x2DE989D6u, 0x3A929D95u,
+        0x5EF3F05Cu, 0x4988E41Fu, 0x7005D8DAu, 0x677ECC99u, 0x14074139u, 0x037C557Au,
+        0x3AF169BFu, 0x2D8A7DFCu, 0x49EB1035u, 0x5E900476u, 0x671D38B3u, 0x70662CF0u,
+        0xAFDFE321u, 0xB8A4F762u, 0x8129CBA7u, 0x9652DFE4u, 0xF233B22Du, 0xE548A66Eu,
+        0xDCC59AABu, 0xCBBE8EE8u, 0x3A3681EBu, 0x2D4D95A8u, 0x14C0A96Du, 0x03BBBD2Eu,
+        0x67DAD0E7u, 0x70A1C4A4u, 0x492CF861u, 0x5E57EC22u, 0x81EE23F3u, 0x969537B0u,
+        0xAF180B75u, 0xB8631F36u, 0xDC0272FFu, 0xCB7966BCu, 0xF2F45A79u, 0xE58F4E3Au,
+        0x96F6C39Au, 0x818DD7D9u, 0xB800EB1Cu, 0xAF7BFF5Fu, 0xCB1A9296u, 0xDC6186D5u,
+        0xE5ECBA10u, 0xF297AE53u, 0x2D2E6182u, 0x3A5575C1u, 0x03D84904u, 0x14A35D47u,
+        0x70C2308Eu, 0x67B924CDu, 0x5E341808u, 0x494F0C4Bu,
+    },
+    {
+        0x00000000u, 0xEFC26B3Eu, 0x04F5D03Du, 0xEB37BB03u, 0x09EBA07Au, 0xE629CB44u,
+        0x0D1E7047u, 0xE2DC1B79u, 0x13D740F4u, 0xFC152BCAu, 0x172290C9u, 0xF8E0FBF7u,
+        0x1A3CE08Eu, 0xF5FE8BB0u, 0x1EC930B3u, 0xF10B5B8Du, 0x27AE81E8u, 0xC86CEAD6u,
+        0x235B51D5u, 0xCC993AEBu, 0x2E452192u, 0xC1874AACu, 0x2AB0F1AFu, 0xC5729A91u,
+        0x3479C11Cu, 0xDBBBAA22u, 0x308C1121u, 0xDF4E7A1Fu, 0x3D926166u, 0xD2500A58u,
+        0x3967B15Bu, 0xD6A5DA65u, 0x4F5D03D0u, 0xA09F68EEu, 0x4BA8D3EDu, 0xA46AB8D3u,
+        0x46B6A3AAu, 0xA974C894u, 0x42437397u, 0xAD8118A9u, 0x5C8A4324u, 0xB348281Au,
+        0x587F9319u, 0xB7BDF827u, 0x5561E35Eu, 0xBAA38860u, 0x51943363u, 0xBE56585Du,
+        0x68F38238u, 0x8731E906u, 0x6C065205u, 0x83C4393Bu, 0x61182242u, 0x8EDA497Cu,
+        0x65EDF27Fu, 0x8A2F9941u, 0x7B24C2CCu, 0x94E6A9F2u, 0x7FD112F1u, 0x901379CFu,
+        0x72CF62B6u, 0x9D0D0988u, 0x763AB28Bu, 0x99F8D9B5u, 0x9EBA07A0u, 0x71786C9Eu,
+        0x9A4FD79Du, 0x758DBCA3u, 0x9751A7DAu, 0x7893CCE4u, 0x93A477E7u, 0x7C661CD9u,
+        0x8D6D4754u, 0x62AF2C6Au, 0x89989769u, 0x665AFC57u, 0x8486E72Eu, 0x6B448C10u,
+        0x80733713u, 0x6FB15C2Du, 0xB9148648u, 0x56D6ED76u, 0xBDE15675u, 0x52233D4Bu,
+        0xB0FF2632u, 0x5F3D4D0Cu, 0xB40AF60Fu, 0x5BC89D31u, 0xAAC3C6BCu, 0x4501AD82u,
+        0xAE361681u, 0x41F47DBFu, 0xA32866C6u, 0x4CEA0DF8u, 0xA7DDB6FBu, 0x481FDDC5u,
+        0xD1E70470u, 0x3E256F4Eu, 0xD512D44Du, 0x3AD0BF73u, 0xD80CA40Au, 0x37CECF34u,
+        0xDCF97437u, 0x333B1F09u, 0xC2304484u, 0x2DF22FBAu, 0xC6C594B9u, 0x2907FF87u,
+        0xCBDBE4FEu, 0x24198FC0u, 0xCF2E34C3u, 0x20EC5FFDu, 0xF6498598u, 0x198BEEA6u,
+        0xF2BC55A5u, 0x1D7E3E9Bu, 0xFFA225E2u, 0x10604EDCu, 0xFB57F5DFu, 0x14959EE1u,
+        0xE59EC56Cu, 0x0A5CAE52u, 0xE16B1551u, 0x0EA97E6Fu, 0xEC756516u, 0x03B70E28u,
+        0xE880B52Bu, 0x0742DE15u, 0xE6050901u, 0x09C7623Fu, 0xE2F0D93Cu, 0x0D32B202u,
+        0xEFEEA97Bu, 0x002CC245u, 0xEB1B7946u, 0x04D91278u, 0xF5D249F5u, 0x1A1022CBu,
+        0xF12799C8u, 0x1EE5F2F6u, 0xFC39E98Fu, 0x13FB82B1u, 0xF8CC39B2u, 0x170E528Cu,
+        0xC1AB88E9u, 0x2E69E3D7u, 0xC55E58D4u, 0x2A9C33EAu, 0xC8402893u, 0x278243ADu,
+        0xCCB5F8AEu, 0x23779390u, 0xD27CC81Du, 0x3DBEA323u, 0xD6891820u, 0x394B731Eu,
+        0xDB976867u, 0x34550359u, 0xDF62B85Au, 0x30A0D364u, 0xA9580AD1u, 0x469A61EFu,
+        0xADADDAECu, 0x426FB1D2u, 0xA0B3AAABu, 0x4F71C195u, 0xA4467A96u, 0x4B8411A8u,
+        0xBA8F4A25u, 0x554D211Bu, 0xBE7A9A18u, 0x51B8F126u, 0xB364EA5Fu, 0x5CA68161u,
+        0xB7913A62u, 0x5853515Cu, 0x8EF68B39u, 0x6134E007u, 0x8A035B04u, 0x65C1303Au,
+        0x871D2B43u, 0x68DF407Du, 0x83E8FB7Eu, 0x6C2A9040u, 0x9D21CBCDu, 0x72E3A0F3u,
+        0x99D41BF0u, 0x761670CEu, 0x94CA6BB7u, 0x7B080089u, 0x903FBB8Au, 0x7FFDD0B4u,
+        0x78BF0EA1u, 0x977D659Fu, 0x7C4ADE9Cu, 0x9388B5A2u, 0x7154AEDBu, 0x9E96C5E5u,
+        0x75A17EE6u, 0x9A6315D8u, 0x6B684E55u, 0x84AA256Bu, 0x6F9D9E68u, 0x805FF556u,
+        0x6283EE2Fu, 0x8D418511u, 0x66763E12u, 0x89B4552Cu, 0x5F118F49u, 0xB0D3E477u,
+        0x5BE45F74u, 0xB426344Au, 0x56FA2F33u, 0xB938440Du, 0x520FFF0Eu, 0xBDCD9430u,
+        0x4CC6CFBDu, 0xA304A483u, 0x48331F80u, 0xA7F174BEu, 0x452D6FC7u, 0xAAEF04F9u,
+        0x41D8BFFAu, 0xAE1AD4C4u, 0x37E20D71u, 0xD820664Fu, 0x3317DD4Cu, 0xDCD5B672u,
+        0x3E09AD0Bu, 0xD1CBC635u, 0x3AFC7D36u, 0xD53E1608u, 0x24354D85u, 0xCBF726BBu,
+        0x20C09DB8u, 0xCF02F686u, 0x2DDEEDFFu, 0xC21C86C1u, 0x292B3DC2u, 0xC6E956FCu,
+        0x104C8C99u, 0xFF8EE7A7u, 0x14B95CA4u, 0xFB7B379Au, 0x19A72CE3u, 0xF66547DDu,
+        0x1D52FCDEu, 0xF29097E0u, 0x039BCC6Du, 0xEC59A753u, 0x076E1C50u, 0xE8AC776Eu,
+        0x0A706C17u, 0xE5B20729u, 0x0E85BC2Au, 0xE147D714u,
+    },
+    {
+        0x00000000u, 0xC18EDFC0u, 0x586CB9C1u, 0x99E26601u, 0xB0D97382u, 0x7157AC42u,
+        0xE8B5CA43u, 0x293B1583u, 0xBAC3E145u, 0x7B4D3E85u, 0xE2AF5884u, 0x23218744u,
+        0x0A1A92C7u, 0xCB944D07u, 0x52762B06u, 0x93F8F4C6u, 0xAEF6C4CBu, 0x6F781B0Bu,
+        0xF69A7D0Au, 0x3714A2CAu, 0x1E2FB749u, 0xDFA16889u, 0x46430E88u, 0x87CDD148u,
+        0x1435258Eu, 0xD5BBFA4Eu, 0x4C599C4Fu, 0x8DD7438Fu, 0xA4EC560Cu, 0x656289CCu,
+        0xFC80EFCDu, 0x3D0E300Du, 0x869C8FD7u, 0x47125017u, 0xDEF03616u, 0x1F7EE9D6u,
+        0x3645FC55u, 0xF7CB2395u, 0x6E294594u, 0xAFA79A54u, 0x3C5F6E92u, 0xFDD1B152u,
+        0x6433D753u, 0xA5BD0893u, 0x8C861D10u, 0x4D08C2D0u, 0xD4EAA4D1u, 0x15647B11u,
+        0x286A4B1Cu, 0xE9E494DCu, 0x7006F2DDu, 0xB1882D1Du, 0x98B3389Eu, 0x593DE75Eu,
+        0xC0DF815Fu, 0x01515E9Fu, 0x92A9AA59u, 0x53277599u, 0xCAC51398u, 0x0B4BCC58u,
+        0x2270D9DBu, 0xE3FE061Bu, 0x7A1C601Au, 0xBB92BFDAu, 0xD64819EFu, 0x17C6C62Fu,
+        0x8E24A02Eu, 0x4FAA7FEEu, 0x66916A6Du, 0xA71FB5ADu, 0x3EFDD3ACu, 0xFF730C6Cu,
+        0x6C8BF8AAu, 0xAD05276Au, 0x34E7416Bu, 0xF5699EABu, 0xDC528B28u, 0x1DDC54E8u,
+        0x843E32E9u, 0x45B0ED29u, 0x78BEDD24u, 0xB93002E4u, 0x20D264E5u, 0xE15CBB25u,
+        0xC867AEA6u, 0x09E97166u, 0x900B1767u, 0x5185C8A7u, 0xC27D3C61u, 0x03F3E3A1u,
+        0x9A1185A0u, 0x5B9F5A60u, 0x72A44FE3u, 0xB32A9023u, 0x2AC8F622u, 0xEB4629E2u,
+        0x50D49638u, 0x915A49F8u, 0x08B82FF9u, 0xC936F039u, 0xE00DE5BAu, 0x21833A7Au,
+        0xB8615C7Bu, 0x79EF83BBu, 0xEA17777Du, 0x2B99A8BDu, 0xB27BCEBCu, 0x73F5117Cu,
+        0x5ACE04FFu, 0x9B40DB3Fu, 0x02A2BD3Eu, 0xC32C62FEu, 0xFE2252F3u, 0x3FAC8D33u,
+        0xA64EEB32u, 0x67C034F2u, 0x4EFB2171u, 0x8F75FEB1u, 0x169798B0u, 0xD7194770u,
+        0x44E1B3B6u, 0x856F6C76u, 0x1C8D0A77u, 0xDD03D5B7u, 0xF438C034u, 0x35B61FF4u,
+        0xAC5479F5u, 0x6DDAA635u, 0x77E1359Fu, 0xB66FEA5Fu, 0x2F8D8C5Eu, 0xEE03539Eu,
+        0xC738461Du, 0x06B699DDu, 0x9F54FFDCu, 0x5EDA201Cu, 0xCD22D4DAu, 0x0CAC0B1Au,
+        0x954E6D1Bu, 0x54C0B2DBu, 0x7DFBA758u, 0xBC757898u, 0x25971E99u, 0xE419C159u,
+        0xD917F154u, 0x18992E94u, 0x817B4895u, 0x40F59755u, 0x69CE82D6u, 0xA8405D16u,
+        0x31A23B17u, 0xF02CE4D7u, 0x63D41011u, 0xA25ACFD1u, 0x3BB8A9D0u, 0xFA367610u,
+        0xD30D6393u, 0x1283BC53u, 0x8B61DA52u, 0x4AEF0592u, 0xF17DBA48u, 0x30F36588u,
+        0xA9110389u, 0x689FDC49u, 0x41A4C9CAu, 0x802A160Au, 0x19C8700Bu, 0xD846AFCBu,
+        0x4BBE5B0Du, 0x8A3084CDu, 0x13D2E2CCu, 0xD25C3D0Cu, 0xFB67288Fu, 0x3AE9F74Fu,
+        0xA30B914Eu, 0x62854E8Eu, 0x5F8B7E83u, 0x9E05A143u, 0x07E7C742u, 0xC6691882u,
+        0xEF520D01u, 0x2EDCD2C1u, 0xB73EB4C0u, 0x76B06B00u, 0xE5489FC6u, 0x24C64006u,
+        0xBD242607u, 0x7CAAF9C7u, 0x5591EC44u, 0x941F3384u, 0x0DFD5585u, 0xCC738A45u,
+        0xA1A92C70u, 0x6027F3B0u, 0xF9C595B1u, 0x384B4A71u, 0x11705FF2u, 0xD0FE8032u,
+        0x491CE633u, 0x889239F3u, 0x1B6ACD35u, 0xDAE412F5u, 0x430674F4u, 0x8288AB34u,
+        0xABB3BEB7u, 0x6A3D6177u, 0xF3DF0776u, 0x3251D8B6u, 0x0F5FE8BBu, 0xCED1377Bu,
+        0x5733517Au, 0x96BD8EBAu, 0xBF869B39u, 0x7E0844F9u, 0xE7EA22F8u, 0x2664FD38u,
+        0xB59C09FEu, 0x7412D63Eu, 0xEDF0B03Fu, 0x2C7E6FFFu, 0x05457A7Cu, 0xC4CBA5BCu,
+        0x5D29C3BDu, 0x9CA71C7Du, 0x2735A3A7u, 0xE6BB7C67u, 0x7F591A66u, 0xBED7C5A6u,
+        0x97ECD025u, 0x56620FE5u, 0xCF8069E4u, 0x0E0EB624u, 0x9DF642E2u, 0x5C789D22u,
+        0xC59AFB23u, 0x041424E3u, 0x2D2F3160u, 0xECA1EEA0u, 0x754388A1u, 0xB4CD5761u,
+        0x89C3676Cu, 0x484DB8ACu, 0xD1AFDEADu, 0x1021016Du, 0x391A14EEu, 0xF894CB2Eu,
+        0x6176AD2Fu, 0xA0F872EFu, 0x33008629u, 0xF28E59E9u, 0x6B6C3FE8u, 0xAAE2E028u,
+        0x83D9F5ABu, 0x42572A6Bu, 0xDBB54C6Au, 0x1A3B93AAu,
+    },
+    {
+        0x00000000u, 0x9BA54C6Fu, 0xEC3B9E9Fu, 0x779ED2F0u, 0x03063B7Fu, 0x98A37710u,
+        0xEF3DA5E0u, 0x7498E98Fu, 0x060C76FEu, 0x9DA93A91u, 0xEA37E861u, 0x7192A40Eu,
+        0x050A4D81u, 0x9EAF01EEu, 0xE931D31Eu, 0x72949F71u, 0x0C18EDFCu, 0x97BDA193u,
+        0xE0237363u, 0x7B863F0Cu, 0x0F1ED683u, 0x94BB9AECu, 0xE325481Cu, 0x78800473u,
+        0x0A149B02u, 0x91B1D76Du, 0xE62F059Du, 0x7D8A49F2u, 0x0912A07Du, 0x92B7EC12u,
+        0xE5293EE2u, 0x7E8C728Du, 0x1831DBF8u, 0x83949797u, 0xF40A4567u, 0x6FAF0908u,
+        0x1B37E087u, 0x8092ACE8u, 0xF70C7E18u, 0x6CA93277u, 0x1E3DAD06u, 0x8598E169u,
+        0xF2063399u, 0x69A37FF6u, 0x1D3B9679u, 0x869EDA16u, 0xF10008E6u, 0x6AA54489u,
+        0x14293604u, 0x8F8C7A6Bu, 0xF812A89Bu, 0x63B7E4F4u, 0x172F0D7Bu, 0x8C8A4114u,
+        0xFB1493E4u, 0x60B1DF8Bu, 0x122540FAu, 0x89800C95u, 0xFE1EDE65u, 0x65BB920Au,
+        0x11237B85u, 0x8A8637EAu, 0xFD18E51Au, 0x66BDA975u, 0x3063B7F0u, 0xABC6FB9Fu,
+        0xDC58296Fu, 0x47FD6500u, 0x33658C8Fu, 0xA8C0C0E0u, 0xDF5E1210u, 0x44FB5E7Fu,
+        0x366FC10Eu, 0xADCA8D61u, 0xDA545F91u, 0x41F113FEu, 0x3569FA71u, 0xAECCB61Eu,
+        0xD95264EEu, 0x42F72881u, 0x3C7B5A0Cu, 0xA7DE1663u, 0xD040C493u, 0x4BE588FCu,
+        0x3F7D6173u, 0xA4D82D1Cu, 0xD346FFECu, 0x48E3B383u, 0x3A772CF2u, 0xA1D2609Du,
+        0xD64CB26Du, 0x4DE9FE02u, 0x3971178Du, 0xA2D45BE2u, 0xD54A8912u, 0x4EEFC57Du,
+        0x28526C08u, 0xB3F72067u, 0xC469F297u, 0x5FCCBEF8u, 0x2B545777u, 0xB0F11B18u,
+        0xC76FC9E8u, 0x5CCA8587u, 0x2E5E1AF6u, 0xB5FB5699u, 0xC2658469u, 0x59C0C806u,
+        0x2D582189u, 0xB6FD6DE6u, 0xC163BF16u, 0x5AC6F379u, 0x244A81F4u, 0xBFEFCD9Bu,
+        0xC8711F6Bu, 0x53D45304u, 0x274CBA8Bu, 0xBCE9F6E4u, 0xCB772414u, 0x50D2687Bu,
+        0x2246F70Au, 0xB9E3BB65u, 0xCE7D6995u, 0x55D825FAu, 0x2140CC75u, 0xBAE5801Au,
+        0xCD7B52EAu, 0x56DE1E85u, 0x60C76FE0u, 0xFB62238Fu, 0x8CFCF17Fu, 0x1759BD10u,
+        0x63C1549Fu, 0xF86418F0u, 0x8FFACA00u, 0x145F866Fu, 0x66CB191Eu, 0xFD6E5571u,
+        0x8AF08781u, 0x1155CBEEu, 0x65CD2261u, 0xFE686E0Eu, 0x89F6BCFEu, 0x1253F091u,
+        0x6CDF821Cu, 0xF77ACE73u, 0x80E41C83u, 0x1B4150ECu, 0x6FD9B963u, 0xF47CF50Cu,
+        0x83E227FCu, 0x18476B93u, 0x6AD3F4E2u, 0xF176B88Du, 0x86E86A7Du, 0x1D4D2612u,
+        0x69D5CF9Du, 0xF27083F2u, 0x85EE5102u, 0x1E4B1D6Du, 0x78F6B418u, 0xE353F877u,
+        0x94CD2A87u, 0x0F6866E8u, 0x7BF08F67u, 0xE055C308u, 0x97CB11F8u, 0x0C6E5D97u,
+        0x7EFAC2E6u, 0xE55F8E89u, 0x92C15C79u, 0x09641016u, 0x7DFCF999u, 0xE659B5F6u,
+        0x91C76706u, 0x0A622B69u, 0x74EE59E4u, 0xEF4B158Bu, 0x98D5C77Bu, 0x03708B14u,
+        0x77E8629Bu, 0xEC4D2EF4u, 0x9BD3FC04u, 0x0076B06Bu, 0x72E22F1Au, 0xE9476375u,
+        0x9ED9B185u, 0x057CFDEAu, 0x71E41465u, 0xEA41580Au, 0x9DDF8AFAu, 0x067AC695u,
+        0x50A4D810u, 0xCB01947Fu, 0xBC9F468Fu, 0x273A0AE0u, 0x53A2E36Fu, 0xC807AF00u,
+        0xBF997DF0u, 0x243C319Fu, 0x56A8AEEEu, 0xCD0DE281u, 0xBA933071u, 0x21367C1Eu,
+        0x55AE9591u, 0xCE0BD9FEu, 0xB9950B0Eu, 0x22304761u, 0x5CBC35ECu, 0xC7197983u,
+        0xB087AB73u, 0x2B22E71Cu, 0x5FBA0E93u, 0xC41F42FCu, 0xB381900Cu, 0x2824DC63u,
+        0x5AB04312u, 0xC1150F7Du, 0xB68BDD8Du, 0x2D2E91E2u, 0x59B6786Du, 0xC2133402u,
+        0xB58DE6F2u, 0x2E28AA9Du, 0x489503E8u, 0xD3304F87u, 0xA4AE9D77u, 0x3F0BD118u,
+        0x4B933897u, 0xD03674F8u, 0xA7A8A608u, 0x3C0DEA67u, 0x4E997516u, 0xD53C3979u,
+        0xA2A2EB89u, 0x3907A7E6u, 0x4D9F4E69u, 0xD63A0206u, 0xA1A4D0F6u, 0x3A019C99u,
+        0x448DEE14u, 0xDF28A27Bu, 0xA8B6708Bu, 0x33133CE4u, 0x478BD56Bu, 0xDC2E9904u,
+        0xABB04BF4u, 0x3015079Bu, 0x428198EAu, 0xD924D485u, 0xAEBA0675u, 0x351F4A1Au,
+        0x4187A395u, 0xDA22EFFAu, 0xADBC3D0Au, 0x36197165u,
+    },
+    {
+        0x00000000u, 0xDD96D985u, 0x605CB54Bu, 0xBDCA6CCEu, 0xC0B96A96u, 0x1D2FB313u,
+        0xA0E5DFDDu, 0x7D730658u, 0x5A03D36Du, 0x87950AE8u, 0x3A5F6626u, 0xE7C9BFA3u,
+        0x9ABAB9FBu, 0x472C607Eu, 0xFAE60CB0u, 0x2770D535u, 0xB407A6DAu, 0x69917F5Fu,
+        0xD45B1391u, 0x09CDCA14u, 0x74BECC4Cu, 0xA92815C9u, 0x14E27907u, 0xC974A082u,
+        0xEE0475B7u, 0x3392AC32u, 0x8E58C0FCu, 0x53CE1979u, 0x2EBD1F21u, 0xF32BC6A4u,
+        0x4EE1AA6Au, 0x937773EFu, 0xB37E4BF5u, 0x6EE89270u, 0xD322FEBEu, 0x0EB4273Bu,
+        0x73C72163u, 0xAE51F8E6u, 0x139B9428u, 0xCE0D4DADu, 0xE97D9898u, 0x34EB411Du,
+        0x89212DD3u, 0x54B7F456u, 0x29C4F20Eu, 0xF4522B8Bu, 0x49984745u, 0x940E9EC0u,
+        0x0779ED2Fu, 0xDAEF34AAu, 0x67255864u, 0xBAB381E1u, 0xC7C087B9u, 0x1A565E3Cu,
+        0xA79C32F2u, 0x7A0AEB77u, 0x5D7A3E42u, 0x80ECE7C7u, 0x3D268B09u, 0xE0B0528Cu,
+        0x9DC354D4u, 0x40558D51u, 0xFD9FE19Fu, 0x2009381Au, 0xBD8D91ABu, 0x601B482Eu,
+        0xDDD124E0u, 0x0047FD65u, 0x7D34FB3Du, 0xA0A222B8u, 0x1D684E76u, 0xC0FE97F3u,
+        0xE78E42C6u, 0x3A189B43u, 0x87D2F78Du, 0x5A442E08u, 0x27372850u, 0xFAA1F1D5u,
+        0x476B9D1Bu, 0x9AFD449Eu, 0x098A3771u, 0xD41CEEF4u, 0x69D6823Au, 0xB4405BBFu,
+        0xC9335DE7u, 0x14A58462u, 0xA96FE8ACu, 0x74F93129u, 0x5389E41Cu, 0x8E1F3D99u,
+        0x33D55157u, 0xEE4388D2u, 0x93308E8Au, 0x4EA6570Fu, 0xF36C3BC1u, 0x2EFAE244u,
+        0x0EF3DA5Eu, 0xD36503DBu, 0x6EAF6F15u, 0xB339B690u, 0xCE4AB0C8u, 0x13DC694Du,
+        0xAE160583u, 0x7380DC06u, 0x54F00933u, 0x8966D0B6u, 0x34ACBC78u, 0xE93A65FDu,
+        0x944963A5u, 0x49DFBA20u, 0xF415D6EEu, 0x29830F6Bu, 0xBAF47C84u, 0x6762A501u,
+        0xDAA8C9CFu, 0x073E104Au, 0x7A4D1612u, 0xA7DBCF97u, 0x1A11A359u, 0xC7877ADCu,
+        0xE0F7AFE9u, 0x3D61766Cu, 0x80AB1AA2u, 0x5D3DC327u, 0x204EC57Fu, 0xFDD81CFAu,
+        0x40127034u, 0x9D84A9B1u, 0xA06A2517u, 0x7DFCFC92u, 0xC036905Cu, 0x1DA049D9u,
+        0x60D34F81u, 0xBD459604u, 0x008FFACAu, 0xDD19234Fu, 0xFA69F67Au, 0x27FF2FFFu,
+        0x9A354331u, 0x47A39AB4u, 0x3AD09CECu, 0xE7464569u, 0x5A8C29A7u, 0x871AF022u,
+        0x146D83CDu, 0xC9FB5A48u, 0x74313686u, 0xA9A7EF03u, 0xD4D4E95Bu, 0x094230DEu,
+        0xB4885C10u, 0x691E8595u, 0x4E6E50A0u, 0x93F88925u, 0x2E32E5EBu, 0xF3A43C6Eu,
+        0x8ED73A36u, 0x5341E3B3u, 0xEE8B8F7Du, 0x331D56F8u, 0x13146EE2u, 0xCE82B767u,
+        0x7348DBA9u, 0xAEDE022Cu, 0xD3AD0474u, 0x0E3BDDF1u, 0xB3F1B13Fu, 0x6E6768BAu,
+        0x4917BD8Fu, 0x9481640Au, 0x294B08C4u, 0xF4DDD141u, 0x89AED719u, 0x54380E9Cu,
+        0xE9F26252u, 0x3464BBD7u, 0xA713C838u, 0x7A8511BDu, 0xC74F7D73u, 0x1AD9A4F6u,
+        0x67AAA2AEu, 0xBA3C7B2Bu, 0x07F617E5u, 0xDA60CE60u, 0xFD101B55u, 0x2086C2D0u,
+        0x9D4CAE1Eu, 0x40DA779Bu, 0x3DA971C3u, 0xE03FA846u, 0x5DF5C488u, 0x80631D0Du,
+        0x1DE7B4BCu, 0xC0716D39u, 0x7DBB01F7u, 0xA02DD872u, 0xDD5EDE2Au, 0x00C807AFu,
+        0xBD026B61u, 0x6094B2E4u, 0x47E467D1u, 0x9A72BE54u, 0x27B8D29Au, 0xFA2E0B1Fu,
+        0x875D0D47u, 0x5ACBD4C2u, 0xE701B80Cu, 0x3A976189u, 0xA9E01266u, 0x7476CBE3u,
+        0xC9BCA72Du, 0x142A7EA8u, 0x695978F0u, 0xB4CFA175u, 0x0905CDBBu, 0xD493143Eu,
+        0xF3E3C10Bu, 0x2E75188Eu, 0x93BF7440u, 0x4E29ADC5u, 0x335AAB9Du, 0xEECC7218u,
+        0x53061ED6u, 0x8E90C753u, 0xAE99FF49u, 0x730F26CCu, 0xCEC54A02u, 0x13539387u,
+        0x6E2095DFu, 0xB3B64C5Au, 0x0E7C2094u, 0xD3EAF911u, 0xF49A2C24u, 0x290CF5A1u,
+        0x94C6996Fu, 0x495040EAu, 0x342346B2u, 0xE9B59F37u, 0x547FF3F9u, 0x89E92A7Cu,
+        0x1A9E5993u, 0xC7088016u, 0x7AC2ECD8u, 0xA754355Du, 0xDA273305u, 0x07B1EA80u,
+        0xBA7B864Eu, 0x67ED5FCBu, 0x409D8AFEu, 0x9D0B537Bu, 0x20C13FB5u, 0xFD57E630u,
+        0x8024E068u, 0x5DB239EDu, 0xE0785523u, 0x3DEE8CA6u,
+    },
+    {
+        0x00000000u, 0x9D0FE176u, 0xE16EC4ADu, 0x7C6125DBu, 0x19AC8F1Bu, 0x84A36E6Du,
+        0xF8C24BB6u, 0x65CDAAC0u, 0x33591E36u, 0xAE56FF40u, 0xD237DA9Bu, 0x4F383BEDu,
+        0x2AF5912Du, 0xB7FA705Bu, 0xCB9B5580u, 0x5694B4F6u, 0x66B23C6Cu, 0xFBBDDD1Au,
+        0x87DCF8C1u, 0x1AD319B7u, 0x7F1EB377u, 0xE2115201u, 0x9E7077DAu, 0x037F96ACu,
+        0x55EB225Au, 0xC8E4C32Cu, 0xB485E6F7u, 0x298A0781u, 0x4C47AD41u, 0xD1484C37u,
+        0xAD2969ECu, 0x3026889Au, 0xCD6478D8u, 0x506B99AEu, 0x2C0ABC75u, 0xB1055D03u,
+        0xD4C8F7C3u, 0x49C716B5u, 0x35A6336Eu, 0xA8A9D218u, 0xFE3D66EEu, 0x63328798u,
+        0x1F53A243u, 0x825C4335u, 0xE791E9F5u, 0x7A9E0883u, 0x06FF2D58u, 0x9BF0CC2Eu,
+        0xABD644B4u, 0x36D9A5C2u, 0x4AB88019u, 0xD7B7616Fu, 0xB27ACBAFu, 0x2F752AD9u,
+        0x53140F02u, 0xCE1BEE74u, 0x988F5A82u, 0x0580BBF4u, 0x79E19E2Fu, 0xE4EE7F59u,
+        0x8123D599u, 0x1C2C34EFu, 0x604D1134u, 0xFD42F042u, 0x41B9F7F1u, 0xDCB61687u,
+        0xA0D7335Cu, 0x3DD8D22Au, 0x581578EAu, 0xC51A999Cu, 0xB97BBC47u, 0x24745D31u,
+        0x72E0E9C7u, 0xEFEF08B1u, 0x938E2D6Au, 0x0E81CC1Cu, 0x6B4C66DCu, 0xF64387AAu,
+        0x8A22A271u, 0x172D4307u, 0x270BCB9Du, 0xBA042AEBu, 0xC6650F30u, 0x5B6AEE46u,
+        0x3EA74486u, 0xA3A8A5F0u, 0xDFC9802Bu, 0x42C6615Du, 0x1452D5ABu, 0x895D34DDu,
+        0xF53C1106u, 0x6833F070u, 0x0DFE5AB0u, 0x90F1BBC6u, 0xEC909E1Du, 0x719F7F6Bu,
+        0x8CDD8F29u, 0x11D26E5Fu, 0x6DB34B84u, 0xF0BCAAF2u, 0x95710032u, 0x087EE144u,
+        0x741FC49Fu, 0xE91025E9u, 0xBF84911Fu, 0x228B7069u, 0x5EEA55B2u, 0xC3E5B4C4u,
+        0xA6281E04u, 0x3B27FF72u, 0x4746DAA9u, 0xDA493BDFu, 0xEA6FB345u, 0x77605233u,
+        0x0B0177E8u, 0x960E969Eu, 0xF3C33C5Eu, 0x6ECCDD28u, 0x12ADF8F3u, 0x8FA21985u,
+        0xD936AD73u, 0x44394C05u, 0x385869DEu, 0xA55788A8u, 0xC09A2268u, 0x5D95C31Eu,
+        0x21F4E6C5u, 0xBCFB07B3u, 0x8373EFE2u, 0x1E7C0E94u, 0x621D2B4Fu, 0xFF12CA39u,
+        0x9ADF60F9u, 0x07D0818Fu, 0x7BB1A454u, 0xE6BE4522u, 0xB02AF1D4u, 0x2D2510A2u,
+        0x51443579u, 0xCC4BD40Fu, 0xA9867ECFu, 0x34899FB9u, 0x48E8BA62u, 0xD5E75B14u,
+        0xE5C1D38Eu, 0x78CE32F8u, 0x04AF1723u, 0x99A0F655u, 0xFC6D5C95u, 0x6162BDE3u,
+        0x1D039838u, 0x800C794Eu, 0xD698CDB8u, 0x4B972CCEu, 0x37F60915u, 0xAAF9E863u,
+        0xCF3442A3u, 0x523BA3D5u, 0x2E5A860Eu, 0xB3556778u, 0x4E17973Au, 0xD318764Cu,
+        0xAF795397u, 0x3276B2E1u, 0x57BB1821u, 0xCAB4F957u, 0xB6D5DC8Cu, 0x2BDA3DFAu,
+        0x7D4E890Cu, 0xE041687Au, 0x9C204DA1u, 0x012FACD7u, 0x64E20617u, 0xF9EDE761u,
+        0x858CC2BAu, 0x188323CCu, 0x28A5AB56u, 0xB5AA4A20u, 0xC9CB6FFBu, 0x54C48E8Du,
+        0x3109244Du, 0xAC06C53Bu, 0xD067E0E0u, 0x4D680196u, 0x1BFCB560u, 0x86F35416u,
+        0xFA9271CDu, 0x679D90BBu, 0x02503A7Bu, 0x9F5FDB0Du, 0xE33EFED6u, 0x7E311FA0u,
+        0xC2CA1813u, 0x5FC5F965u, 0x23A4DCBEu, 0xBEAB3DC8u, 0xDB669708u, 0x4669767Eu,
+        0x3A0853A5u, 0xA707B2D3u, 0xF1930625u, 0x6C9CE753u, 0x10FDC288u, 0x8DF223FEu,
+        0xE83F893Eu, 0x75306848u, 0x09514D93u, 0x945EACE5u, 0xA478247Fu, 0x3977C509u,
+        0x4516E0D2u, 0xD81901A4u, 0xBDD4AB64u, 0x20DB4A12u, 0x5CBA6FC9u, 0xC1B58EBFu,
+        0x97213A49u, 0x0A2EDB3Fu, 0x764FFEE4u, 0xEB401F92u, 0x8E8DB552u, 0x13825424u,
+        0x6FE371FFu, 0xF2EC9089u, 0x0FAE60CBu, 0x92A181BDu, 0xEEC0A466u, 0x73CF4510u,
+        0x1602EFD0u, 0x8B0D0EA6u, 0xF76C2B7Du, 0x6A63CA0Bu, 0x3CF77EFDu, 0xA1F89F8Bu,
+        0xDD99BA50u, 0x40965B26u, 0x255BF1E6u, 0xB8541090u, 0xC435354Bu, 0x593AD43Du,
+        0x691C5CA7u, 0xF413BDD1u, 0x8872980Au, 0x157D797Cu, 0x70B0D3BCu, 0xEDBF32CAu,
+        0x91DE1711u, 0x0CD1F667u, 0x5A454291u, 0xC74AA3E7u, 0xBB2B863Cu, 0x2624674Au,
+        0x43E9CD8Au, 0xDEE62CFCu, 0xA2870927u, 0x3F88E851u,
+    },
+    {
+        0x00000000u, 0xB9FBDBE8u, 0xA886B191u, 0x117D6A79u, 0x8A7C6563u, 0x3387BE8Bu,
+        0x22FAD4F2u, 0x9B010F1Au, 0xCF89CC87u, 0x7672176Fu, 0x670F7D16u, 0xDEF4A6FEu,
+        0x45F5A9E4u, 0xFC0E720Cu, 0xED731875u, 0x5488C39Du, 0x44629F4Fu, 0xFD9944A7u,
+        0xECE42EDEu, 0x551FF536u, 0xCE1EFA2Cu, 0x77E521C4u, 0x66984BBDu, 0xDF639055u,
+        0x8BEB53C8u, 0x32108820u, 0x236DE259u, 0x9A9639B1u, 0x019736ABu, 0xB86CED43u,
+        0xA911873Au, 0x10EA5CD2u, 0x88C53E9Eu, 0x313EE576u, 0x20438F0Fu, 0x99B854E7u,
+        0x02B95BFDu, 0xBB428015u, 0xAA3FEA6Cu, 0x13C43184u, 0x474CF219u, 0xFEB729F1u,
+        0xEFCA4388u, 0x56319860u, 0xCD30977Au, 0x74CB4C92u, 0x65B626EBu, 0xDC4DFD03u,
+        0xCCA7A1D1u, 0x755C7A39u, 0x64211040u, 0xDDDACBA8u, 0x46DBC4B2u, 0xFF201F5Au,
+        0xEE5D7523u, 0x57A6AECBu, 0x032E6D56u, 0xBAD5B6BEu, 0xABA8DCC7u, 0x1253072Fu,
+        0x89520835u, 0x30A9D3DDu, 0x21D4B9A4u, 0x982F624Cu, 0xCAFB7B7Du, 0x7300A095u,
+        0x627DCAECu, 0xDB861104u, 0x40871E1Eu, 0xF97CC5F6u, 0xE801AF8Fu, 0x51FA7467u,
+        0x0572B7FAu, 0xBC896C12u, 0xADF4066Bu, 0x140FDD83u, 0x8F0ED299u, 0x36F50971u,
+        0x27886308u, 0x9E73B8E0u, 0x8E99E432u, 0x37623FDAu, 0x261F55A3u, 0x9FE48E4Bu,
+        0x04E58151u, 0xBD1E5AB9u, 0xAC6330C0u, 0x1598EB28u, 0x411028B5u, 0xF8EBF35Du,
+        0xE9969924u, 0x506D42CCu, 0xCB6C4DD6u, 0x7297963Eu, 0x63EAFC47u, 0xDA1127AFu,
+        0x423E45E3u, 0xFBC59E0Bu, 0xEAB8F472u, 0x53432F9Au, 0xC8422080u, 0x71B9FB68u,
+        0x60C49111u, 0xD93F4AF9u, 0x8DB78964u, 0x344C528Cu, 0x253138F5u, 0x9CCAE31Du,
+        0x07CBEC07u, 0xBE3037EFu, 0xAF4D5D96u, 0x16B6867Eu, 0x065CDAACu, 0xBFA70144u,
+        0xAEDA6B3Du, 0x1721B0D5u, 0x8C20BFCFu, 0x35DB6427u, 0x24A60E5Eu, 0x9D5DD5B6u,
+        0xC9D5162Bu, 0x702ECDC3u, 0x6153A7BAu, 0xD8A87C52u, 0x43A97348u, 0xFA52A8A0u,
+        0xEB2FC2D9u, 0x52D41931u, 0x4E87F0BBu, 0xF77C2B53u, 0xE601412Au, 0x5FFA9AC2u,
+        0xC4FB95D8u, 0x7D004E30u, 0x6C7D2449u, 0xD586FFA1u, 0x810E3C3Cu, 0x38F5E7D4u,
+        0x29888DADu, 0x90735645u, 0x0B72595Fu, 0xB28982B7u, 0xA3F4E8CEu, 0x1A0F3326u,
+        0x0AE56FF4u, 0xB31EB41Cu, 0xA263DE65u, 0x1B98058Du, 0x80990A97u, 0x3962D17Fu,
+        0x281FBB06u, 0x91E460EEu, 0xC56CA373u, 0x7C97789Bu, 0x6DEA12E2u, 0xD411C90Au,
+        0x4F10C610u, 0xF6EB1DF8u, 0xE7967781u, 0x5E6DAC69u, 0xC642CE25u, 0x7FB915CDu,
+        0x6EC47FB4u, 0xD73FA45Cu, 0x4C3EAB46u, 0xF5C570AEu, 0xE4B81AD7u, 0x5D43C13Fu,
+        0x09CB02A2u, 0xB030D94Au, 0xA14DB333u, 0x18B668DBu, 0x83B767C1u, 0x3A4CBC29u,
+        0x2B31D650u, 0x92CA0DB8u, 0x8220516Au, 0x3BDB8A82u, 0x2AA6E0FBu, 0x935D3B13u,
+        0x085C3409u, 0xB1A7EFE1u, 0xA0DA8598u, 0x19215E70u, 0x4DA99DEDu, 0xF4524605u,
+        0xE52F2C7Cu, 0x5CD4F794u, 0xC7D5F88Eu, 0x7E2E2366u, 0x6F53491Fu, 0xD6A892F7u,
+        0x847C8BC6u, 0x3D87502Eu, 0x2CFA3A57u, 0x9501E1BFu, 0x0E00EEA5u, 0xB7FB354Du,
+        0xA6865F34u, 0x1F7D84DCu, 0x4BF54741u, 0xF20E9CA9u, 0xE373F6D0u, 0x5A882D38u,
+        0xC1892222u, 0x7872F9CAu, 0x690F93B3u, 0xD0F4485Bu, 0xC01E1489u, 0x79E5CF61u,
+        0x6898A518u, 0xD1637EF0u, 0x4A6271EAu, 0xF399AA02u, 0xE2E4C07Bu, 0x5B1F1B93u,
+        0x0F97D80Eu, 0xB66C03E6u, 0xA711699Fu, 0x1EEAB277u, 0x85EBBD6Du, 0x3C106685u,
+        0x2D6D0CFCu, 0x9496D714u, 0x0CB9B558u, 0xB5426EB0u, 0xA43F04C9u, 0x1DC4DF21u,
+        0x86C5D03Bu, 0x3F3E0BD3u, 0x2E4361AAu, 0x97B8BA42u, 0xC33079DFu, 0x7ACBA237u,
+        0x6BB6C84Eu, 0xD24D13A6u, 0x494C1CBCu, 0xF0B7C754u, 0xE1CAAD2Du, 0x583176C5u,
+        0x48DB2A17u, 0xF120F1FFu, 0xE05D9B86u, 0x59A6406Eu, 0xC2A74F74u, 0x7B5C949Cu,
+        0x6A21FEE5u, 0xD3DA250Du, 0x8752E690u, 0x3EA93D78u, 0x2FD45701u, 0x962F8CE9u,
+        0x0D2E83F3u, 0xB4D5581Bu, 0xA5A83262u, 0x1C53E98Au,
+    },
+    {
+        0x00000000u, 0xAE689191u, 0x87A02563u, 0x29C8B4F2u, 0xD4314C87u, 0x7A59DD16u,
+        0x539169E4u, 0xFDF9F875u, 0x73139F4Fu, 0xDD7B0EDEu, 0xF4B3BA2Cu, 0x5ADB2BBDu,
+        0xA722D3C8u, 0x094A4259u, 0x2082F6ABu, 0x8EEA673Au, 0xE6273E9Eu, 0x484FAF0Fu,
+        0x61871BFDu, 0xCFEF8A6Cu, 0x32167219u, 0x9C7EE388u, 0xB5B6577Au, 0x1BDEC6EBu,
+        0x9534A1D1u, 0x3B5C3040u, 0x129484B2u, 0xBCFC1523u, 0x4105ED56u, 0xEF6D7CC7u,
+        0xC6A5C835u, 0x68CD59A4u, 0x173F7B7Du, 0xB957EAECu, 0x909F5E1Eu, 0x3EF7CF8Fu,
+        0xC30E37FAu, 0x6D66A66Bu, 0x44AE1299u, 0xEAC68308u, 0x642CE432u, 0xCA4475A3u,
+        0xE38CC151u, 0x4DE450C0u, 0xB01DA8B5u, 0x1E753924u, 0x37BD8DD6u, 0x99D51C47u,
+        0xF11845E3u, 0x5F70D472u, 0x76B86080u, 0xD8D0F111u, 0x25290964u, 0x8B4198F5u,
+        0xA2892C07u, 0x0CE1BD96u, 0x820BDAACu, 0x2C634B3Du, 0x05ABFFCFu, 0xABC36E5Eu,
+        0x563A962Bu, 0xF85207BAu, 0xD19AB348u, 0x7FF222D9u, 0x2E7EF6FAu, 0x8016676Bu,
+        0xA9DED399u, 0x07B64208u, 0xFA4FBA7Du, 0x54272BECu, 0x7DEF9F1Eu, 0xD3870E8Fu,
+        0x5D6D69B5u, 0xF305F824u, 0xDACD4CD6u, 0x74A5DD47u, 0x895C2532u, 0x2734B4A3u,
+        0x0EFC0051u, 0xA09491C0u, 0xC859C864u, 0x663159F5u, 0x4FF9ED07u, 0xE1917C96u,
+        0x1C6884E3u, 0xB2001572u, 0x9BC8A180u, 0x35A03011u, 0xBB4A572Bu, 0x1522C6BAu,
+        0x3CEA7248u, 0x9282E3D9u, 0x6F7B1BACu, 0xC1138A3Du, 0xE8DB3ECFu, 0x46B3AF5Eu,
+        0x39418D87u, 0x97291C16u, 0xBEE1A8E4u, 0x10893975u, 0xED70C100u, 0x43185091u,
+        0x6AD0E463u, 0xC4B875F2u, 0x4A5212C8u, 0xE43A8359u, 0xCDF237ABu, 0x639AA63Au,
+        0x9E635E4Fu, 0x300BCFDEu, 0x19C37B2Cu, 0xB7ABEABDu, 0xDF66B319u, 0x710E2288u,
+        0x58C6967Au, 0xF6AE07EBu, 0x0B57FF9Eu, 0xA53F6E0Fu, 0x8CF7DAFDu, 0x229F4B6Cu,
+        0xAC752C56u, 0x021DBDC7u, 0x2BD50935u, 0x85BD98A4u, 0x784460D1u, 0xD62CF140u,
+        0xFFE445B2u, 0x518CD423u, 0x5CFDEDF4u, 0xF2957C65u, 0xDB5DC897u, 0x75355906u,
+        0x88CCA173u, 0x26A430E2u, 0x0F6C8410u, 0xA1041581u, 0x2FEE72BBu, 0x8186E32Au,
+        0xA84E57D8u, 0x0626C649u, 0xFBDF3E3Cu, 0x55B7AFADu, 0x7C7F1B5Fu, 0xD2178ACEu,
+        0xBADAD36Au, 0x14B242FBu, 0x3D7AF609u, 0x93126798u, 0x6EEB9FEDu, 0xC0830E7Cu,
+        0xE94BBA8Eu, 0x47232B1Fu, 0xC9C94C25u, 0x67A1DDB4u, 0x4E696946u, 0xE001F8D7u,
+        0x1DF800A2u, 0xB3909133u, 0x9A5825C1u, 0x3430B450u, 0x4BC29689u, 0xE5AA0718u,
+        0xCC62B3EAu, 0x620A227Bu, 0x9FF3DA0Eu, 0x319B4B9Fu, 0x1853FF6Du, 0xB63B6EFCu,
+        0x38D109C6u, 0x96B99857u, 0xBF712CA5u, 0x1119BD34u, 0xECE04541u, 0x4288D4D0u,
+        0x6B406022u, 0xC528F1B3u, 0xADE5A817u, 0x038D3986u, 0x2A458D74u, 0x842D1CE5u,
+        0x79D4E490u, 0xD7BC7501u, 0xFE74C1F3u, 0x501C5062u, 0xDEF63758u, 0x709EA6C9u,
+        0x5956123Bu, 0xF73E83AAu, 0x0AC77BDFu, 0xA4AFEA4Eu, 0x8D675EBCu, 0x230FCF2Du,
+        0x72831B0Eu, 0xDCEB8A9Fu, 0xF5233E6Du, 0x5B4BAFFCu, 0xA6B25789u, 0x08DAC618u,
+        0x211272EAu, 0x8F7AE37Bu, 0x01908441u, 0xAFF815D0u, 0x8630A122u, 0x285830B3u,
+        0xD5A1C8C6u, 0x7BC95957u, 0x5201EDA5u, 0xFC697C34u, 0x94A42590u, 0x3ACCB401u,
+        0x130400F3u, 0xBD6C9162u, 0x40956917u, 0xEEFDF886u, 0xC7354C74u, 0x695DDDE5u,
+        0xE7B7BADFu, 0x49DF2B4Eu, 0x60179FBCu, 0xCE7F0E2Du, 0x3386F658u, 0x9DEE67C9u,
+        0xB426D33Bu, 0x1A4E42AAu, 0x65BC6073u, 0xCBD4F1E2u, 0xE21C4510u, 0x4C74D481u,
+        0xB18D2CF4u, 0x1FE5BD65u, 0x362D0997u, 0x98459806u, 0x16AFFF3Cu, 0xB8C76EADu,
+        0x910FDA5Fu, 0x3F674BCEu, 0xC29EB3BBu, 0x6CF6222Au, 0x453E96D8u, 0xEB560749u,
+        0x839B5EEDu, 0x2DF3CF7Cu, 0x043B7B8Eu, 0xAA53EA1Fu, 0x57AA126Au, 0xF9C283FBu,
+        0xD00A3709u, 0x7E62A698u, 0xF088C1A2u, 0x5EE05033u, 0x7728E4C1u, 0xD9407550u,
+        0x24B98D25u, 0x8AD11CB4u, 0xA319A846u, 0x0D7139D7u,
+    },
+};
+
+// x^(2^k) mod P, bit-reflected
+static const uint32_t VSFS_CRC32_X2N[32] = {
+    0x40000000u, 0x20000000u, 0x08000000u, 0x00800000u, 0x00008000u, 0xEDB88320u,
+    0xB1E6B092u, 0xA06A2517u, 0xED627DAEu, 0x88D14467u, 0xD7BBFE6Au, 0xEC447F11u,
+    0x8E7EA170u, 0x6427800Eu, 0x4D47BAE0u, 0x09FE548Fu, 0x83852D0Fu, 0x30362F1Au,
+    0x7B5A9CC3u, 0x31FEC169u, 0x9FEC022Au, 0x6C8DEDC4u, 0x15D6874Du, 0x5FDE7A4Eu,
+    0xBAD90E37u, 0x2E4E5EEFu, 0x4EABA214u, 0xA8A472C0u, 0x429A969Eu, 0x148D302Au,
+    0xC40BA6D0u, 0xC4E22C3Cu,
+};
+
+#endif // VSFS_CRC32_TABLE_H
@@ -0,0 +1,242 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra vsfs_extract.c -L. -lminivsfs -pthread -o vsfs_extract
+//
+// Copy every file of an image (or the ones named with --file) into a host
+// directory. Files are extracted in parallel by a pool of worker threads;
+// each one is copied from the image file in the kernel, one request per
+// contiguous run of blocks (see vsfs_extract()).
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "vsfs.h"
+
+#define EXTRACT_WORKERS_MAX 16
+
+typedef struct {
+    vsfs_dirent_t *entries;
+    size_t count;
+    size_t cap;
+} entry_list_t;
+
+typedef struct {
+    vsfs_t *fs;
+    int dir_fd;
+    const entry_list_t *list;
+    atomic_size_t next;
+    atomic_size_t extracted;
+    atomic_int failed;
+} extractor_t;
+
+int collect_entry(const vsfs_dirent_t *de, void *arg) {
+    entry_list_t *list = arg;
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        vsfs_dirent_t *entries = realloc(list->entries, cap * sizeof(*entries));
+        if (!entries) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        list->entries = entries;
+        list->cap = cap;
+    }
+    list->entries[list->count++] = *de;
+    return 0;
+}
+
+// Where name goes below the output directory: leading slashes are dropped,
+// and names with an empty result or a ".." component are refused so
+// nothing is written outside the directory.
+const char *output_path(const char *name) {
+    while (*name == '/') {
+        name++;
+    }
+    if (*name == '\0') {
+        return NULL;
+    }
+    for (const char *p = name; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return NULL;
+        }
+        p += len;
+        while (*p == '/') p++;
+    }
+    return name;
+}
+
+// Create the parent directories of path below dir_fd.
+int make_parents(int dir_fd, const char *path) {
+    char buf[VSFS_NAME_MAX + 1];
+    strcpy(buf, path);
+    for (char *slash = strchr(buf, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdirat(dir_fd, buf, 0755) != 0 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+int extract_one(extractor_t *x, const vsfs_dirent_t *de) {
+    const char *path = output_path(de->name);
+    if (!path) {
+        fprintf(stderr, "Error: Refusing to extract '%s' outside the output directory\n", de->name);
+        return -1;
+    }
+    if (make_parents(x->dir_fd, path) != 0) {
+        fprintf(stderr, "Error: Cannot create directory for '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    int fd = openat(x->dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    int rc = vsfs_extract(x->fs, de->name, fd);
+    if (rc != 0) {
+        fprintf(stderr, "Error: %s\n", vsfs_last_error());
+    } else {
+        struct timespec times[2] = { { (time_t)de->st.mtime, 0 }, { (time_t)de->st.mtime, 0 } };
+        futimens(fd, times);
+    }
+    if (close(fd) != 0 && rc == 0) {
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", path, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+void *extract_worker(void *arg) {
+    extractor_t *x = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&x->next, 1);
+        if (i >= x->list->count) {
+            return NULL;
+        }
+        if (extract_one(x, &x->list->entries[i]) == 0) {
+            atomic_fetch_add(&x->extracted, 1);
+        } else {
+            atomic_store(&x->failed, 1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *input_file = NULL;
+    char *output_dir = NULL;
+    long jobs = 0;
+    int io = VSFS_IO_PREAD;
+    char **names = calloc((size_t)argc, sizeof(char *));
+    size_t name_count = 0;
+    if (!names) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input_file = argv[++i];
+        } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            names[name_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            io = vsfs_io_from_name(argv[++i]);
+        } else {
+            input_file = NULL;
+            break;
+        }
+    }
+    if (!input_file || !output_dir || jobs < 0 || io < 0) {
+        fprintf(stderr, "Usage: %s --input <image.img> --output-dir <dir> [--jobs <n>] [--file <name>]... "
+                        "[--io pread|stdio|mmap|uring]\n", argv[0]);
+        return 1;
+    }
+
+    vsfs_open_opts_t opts = { VSFS_RDONLY, 0, io };
+    vsfs_t *fs = vsfs_open_with(input_file, &opts);
+    if (!fs) {
+        fprintf(stderr, "Error: %s\n", vsfs_last_error());
+        return 1;
+    }
+
+    entry_list_t list = {0};
+    if (name_count == 0) {
+        int rc = vsfs_readdir(fs, collect_entry, &list);
+        if (rc != 0) {
+            if (rc < 0) {
+                fprintf(stderr, "Error: %s\n", vsfs_last_error());
+            }
+            vsfs_close(fs);
+            return 1;
+        }
+    }
+    for (size_t k = 0; k < name_count; k++) {
+        vsfs_dirent_t de = {0};
+        strncpy(de.name, names[k], VSFS_NAME_MAX);
+        int found = vsfs_stat(fs, de.name, &de.st);
+        if (found <= 0) {
+            if (found == 0) {
+                fprintf(stderr, "Error: File '%s' not found in the file system\n", names[k]);
+            } else {
+                fprintf(stderr, "Error: %s\n", vsfs_last_error());
+            }
+            vsfs_close(fs);
+            return 1;
+        }
+        if (collect_entry(&de, &list) != 0) {
+            vsfs_close(fs);
+            return 1;
+        }
+    }
+
+    if (mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create output directory '%s': %s\n", output_dir, strerror(errno));
+        vsfs_close(fs);
+        return 1;
+    }
+    int dir_fd = open(output_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        fprintf(stderr, "Error: Cannot open output directory '%s': %s\n", output_dir, strerror(errno));
+        vsfs_close(fs);
+        return 1;
+    }
+
+    if (jobs == 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    size_t nworkers = jobs > 0 ? (size_t)jobs : 1;
+    if (nworkers > EXTRACT_WORKERS_MAX) nworkers = EXTRACT_WORKERS_MAX;
+    if (nworkers > list.count) nworkers = list.count ? list.count : 1;
+
+    extractor_t x = { .fs = fs, .dir_fd = dir_fd, .list = &list };
+    atomic_init(&x.next, 0);
+    atomic_init(&x.extracted, 0);
+    atomic_init(&x.failed, 0);
+    pthread_t threads[EXTRACT_WORKERS_MAX];
+    size_t started = 0;
+    while (started + 1 < nworkers && pthread_create(&threads[started], NULL, extract_worker, &x) == 0) {
+        started++;
+    }
+    extract_worker(&x);   // this thread works too
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    close(dir_fd);
+    vsfs_close(fs);
+    free(list.entries);
+    free(names);
+    printf("Extracted %zu of %zu files to '%s'\n", atomic_load(&x.extracted), list.count, output_dir);
+    return atomic_load(&x.failed) ? 1 : 0;
+}
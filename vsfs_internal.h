@@ -0,0 +1,266 @@
+// On-disk format of MiniVSFS and the helpers libminivsfs shares between
+// its translation units. Not part of the public API (see vsfs.h).
+#ifndef VSFS_INTERNAL_H
+#define VSFS_INTERNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "vsfs_crc32.h"
+#include "vsfs_bitmap.h"
+
+#define VSFS_MAGIC 0x4D565346u
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define PTRS_PER_BLOCK (BS / 4u)   // block numbers per indirect block
+// direct + single indirect (reserved_0) + double indirect (reserved_1)
+#define FILE_MAX_BLOCKS ((uint64_t)DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define DIRENTS_PER_BLOCK (BS / 64u)
+#define DIR_MAX_ENTRIES (DIRECT_MAX * DIRENTS_PER_BLOCK)
+
+// superblock_t.flags
+#define SB_FLAG_DIR_INDEX 0x1u     // root inode reserved_2 points at a dir_index_t block
+#define SB_FLAG_EXTENTS   0x2u     // regular files may be mapped by extents (see extent_block_t)
+#define SB_FLAG_GROUPS    0x4u     // block groups, group descriptor table from block 1
+#define SB_FLAG_LAZY_ITABLE 0x8u   // inode table initialized only up to superblock_ext_t.itable_initialized
+
+#define BITS_PER_BLOCK (BS * 8u)
+#define BLOCKS_PER_GROUP BITS_PER_BLOCK   // one data bitmap block per group, as in ext2
+#define INODES_PER_GROUP_ALIGN 64u         // group inode bitmap slices are whole 64-bit words
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;                 
+    uint32_t version;              
+    uint32_t block_size;           
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;   
+    uint64_t inode_bitmap_blocks; 
+    uint64_t data_bitmap_start;      
+    uint64_t data_bitmap_blocks;   
+    uint64_t inode_table_start;    
+    uint64_t inode_table_blocks;   
+    uint64_t data_region_start;   
+    uint64_t data_region_blocks;   
+    uint64_t root_inode;           
+    uint64_t mtime_epoch;          
+    uint32_t flags;               
+    uint32_t checksum;            
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;                
+    uint16_t links;                
+    uint32_t uid;                  
+    uint32_t gid;                
+    uint64_t size_bytes;           
+    uint64_t atime;                
+    uint64_t mtime;                
+    uint64_t ctime;                
+    uint32_t direct[DIRECT_MAX];   
+    uint32_t reserved_0;          
+    uint32_t reserved_1;          
+    uint32_t reserved_2;         
+    uint32_t proj_id;           
+    uint32_t uid16_gid16;          
+    uint64_t xattr_ptr;            
+    uint64_t inode_crc;            
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;             
+    uint8_t type;                  
+    char name[58];                
+    uint8_t checksum;              
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+// Hashed index over the root directory, in the spirit of ext3's htree.
+// It lives in its own data block, referenced only from the root inode's
+// reserved_2 field, so the dirent blocks stay plain and older tools keep
+// reading them unchanged. Open addressing, linear probing: each slot holds
+// 16 bits of the name hash and the dirent location (block * 64 + entry) + 1.
+// The index is trusted only if its CRC matches, it was written against the
+// current root mtime, and the slot it believes is next free really is free;
+// otherwise it is rebuilt from the dirent blocks.
+#define DIR_INDEX_MAGIC 0x58445356u   // "VSDX"
+#define DIR_INDEX_SLOTS 1016u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t count;                    // live entries in the directory
+    uint32_t next_free;                // lowest dirent location that may be free
+    uint32_t reserved;
+    uint64_t dir_mtime;                // root inode mtime the index matches
+    uint32_t reserved2;
+    uint32_t checksum;                 // crc32 of the block with this field zeroed
+    uint16_t tag[DIR_INDEX_SLOTS];     // hash bits, never 0 for a used slot
+    uint16_t loc[DIR_INDEX_SLOTS];     // dirent location + 1, 0 = empty slot
+} dir_index_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dir_index_t) == BS, "dir index must fill one block");
+_Static_assert(DIR_MAX_ENTRIES < DIR_INDEX_SLOTS, "dir index too small");
+
+// Extent-mapped regular files (SB_FLAG_EXTENTS). direct[] is unused and the
+// inode's spare fields hold the map instead:
+//   xattr_ptr   bit 63 (EXTENT_XATTR_FLAG) set; a block map never sets
+//               xattr_ptr, and reserved_0 alone cannot tell the two maps
+//               apart, since it is the single indirect block of a
+//               block-mapped file
+//   reserved_0  EXTENT_MAGIC | depth << 16 | count << 24, where the 8-bit
+//               count field is only used at depth 0
+//   depth 0:    up to two inline extents, logically back to back:
+//               reserved_1/reserved_2 = start/length of the first,
+//               xattr_ptr bits 0-31/32-62 = start/length of the second
+//               (a file is far shorter than 2^31 blocks)
+//   depth 1:    count field 0 (up to EXTENT_TREE_MAX extents do not fit
+//               in it), reserved_1 = extent_block_t holding all extents,
+//               reserved_2 = number of extents in it, matching the
+//               block's own count, which is authoritative
+// A contiguous file therefore maps with a single entry. Files too
+// fragmented for one extent block fall back to the block map.
+#define EXTENT_MAGIC 0xE57Au
+#define EXTENT_XATTR_FLAG (1ull << 63)
+#define EXTENT_INLINE_MAX 2u
+#define EXTENT_TREE_MAX 340u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t logical;   // first file block covered
+    uint32_t start;     // first physical block
+    uint32_t len;       // blocks in the run
+} extent_t;
+
+typedef struct {
+    uint32_t magic;     // EXTENT_MAGIC
+    uint32_t count;
+    extent_t ext[EXTENT_TREE_MAX];   // sorted by logical
+    uint8_t pad[8];
+} extent_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_block_t) == BS, "extent block must fill one block");
+
+// Extra superblock fields in block 0 after superblock_t, covered by the
+// superblock CRC.
+#define SB_EXT_OFFSET 128u
+
+#pragma pack(push,1)
+typedef struct {
+    uint64_t itable_initialized;   // SB_FLAG_LAZY_ITABLE high-water mark, in inode table blocks
+} superblock_ext_t;
+#pragma pack(pop)
+
+// Block groups (SB_FLAG_GROUPS), laid out by vsfs_format(). Group g owns data blocks
+// [g * BLOCKS_PER_GROUP, ...) of the data region and a run of inodes; both
+// bitmap slices are whole 64-bit words, so groups can be allocated from in
+// parallel without sharing a byte.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t first_data_block;    // absolute block number
+    uint32_t data_blocks;
+    uint32_t first_inode;         // 1-based inode number
+    uint32_t inode_count;
+    uint32_t inode_table_block;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t checksum;            // crc32 of bytes [0..27]
+} group_desc_t;
+#pragma pack(pop)
+_Static_assert(sizeof(group_desc_t) == 32, "group descriptor size mismatch");
+
+// Number of groups for a data region: one per BLOCKS_PER_GROUP data blocks,
+// the tail folded into the last group. vsfs_format() lays groups out by
+// this rule and everything that reads them checks it.
+static inline uint64_t group_count_for(uint64_t data_region_blocks) {
+    uint64_t count = data_region_blocks / BLOCKS_PER_GROUP;
+    return count == 0 ? 1 : count;
+}
+
+// ==========================DO NOT CHANGE THIS PORTION=========================
+// These functions are there for your help. You should refer to the specifications to see how you can use them.
+// ====================================CRC32====================================
+// Table-driven loop replaced by vsfs_crc32.h (slicing-by-16 / PCLMULQDQ,
+// bit-identical output). crc32_init() now only selects the fastest kernel.
+static inline void crc32_init(void){
+    vsfs_crc32_init();
+}
+static inline uint32_t crc32(const void* data, size_t n){
+    return vsfs_crc32(0, data, n);
+}
+// ====================================CRC32====================================
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+// sb must point at a whole BS-byte block 0 buffer: the crc covers the
+// superblock_ext_t fields after the struct as well.
+static inline uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+static inline void inode_crc_finalize(inode_t* ino){
+    // bytes [0..119] are everything before inode_crc, so no zeroed copy is needed
+    uint32_t c = crc32(ino, offsetof(inode_t, inode_crc));
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+static inline void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i]; // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+
+// Whether a regular file's map is an extent map rather than a block map.
+static inline int inode_is_extent_mapped(const superblock_t *sb, const inode_t *inode) {
+    return (sb->flags & SB_FLAG_EXTENTS) && (inode->xattr_ptr & EXTENT_XATTR_FLAG);
+}
+
+// Start and length of the second inline extent of a depth 0 extent map.
+static inline uint32_t extent_inline2_start(const inode_t *inode) {
+    return (uint32_t)inode->xattr_ptr;
+}
+static inline uint32_t extent_inline2_len(const inode_t *inode) {
+    return (uint32_t)((inode->xattr_ptr & ~EXTENT_XATTR_FLAG) >> 32);
+}
+
+static inline void group_desc_finalize(group_desc_t *gd) {
+    gd->checksum = crc32(gd, offsetof(group_desc_t, checksum));
+}
+
+// Store n bytes at offset off of block 0 (sb_block, BS bytes) and patch the
+// superblock crc for just those bytes instead of rehashing the block. The
+// crc must have been valid before, and the bytes must not overlap
+// superblock_t.checksum itself.
+static inline void superblock_update(uint8_t *sb_block, size_t off, const void *val, size_t n) {
+    superblock_t *sb = (superblock_t *)sb_block;
+    sb->checksum = vsfs_crc32_patch(sb->checksum, BS - 4, off, sb_block + off, val, n);
+    memcpy(sb_block + off, val, n);
+}
+
+// Finalize, in one pass over an inode table block, the crcs of the inodes
+// whose slot bit is set in dirty.
+_Static_assert(BS / INODE_SIZE <= 32, "inode table block slots must fit a 32-bit mask");
+static inline void inode_block_crc_finalize(uint8_t *block, uint32_t dirty) {
+    for (; dirty != 0; dirty &= dirty - 1) {
+        inode_crc_finalize((inode_t *)(block + (size_t)__builtin_ctz(dirty) * INODE_SIZE));
+    }
+}
+
+// Record the message vsfs_last_error() returns (printf-style, no "Error:"
+// prefix and no newline).
+void vsfs_set_error(const char *fmt, ...) __attribute__((format(printf, 1, 2), visibility("hidden")));
+
+#endif // VSFS_INTERNAL_H
@@ -0,0 +1,632 @@
+// Image I/O backends, see vsfs_io.h.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "vsfs.h"
+#include "vsfs_internal.h"
+#include "vsfs_io.h"
+
+#define COPY_CHUNK (256u * BS)     // largest bounce-buffer copy, 1 MiB
+#define URING_DEPTH 32u            // copy_in() pieces in flight
+#define URING_CHUNK (32u * BS)     // bytes per piece, 128 KiB
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int pwritev_full(int fd, const struct iovec *iov_in, int iovcnt, uint64_t off) {
+    struct iovec local[16];
+    struct iovec *iov = iovcnt <= 16 ? local : malloc((size_t)iovcnt * sizeof(*iov));
+    if (!iov) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(iov, iov_in, (size_t)iovcnt * sizeof(*iov));
+    struct iovec *cur = iov;
+    int rc = 0;
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, cur, iovcnt, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            rc = -1;
+            break;
+        }
+        off += (uint64_t)n;
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+            n -= (ssize_t)cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (uint8_t *)cur->iov_base + n;
+            cur->iov_len -= (size_t)n;
+        }
+    }
+    if (iov != local) {
+        free(iov);
+    }
+    return rc;
+}
+
+// Read exactly len bytes from the current position of fd (a file, pipe or
+// FIFO).
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Bytes to request for len bytes of source data. With direct I/O the
+// source may be open with O_DIRECT, so whole blocks are read and the last
+// one comes back short at end of file.
+static size_t read_len(const vsfs_io_t *io, size_t len) {
+    return io->data_fd >= 0 ? (len + BS - 1) / BS * BS : len;
+}
+
+// Read up to want bytes, stopping early only at end of file, and fail if
+// fewer than len arrived.
+static int read_upto(int fd, void *buf, size_t want, size_t len) {
+    uint8_t *p = buf;
+    size_t got = 0;
+    while (got < want) {
+        ssize_t n = read(fd, p + got, want - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    if (got < len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Write file data: through the O_DIRECT descriptor in direct mode, else
+// through the backend.
+static int write_data(vsfs_io_t *io, const void *buf, size_t len, uint64_t off) {
+    if (io->data_fd >= 0) {
+        struct iovec iov = { (void *)buf, len };
+        return pwritev_full(io->data_fd, &iov, 1, off);
+    }
+    return io_write(io, buf, len, off);
+}
+
+// copy_in() through a bounce buffer: read a chunk of the source, pad it and
+// write it out. The buffer is block-aligned, as O_DIRECT requires.
+static int copy_in_bounce(vsfs_io_t *io, int src_fd, const io_copy_t *copies, size_t n) {
+    size_t buf_len = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (copies[i].span > buf_len) buf_len = copies[i].span;
+    }
+    if (buf_len > COPY_CHUNK) buf_len = COPY_CHUNK;
+    uint8_t *buf = NULL;
+    if (buf_len > 0 && posix_memalign((void **)&buf, BS, buf_len) != 0) {
+        errno = ENOMEM;
+        return IO_COPY_DST_ERROR;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        const io_copy_t *c = &copies[i];
+        for (size_t pos = 0; pos < c->span && rc == 0; pos += buf_len) {
+            size_t span = c->span - pos < buf_len ? c->span - pos : buf_len;
+            size_t len = c->len > pos ? (c->len - pos < span ? c->len - pos : span) : 0;
+            if (read_upto(src_fd, buf, read_len(io, len), len) != 0) {
+                rc = IO_COPY_SRC_ERROR;
+                break;
+            }
+            memset(buf + len, 0, span - len);
+            if (write_data(io, buf, span, c->dst_off + pos) != 0) {
+                rc = IO_COPY_DST_ERROR;
+            }
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+// pread/pwritev
+
+static int pread_open(vsfs_io_t *io) {
+    (void)io;
+    return 0;
+}
+
+static void pread_close(vsfs_io_t *io) {
+    (void)io;
+}
+
+static int pread_read(vsfs_io_t *io, void *buf, size_t len, uint64_t off) {
+    return pread_full(io->fd, buf, len, off);
+}
+
+static int pread_writev(vsfs_io_t *io, const struct iovec *iov, int iovcnt, uint64_t off) {
+    return pwritev_full(io->fd, iov, iovcnt, off);
+}
+
+static int pread_sync(vsfs_io_t *io) {
+    return fdatasync(io->fd);
+}
+
+static const vsfs_io_ops_t pread_ops = {
+    "pread", pread_open, pread_close, pread_read, pread_writev, pread_sync, copy_in_bounce,
+};
+
+// stdio. Every write is flushed before returning, so the descriptor (used
+// for copy_file_range and fallocate) never sees stale data. The stream lock
+// keeps each seek and transfer together for concurrent readers.
+
+static int stdio_open(vsfs_io_t *io) {
+    int fd = dup(io->fd);
+    if (fd < 0) {
+        return -1;
+    }
+    FILE *f = fdopen(fd, io->writable ? "r+b" : "rb");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+    io->priv = f;
+    return 0;
+}
+
+static void stdio_close(vsfs_io_t *io) {
+    if (io->priv) {
+        fclose(io->priv);
+    }
+}
+
+static int stdio_read(vsfs_io_t *io, void *buf, size_t len, uint64_t off) {
+    FILE *f = io->priv;
+    int rc = 0;
+    flockfile(f);
+    if (fseeko(f, (off_t)off, SEEK_SET) != 0) {
+        rc = -1;
+    } else if (fread(buf, 1, len, f) != len) {
+        if (!ferror(f)) errno = EIO;
+        clearerr(f);
+        rc = -1;
+    }
+    funlockfile(f);
+    return rc;
+}
+
+static int stdio_writev(vsfs_io_t *io, const struct iovec *iov, int iovcnt, uint64_t off) {
+    FILE *f = io->priv;
+    int rc = 0;
+    flockfile(f);
+    if (fseeko(f, (off_t)off, SEEK_SET) != 0) {
+        rc = -1;
+    }
+    for (int i = 0; i < iovcnt && rc == 0; i++) {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, f) != iov[i].iov_len) {
+            clearerr(f);
+            rc = -1;
+        }
+    }
+    if (fflush(f) != 0) {
+        rc = -1;
+    }
+    funlockfile(f);
+    return rc;
+}
+
+static int stdio_sync(vsfs_io_t *io) {
+    if (fflush(io->priv) != 0) {
+        return -1;
+    }
+    return fdatasync(io->fd);
+}
+
+static const vsfs_io_ops_t stdio_ops = {
+    "stdio", stdio_open, stdio_close, stdio_read, stdio_writev, stdio_sync, copy_in_bounce,
+};
+
+// mmap. Reads and writes are copies to and from the mapping; copy_in()
+// reads the source straight into it.
+
+static int mmap_open(vsfs_io_t *io) {
+    int prot = PROT_READ | (io->writable ? PROT_WRITE : 0);
+    void *base = mmap(NULL, (size_t)io->size, prot, MAP_SHARED, io->fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    io->priv = base;
+    return 0;
+}
+
+static void mmap_close(vsfs_io_t *io) {
+    if (io->priv) {
+        munmap(io->priv, (size_t)io->size);
+    }
+}
+
+static int mmap_read(vsfs_io_t *io, void *buf, size_t len, uint64_t off) {
+    if (off > io->size || len > io->size - off) {
+        errno = EIO;
+        return -1;
+    }
+    memcpy(buf, (const uint8_t *)io->priv + off, len);
+    return 0;
+}
+
+static int mmap_writev(vsfs_io_t *io, const struct iovec *iov, int iovcnt, uint64_t off) {
+    if (!io->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (off > io->size || iov[i].iov_len > io->size - off) {
+            errno = ENOSPC;
+            return -1;
+        }
+        memcpy((uint8_t *)io->priv + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int mmap_sync(vsfs_io_t *io) {
+    return msync(io->priv, (size_t)io->size, MS_SYNC);
+}
+
+static int mmap_copy_in(vsfs_io_t *io, int src_fd, const io_copy_t *copies, size_t n) {
+    if (!io->writable) {
+        errno = EBADF;
+        return IO_COPY_DST_ERROR;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const io_copy_t *c = &copies[i];
+        if (c->dst_off > io->size || c->span > io->size - c->dst_off) {
+            errno = ENOSPC;
+            return IO_COPY_DST_ERROR;
+        }
+        uint8_t *dst = (uint8_t *)io->priv + c->dst_off;
+        if (read_full(src_fd, dst, c->len) != 0) {
+            return IO_COPY_SRC_ERROR;
+        }
+        memset(dst + c->len, 0, c->span - c->len);
+    }
+    return 0;
+}
+
+static const vsfs_io_ops_t mmap_ops = {
+    "mmap", mmap_open, mmap_close, mmap_read, mmap_writev, mmap_sync, mmap_copy_in,
+};
+
+// io_uring, driven through the raw system calls. copy_in() splits the
+// copies into URING_CHUNK pieces and keeps up to URING_DEPTH of them in
+// flight: a piece's read from the source is queued as soon as a buffer is
+// free, and its write to the image as soon as the read completes, so a
+// large ingest keeps both files busy instead of waiting on one request at a
+// time. Metadata I/O is small and ordered, and uses the pread path.
+
+typedef struct {
+    int ring_fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    uint8_t *bufs;                 // URING_DEPTH * URING_CHUNK
+    int broken;                    // io_uring_enter() kept failing; copies take the bounce path
+} uring_t;
+
+// A piece of a copy and the state of its buffer slot.
+typedef struct {
+    uint64_t src_off;
+    uint64_t dst_off;
+    size_t len;
+    size_t span;
+    size_t want;                   // bytes to read, see read_len()
+    size_t done;                   // bytes of the current read or write completed
+    int writing;
+} uring_slot_t;
+
+static void uring_free(uring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+    if (r->ring_fd >= 0) close(r->ring_fd);
+    free(r->bufs);
+    free(r);
+}
+
+// Set up the ring and check that the kernel supports IORING_OP_READ and
+// IORING_OP_WRITE (Linux 5.6).
+static int uring_open(vsfs_io_t *io) {
+    uring_t *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return -1;
+    }
+    r->ring_fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->ring_fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if (r->ring_fd < 0) {
+        goto fail;
+    }
+
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (!probe) {
+        goto fail;
+    }
+    int supported = syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->last_op >= IORING_OP_WRITE &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+    uint8_t *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    if (posix_memalign((void **)&r->bufs, BS, (size_t)URING_DEPTH * URING_CHUNK) != 0) {
+        r->bufs = NULL;
+        goto fail;
+    }
+    io->priv = r;
+    return 0;
+
+fail:
+    uring_free(r);
+    return -1;
+}
+
+static void uring_close(vsfs_io_t *io) {
+    if (io->priv) {
+        uring_free(io->priv);
+    }
+}
+
+// Queue a read or write of slot s. Never overflows: at most URING_DEPTH
+// operations are in flight and the ring has that many entries.
+static void uring_queue(uring_t *r, int fd, int op, void *buf, size_t len, uint64_t off, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_queue_slot(uring_t *r, int src_fd, int dst_fd, uring_slot_t *slots, unsigned i) {
+    uring_slot_t *s = &slots[i];
+    uint8_t *buf = r->bufs + (size_t)i * URING_CHUNK;
+    if (s->writing) {
+        uring_queue(r, dst_fd, IORING_OP_WRITE, buf + s->done, s->span - s->done, s->dst_off + s->done, i);
+    } else {
+        uring_queue(r, src_fd, IORING_OP_READ, buf + s->done, s->want - s->done, s->src_off + s->done, i);
+    }
+}
+
+static int uring_copy_in(vsfs_io_t *io, int src_fd, const io_copy_t *copies, size_t n) {
+    uring_t *r = io->priv;
+    struct stat st;
+    if (r->broken || fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return copy_in_bounce(io, src_fd, copies, n);   // pipes must be read in order
+    }
+    int dst_fd = io->data_fd >= 0 ? io->data_fd : io->fd;
+    uring_slot_t slots[URING_DEPTH];
+    unsigned free_slots[URING_DEPTH];
+    unsigned nfree = URING_DEPTH, inflight = 0, to_submit = 0;
+    for (unsigned i = 0; i < URING_DEPTH; i++) {
+        free_slots[i] = URING_DEPTH - 1 - i;
+    }
+    size_t ci = 0, pos = 0;          // next piece: copies[ci] from byte pos
+    int rc = 0, err = 0, enter_failed = 0;
+
+    for (;;) {
+        while (rc == 0 && nfree > 0 && ci < n) {
+            const io_copy_t *c = &copies[ci];
+            if (pos >= c->span) {
+                ci++;
+                pos = 0;
+                continue;
+            }
+            unsigned i = free_slots[--nfree];
+            uring_slot_t *s = &slots[i];
+            s->span = c->span - pos < URING_CHUNK ? c->span - pos : URING_CHUNK;
+            s->len = c->len > pos ? (c->len - pos < s->span ? c->len - pos : s->span) : 0;
+            s->src_off = c->src_off + pos;
+            s->dst_off = c->dst_off + pos;
+            s->want = read_len(io, s->len);
+            s->done = 0;
+            s->writing = s->len == 0;
+            if (s->writing) {
+                memset(r->bufs + (size_t)i * URING_CHUNK, 0, s->span);
+            }
+            uring_queue_slot(r, src_fd, dst_fd, slots, i);
+            inflight++;
+            to_submit++;
+            pos += s->span;
+        }
+        if (inflight == 0) {
+            break;
+        }
+
+        // Every request must complete before returning, failed or not:
+        // the next call reuses the slots and buffers (and a stale
+        // completion would be taken for one of its own), and the blocks a
+        // write targets may be handed out again once the batch fails.
+        if (r->broken) {
+            // completions still reach the queue without io_uring_enter()
+            struct timespec pause = { 0, 1000000 };
+            nanosleep(&pause, NULL);
+        } else {
+            long ret = syscall(__NR_io_uring_enter, r->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                if (rc == 0) {
+                    rc = IO_COPY_DST_ERROR;
+                    err = errno;
+                }
+                // take back what the kernel has not picked up, so no later
+                // call submits it, and wait only for what it has; a second
+                // failure in a row retires the ring
+                unsigned sq_head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+                inflight -= *r->sq_tail - sq_head;
+                __atomic_store_n(r->sq_tail, sq_head, __ATOMIC_RELEASE);
+                to_submit = 0;
+                r->broken = enter_failed;
+                enter_failed = 1;
+            } else {
+                enter_failed = 0;
+                to_submit -= (unsigned)ret < to_submit ? (unsigned)ret : to_submit;
+            }
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            unsigned i = (unsigned)cqe->user_data;
+            uring_slot_t *s = &slots[i];
+            int res = cqe->res;
+            if (rc != 0 || res <= 0) {
+                if (rc == 0) {
+                    rc = s->writing ? IO_COPY_DST_ERROR : IO_COPY_SRC_ERROR;
+                    err = res < 0 ? -res : EIO;   // a zero-length read: the file shrank
+                }
+                inflight--;
+                continue;
+            }
+            s->done += (size_t)res;
+            if (!s->writing && s->done >= s->len) {
+                memset(r->bufs + (size_t)i * URING_CHUNK + s->len, 0, s->span - s->len);
+                s->writing = 1;
+                s->done = 0;
+            } else if (s->writing && s->done == s->span) {
+                free_slots[nfree++] = i;
+                inflight--;
+                continue;
+            }
+            uring_queue_slot(r, src_fd, dst_fd, slots, i);   // the next step, or the rest after a short transfer
+            to_submit++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (rc != 0) {
+        errno = err;
+    }
+    return rc;
+}
+
+static const vsfs_io_ops_t uring_ops = {
+    "uring", uring_open, uring_close, pread_read, pread_writev, pread_sync, uring_copy_in,
+};
+
+int vsfs_io_open(vsfs_io_t *io, int kind, int fd, int data_fd, int writable, uint64_t size) {
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->data_fd = data_fd;
+    io->writable = writable;
+    io->size = size;
+    switch (kind) {
+    case VSFS_IO_STDIO: io->ops = &stdio_ops; break;
+    case VSFS_IO_MMAP:  io->ops = &mmap_ops;  break;
+    case VSFS_IO_URING: io->ops = &uring_ops; break;
+    default:            io->ops = &pread_ops; break;
+    }
+    if (io->ops->open(io) != 0) {
+        io->priv = NULL;
+        io->ops = &pread_ops;
+        return io->ops->open(io);
+    }
+    return 0;
+}
+
+void vsfs_io_close(vsfs_io_t *io) {
+    if (io->ops) {
+        io->ops->close(io);
+    }
+    if (io->data_fd >= 0) {
+        close(io->data_fd);
+        io->data_fd = -1;
+    }
+    io->ops = NULL;
+    io->priv = NULL;
+}
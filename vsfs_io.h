@@ -0,0 +1,89 @@
+// Image I/O backends for libminivsfs (internal, see vsfs_io.c).
+//
+// Every access to an open image goes through a vsfs_io_t: whole-buffer
+// reads, gathered writes, a durability barrier, and copy_in(), which moves
+// file data from a host file into the image. The backend is picked when the
+// image is opened (VSFS_IO_* in vsfs.h):
+//
+//   pread   pread/pwritev on the image descriptor (the default)
+//   stdio   a FILE * stream, flushed after every write
+//   mmap    a shared mapping of the whole image
+//   uring   io_uring through raw system calls; copy_in() keeps a queue of
+//           source reads and image writes in flight, everything else goes
+//           through the pread path
+#ifndef VSFS_IO_H
+#define VSFS_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// One piece of file data for copy_in(): len bytes of the source at src_off
+// go to the image at dst_off, padded with zeros to span bytes (whole blocks).
+typedef struct {
+    uint64_t src_off;
+    uint64_t dst_off;
+    size_t len;
+    size_t span;
+} io_copy_t;
+
+// copy_in() failures, so the caller can tell which side failed
+#define IO_COPY_SRC_ERROR (-1)
+#define IO_COPY_DST_ERROR (-2)
+
+typedef struct vsfs_io vsfs_io_t;
+
+typedef struct {
+    const char *name;
+    int (*open)(vsfs_io_t *io);
+    void (*close)(vsfs_io_t *io);
+    int (*read)(vsfs_io_t *io, void *buf, size_t len, uint64_t off);
+    int (*writev)(vsfs_io_t *io, const struct iovec *iov, int iovcnt, uint64_t off);
+    int (*sync)(vsfs_io_t *io);
+    // copies[] are in source order and the source is positioned at
+    // copies[0].src_off; it is read sequentially unless the backend knows
+    // it is a regular file and can read pieces in parallel
+    int (*copy_in)(vsfs_io_t *io, int src_fd, const io_copy_t *copies, size_t n);
+} vsfs_io_ops_t;
+
+struct vsfs_io {
+    const vsfs_io_ops_t *ops;
+    int fd;                        // image descriptor, owned by the caller
+    int data_fd;                   // O_DIRECT image descriptor copy_in() writes to, -1 if none (owned)
+    int writable;
+    uint64_t size;                 // image file size
+    void *priv;                    // backend state
+};
+
+// Set up backend kind (VSFS_IO_*) on fd. With data_fd (an O_DIRECT
+// descriptor of the same image, or -1) file data bypasses the page cache:
+// copy_in() reads whole blocks into aligned buffers and writes them to
+// data_fd. Only the pread and uring backends support it. A backend that
+// cannot start (an old kernel without io_uring, a mapping that fails) falls
+// back to pread; io->ops->name tells which one is in use. Returns -1 with
+// errno set only if no backend could be set up.
+int vsfs_io_open(vsfs_io_t *io, int kind, int fd, int data_fd, int writable, uint64_t size);
+void vsfs_io_close(vsfs_io_t *io);
+
+static inline int io_read(vsfs_io_t *io, void *buf, size_t len, uint64_t off) {
+    return io->ops->read(io, buf, len, off);
+}
+
+static inline int io_writev(vsfs_io_t *io, const struct iovec *iov, int iovcnt, uint64_t off) {
+    return io->ops->writev(io, iov, iovcnt, off);
+}
+
+static inline int io_write(vsfs_io_t *io, const void *buf, size_t len, uint64_t off) {
+    struct iovec iov = { (void *)buf, len };
+    return io->ops->writev(io, &iov, 1, off);
+}
+
+static inline int io_sync(vsfs_io_t *io) {
+    return io->ops->sync(io);
+}
+
+static inline int io_copy_in(vsfs_io_t *io, int src_fd, const io_copy_t *copies, size_t n) {
+    return io->ops->copy_in(io, src_fd, copies, n);
+}
+
+#endif // VSFS_IO_H
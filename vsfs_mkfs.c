@@ -0,0 +1,439 @@
+// vsfs_format(): lay out and write a fresh MiniVSFS image.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "vsfs.h"
+#include "vsfs_internal.h"
+
+typedef struct {
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t group_count;         // 0 without block groups
+    uint64_t inodes_per_group;
+    uint64_t gdt_blocks;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+} layout_t;
+
+// Place the metadata regions for the given size, inode count and number of
+// groups, with gdt_extra spare blocks after the group descriptor table.
+// Bitmaps and the inode table are sized from the request, so both can span
+// many blocks. Without groups, up to 32768 inodes and a 128 MiB data region,
+// this is the classic one-block-each layout (bitmaps in blocks 1 and 2).
+// Returns -1 if the metadata does not fit.
+static int plan_layout(layout_t *l, uint64_t total_blocks, uint64_t inodes, uint64_t group_count,
+                       uint64_t gdt_extra) {
+    memset(l, 0, sizeof(*l));
+    l->total_blocks = total_blocks;
+    l->inode_count = inodes;
+    if (group_count > 0) {
+        uint64_t per = (inodes + group_count - 1) / group_count;
+        l->inodes_per_group = (per + INODES_PER_GROUP_ALIGN - 1) / INODES_PER_GROUP_ALIGN * INODES_PER_GROUP_ALIGN;
+        l->inode_count = l->inodes_per_group * group_count;
+        l->group_count = group_count;
+        l->gdt_blocks = (group_count * sizeof(group_desc_t) + BS - 1) / BS + gdt_extra;
+    }
+    if (l->inode_count > VSFS_MAX_INODES) {
+        return -1;
+    }
+    l->inode_bitmap_start = 1 + l->gdt_blocks;
+    l->inode_bitmap_blocks = (l->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    l->inode_table_blocks = (l->inode_count * INODE_SIZE + BS - 1) / BS;  // Round up
+    uint64_t fixed_blocks = l->inode_bitmap_start + l->inode_bitmap_blocks + l->inode_table_blocks;
+    if (fixed_blocks >= total_blocks) {
+        return -1;
+    }
+    // The data bitmap needs one bit per data block; whatever it does not
+    // take is data region.
+    l->data_bitmap_start = l->inode_bitmap_start + l->inode_bitmap_blocks;
+    l->data_bitmap_blocks = (total_blocks - fixed_blocks + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1);
+    l->inode_table_start = l->data_bitmap_start + l->data_bitmap_blocks;
+    l->data_region_start = l->inode_table_start + l->inode_table_blocks;
+    if (l->data_region_start >= total_blocks) {
+        return -1;
+    }
+    l->data_region_blocks = total_blocks - l->data_region_start;
+    return 0;
+}
+
+// Lay out groups so that their count is group_count_for() the data region
+// that results. The region shrinks as groups are added (descriptors, inodes
+// rounded up per group), so the count is the largest one the layout with
+// that many groups still supports; the scan starts from the count the whole
+// image would give and steps down once per group the metadata displaces.
+// Adding a group can take away more data blocks than it brings, though:
+// then the layout with one group fewer has a region large enough for one
+// more, and the descriptor table is padded until the region is back within
+// its count. Returns -1 if nothing fits.
+static int plan_group_layout(layout_t *l, uint64_t total_blocks, uint64_t inodes) {
+    uint64_t groups = group_count_for(total_blocks);
+    for (;;) {
+        if (plan_layout(l, total_blocks, inodes, groups, 0) == 0 &&
+            group_count_for(l->data_region_blocks) >= groups) {
+            break;
+        }
+        if (groups == 1) {
+            return -1;
+        }
+        groups--;
+    }
+    // each spare block takes at most one block from the data region, so the
+    // count comes down one at a time and stops exactly at groups
+    for (uint64_t extra = 1; group_count_for(l->data_region_blocks) > groups; extra++) {
+        if (plan_layout(l, total_blocks, inodes, groups, extra) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write all of buf at offset, retrying short writes.
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Zero-filling writer. The ranges are cut into ZERO_CHUNK pieces that a pool
+// of threads claims one at a time; each piece goes out as a single pwritev
+// of ZERO_BUF-sized iovecs that all point at one shared, aligned zero
+// buffer. A multi-GB format is then a few hundred syscalls spread over
+// the cores instead of one fwrite per block.
+#define ZERO_BUF (1u << 20)
+#define ZERO_CHUNK (16u << 20)
+#define WRITER_THREADS_MAX 16
+
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+} io_range_t;
+
+typedef struct {
+    int fd;
+    const uint8_t *zero;
+    io_range_t *chunks;
+    size_t count;
+    atomic_size_t next;
+    atomic_int err;
+} zero_writer_t;
+
+static void *zero_worker(void *arg) {
+    zero_writer_t *w = arg;
+    struct iovec iov[ZERO_CHUNK / ZERO_BUF];
+    for (size_t i = 0; i < sizeof(iov) / sizeof(iov[0]); i++) {
+        iov[i].iov_base = (void *)w->zero;
+        iov[i].iov_len = ZERO_BUF;
+    }
+    for (;;) {
+        size_t c = atomic_fetch_add(&w->next, 1);
+        if (c >= w->count || atomic_load(&w->err) != 0) {
+            return NULL;
+        }
+        uint64_t offset = w->chunks[c].offset;
+        uint64_t left = w->chunks[c].len;
+        while (left > 0) {
+            int iovcnt = (int)((left + ZERO_BUF - 1) / ZERO_BUF);
+            iov[iovcnt - 1].iov_len = left % ZERO_BUF ? left % ZERO_BUF : ZERO_BUF;
+            ssize_t n = pwritev(w->fd, iov, iovcnt, (off_t)offset);
+            iov[iovcnt - 1].iov_len = ZERO_BUF;
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                atomic_store(&w->err, n < 0 ? errno : EIO);
+                return NULL;
+            }
+            offset += (uint64_t)n;
+            left -= (uint64_t)n;
+        }
+    }
+}
+
+// Fill the given byte ranges of fd with zeros. Returns 0, or -1 with errno set.
+static int write_zero_ranges(int fd, const io_range_t *ranges, size_t nranges) {
+    size_t count = 0;
+    for (size_t i = 0; i < nranges; i++) {
+        count += (size_t)((ranges[i].len + ZERO_CHUNK - 1) / ZERO_CHUNK);
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    zero_writer_t w = { .fd = fd };
+    uint8_t *zero = NULL;
+    w.chunks = malloc(count * sizeof(io_range_t));
+    if (!w.chunks || posix_memalign((void **)&zero, BS, ZERO_BUF) != 0) {
+        free(w.chunks);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(zero, 0, ZERO_BUF);
+    w.zero = zero;
+    for (size_t i = 0; i < nranges; i++) {
+        for (uint64_t done = 0; done < ranges[i].len; done += ZERO_CHUNK) {
+            uint64_t len = ranges[i].len - done < ZERO_CHUNK ? ranges[i].len - done : ZERO_CHUNK;
+            w.chunks[w.count++] = (io_range_t){ ranges[i].offset + done, len };
+        }
+    }
+    atomic_init(&w.next, 0);
+    atomic_init(&w.err, 0);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+    if (nthreads > WRITER_THREADS_MAX) nthreads = WRITER_THREADS_MAX;
+    if (nthreads > count) nthreads = count;
+
+    pthread_t threads[WRITER_THREADS_MAX];
+    size_t started = 0;
+    while (started + 1 < nthreads && pthread_create(&threads[started], NULL, zero_worker, &w) == 0) {
+        started++;
+    }
+    zero_worker(&w);   // this thread works too
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(zero);
+    free(w.chunks);
+    int err = atomic_load(&w.err);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static pthread_once_t mkfs_once = PTHREAD_ONCE_INIT;
+
+static void mkfs_init(void) {
+    crc32_init();
+}
+
+int vsfs_format(const char *path, const vsfs_format_opts_t *opts, vsfs_info_t *info) {
+    pthread_once(&mkfs_once, mkfs_init);
+
+    uint64_t size_kib = opts->size_kib;
+    uint64_t inodes = opts->inodes;
+    int sparse = (opts->flags & VSFS_FORMAT_SPARSE) != 0;
+    uint32_t flags = 0;
+    if (opts->flags & VSFS_FORMAT_EXTENTS) flags |= SB_FLAG_EXTENTS;
+    if (opts->flags & VSFS_FORMAT_GROUPS) flags |= SB_FLAG_GROUPS;
+    if (opts->flags & VSFS_FORMAT_LAZY_ITABLE) flags |= SB_FLAG_LAZY_ITABLE;
+
+    if (size_kib < VSFS_MIN_SIZE_KIB || size_kib > VSFS_MAX_SIZE_KIB) {
+        vsfs_set_error("size must be between %llu and %" PRIu64, VSFS_MIN_SIZE_KIB, VSFS_MAX_SIZE_KIB);
+        return -1;
+    }
+    if (inodes < VSFS_MIN_INODES || inodes > VSFS_MAX_INODES) {
+        vsfs_set_error("inodes must be between %llu and %" PRIu64, VSFS_MIN_INODES, VSFS_MAX_INODES);
+        return -1;
+    }
+    if (size_kib % 4 != 0) {
+        vsfs_set_error("size must be a multiple of 4");
+        return -1;
+    }
+
+    uint64_t total_blocks = (size_kib * 1024) / BS;
+    layout_t layout;
+    int rc = (flags & SB_FLAG_GROUPS) ? plan_group_layout(&layout, total_blocks, inodes)
+                                      : plan_layout(&layout, total_blocks, inodes, 0, 0);
+    if (rc != 0) {
+        vsfs_set_error("insufficient space for filesystem layout");
+        return -1;
+    }
+    inodes = layout.inode_count;   // rounded up to whole groups
+    uint64_t inode_bitmap_blocks = layout.inode_bitmap_blocks;
+    uint64_t data_bitmap_blocks = layout.data_bitmap_blocks;
+    uint64_t inode_table_blocks = layout.inode_table_blocks;
+    uint64_t data_region_start = layout.data_region_start;
+    uint64_t data_region_blocks = layout.data_region_blocks;
+
+    time_t now = time(NULL);
+
+    // Initialize superblock
+    superblock_t superblock = {0};
+    superblock.magic = VSFS_MAGIC;
+    superblock.version = 1;
+    superblock.block_size = BS;
+    superblock.total_blocks = total_blocks;
+    superblock.inode_count = inodes;
+    superblock.inode_bitmap_start = layout.inode_bitmap_start;
+    superblock.inode_bitmap_blocks = inode_bitmap_blocks;
+    superblock.data_bitmap_start = layout.data_bitmap_start;
+    superblock.data_bitmap_blocks = data_bitmap_blocks;
+    superblock.inode_table_start = layout.inode_table_start;
+    superblock.inode_table_blocks = inode_table_blocks;
+    superblock.data_region_start = data_region_start;
+    superblock.data_region_blocks = data_region_blocks;
+    superblock.root_inode = ROOT_INO;
+    superblock.mtime_epoch = now;
+    superblock.flags = flags;
+
+    // Only a handful of blocks hold anything but zeros: the superblock, the
+    // group descriptors, the first block of each bitmap and of the inode
+    // table, and the root directory block. Build those in one buffer.
+    size_t gdt_bytes = layout.gdt_blocks * BS;
+    uint8_t *meta = NULL;
+    if (posix_memalign((void **)&meta, BS, BS * 5 + gdt_bytes) != 0) {
+        vsfs_set_error("out of memory");
+        return -1;
+    }
+    memset(meta, 0, BS * 5 + gdt_bytes);
+    uint8_t *sb_block = meta;
+    uint8_t *inode_bitmap = meta + BS;
+    uint8_t *data_bitmap = meta + 2 * BS;
+    uint8_t *inode_block = meta + 3 * BS;
+    uint8_t *root_dir_block = meta + 4 * BS;
+    group_desc_t *gdt = (group_desc_t *)(meta + 5 * BS);
+
+    memcpy(sb_block, &superblock, sizeof(superblock_t));
+    if (flags & SB_FLAG_LAZY_ITABLE) {
+        superblock_ext_t ext = {0};
+        ext.itable_initialized = 1;
+        memcpy(sb_block + SB_EXT_OFFSET, &ext, sizeof(ext));
+    }
+    superblock_crc_finalize((superblock_t *)sb_block);   // over the whole block
+
+    // Group descriptor table (blocks 1..gdt_blocks)
+    for (uint64_t g = 0; g < layout.group_count; g++) {
+        group_desc_t *gd = &gdt[g];
+        uint64_t first = g * BLOCKS_PER_GROUP;
+        gd->first_data_block = (uint32_t)(data_region_start + first);
+        gd->data_blocks = (uint32_t)(g + 1 == layout.group_count ? data_region_blocks - first : BLOCKS_PER_GROUP);
+        gd->first_inode = (uint32_t)(g * layout.inodes_per_group + 1);
+        gd->inode_count = (uint32_t)layout.inodes_per_group;
+        gd->inode_table_block = (uint32_t)(layout.inode_table_start + g * layout.inodes_per_group * INODE_SIZE / BS);
+        gd->free_blocks = gd->data_blocks - (g == 0);   // root directory block
+        gd->free_inodes = gd->inode_count - (g == 0);   // root inode
+        group_desc_finalize(gd);
+    }
+
+    inode_bitmap[0] = 0x01;  // Mark inode 1 (root) as allocated
+    data_bitmap[0] = 0x01;  // Mark first data block as allocated for root directory
+
+    inode_t root_inode = {0};
+    root_inode.mode = 040755;
+    root_inode.links = 2;
+    root_inode.size_bytes = 2 * sizeof(dirent64_t);
+    root_inode.atime = now;
+    root_inode.mtime = now;
+    root_inode.ctime = now;
+    root_inode.direct[0] = (uint32_t)data_region_start;  // First data block
+    root_inode.proj_id = 2;
+    inode_crc_finalize(&root_inode);
+
+    // Copy root inode to the block (at position 0 for inode 1)
+    memcpy(inode_block, &root_inode, sizeof(inode_t));
+
+    // "." and ".." entries
+    dirent64_t dot_entry = {0};
+    dot_entry.inode_no = ROOT_INO;
+    dot_entry.type = 2;
+    strcpy(dot_entry.name, ".");
+    dirent_checksum_finalize(&dot_entry);
+
+    dirent64_t dotdot_entry = {0};
+    dotdot_entry.inode_no = ROOT_INO;
+    dotdot_entry.type = 2;
+    strcpy(dotdot_entry.name, "..");
+    dirent_checksum_finalize(&dotdot_entry);
+
+    memcpy(root_dir_block, &dot_entry, sizeof(dirent64_t));
+    memcpy(root_dir_block + sizeof(dirent64_t), &dotdot_entry, sizeof(dirent64_t));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        vsfs_set_error("failed to open image file '%s': %s", path, strerror(errno));
+        free(meta);
+        return -1;
+    }
+
+    // Size the file first so every range can be written independently and
+    // the sparse data region stays a hole on the host filesystem.
+    if (ftruncate(fd, (off_t)(total_blocks * BS)) != 0) {
+        vsfs_set_error("failed to size image: %s", strerror(errno));
+        close(fd);
+        free(meta);
+        return -1;
+    }
+
+    struct {
+        const void *buf;
+        uint64_t block;
+        size_t len;
+        const char *what;
+    } writes[] = {
+        { sb_block, 0, BS, "superblock" },
+        { gdt, 1, gdt_bytes, "group descriptors" },
+        { inode_bitmap, layout.inode_bitmap_start, BS, "inode bitmap" },
+        { data_bitmap, layout.data_bitmap_start, BS, "data bitmap" },
+        { inode_block, layout.inode_table_start, BS, "inode table" },
+        { root_dir_block, data_region_start, BS, "root directory" },
+    };
+    for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        if (writes[i].len && pwrite_full(fd, writes[i].buf, writes[i].len, writes[i].block * BS) != 0) {
+            vsfs_set_error("failed to write %s: %s", writes[i].what, strerror(errno));
+            close(fd);
+            free(meta);
+            return -1;
+        }
+    }
+    free(meta);
+
+    // Everything else is zeros, written by the thread pool
+    io_range_t zeros[] = {
+        { (layout.inode_bitmap_start + 1) * BS, (inode_bitmap_blocks - 1) * BS },
+        { (layout.data_bitmap_start + 1) * BS, (data_bitmap_blocks - 1) * BS },
+        { (layout.inode_table_start + 1) * BS, (flags & SB_FLAG_LAZY_ITABLE) ? 0 : (inode_table_blocks - 1) * BS },
+        { (data_region_start + 1) * BS, sparse ? 0 : (data_region_blocks - 1) * BS },
+    };
+    if (write_zero_ranges(fd, zeros, sizeof(zeros) / sizeof(zeros[0])) != 0) {
+        vsfs_set_error("failed to write image: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (close(fd) != 0) {
+        vsfs_set_error("failed to close image file: %s", strerror(errno));
+        return -1;
+    }
+
+    if (info) {
+        info->total_blocks = total_blocks;
+        info->inode_count = inodes;
+        info->inode_table_blocks = inode_table_blocks;
+        info->data_region_start = data_region_start;
+        info->data_region_blocks = data_region_blocks;
+        info->group_count = layout.group_count;
+        info->inodes_per_group = layout.inodes_per_group;
+    }
+    return 0;
+}